@@ -9,6 +9,30 @@
 #include <string>
 #include <algorithm>
 #include <iomanip>
+#include <sstream>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <deque>
+#include <random>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <filesystem>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <climits>
+#include <chrono>
+#include <cstring>
+#include <cctype>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 using namespace std;
 
@@ -21,136 +45,2446 @@ struct Task {
     int completion_time;
     int wait_time;
     int response_time;
+    int pid;                // bursts with the same pid belong to one process, -1 for none
+    int seq;                // 0-origin line of the task in the input trace
+    int priority;           // static, 0 (highest) to 139
 
-    Task(char id, int arrival, int service) 
+    Task(char id, int arrival, int service, int pid = -1, int seq = 0, int priority = 120) 
     : id(id), arrival_time(arrival), service_time(service),
-      remaining_time(service), start_time(-1), completion_time(0), wait_time(0), response_time(0) {}
+      remaining_time(service), start_time(-1), completion_time(0), wait_time(0), response_time(0), pid(pid), seq(seq),
+      priority(priority) {}
 
 };
 
-void simulate_fifo(vector<Task>& tasks);
-void simulate_sjf(vector<Task>& tasks);
-void simulate_rr(vector<Task>& tasks);
+// Engine state at the top of a tick, before that tick's arrivals are queued.
+// Tasks are referred to by their index in the arrival-sorted task vector.
+struct EngineState {
+    int time = 0;
+    int next_arrival = 0;   // index of the next task to arrive
+    int current = -1;       // running task, -1 when the CPU is idle
+    int start_time = 0;     // fifo: tick the running task was dispatched
+    int time_slice = 0;     // rr: ticks left in the running task's quantum
+    int switching = 0;      // rr: context-switch ticks left before the running task resumes
+    vector<int> ready;      // ready queue front to back (heap order for sjf)
+};
+
+// Receives the engine state at every checkpoint tick instead of the snapshot file
+struct SnapshotObserver {
+    virtual ~SnapshotObserver() {}
+    // Return false to end the run at this tick
+    virtual bool at_snapshot(const vector<Task>& tasks, const EngineState& state) = 0;
+};
+
+// Periodic snapshots of the engine to a binary file, and the state to resume from.
+// Snapshots are written by a forked child so the simulation only pauses for the fork;
+// if the previous writer is still busy the snapshot is skipped instead of waited on.
+struct Checkpointer {
+    string path;
+    int interval = 0;
+    char policy = 0;
+    int quantum = 1;        // rr settings, saved so a resume runs with the same ones
+    int switch_cost = 0;
+    bool resuming = false;
+    EngineState resume_state;
+    pid_t writer = -1;
+    SnapshotObserver* observer = nullptr;
+
+    bool due(int time) const { return interval > 0 && time > 0 && time % interval == 0; }
+    bool save(const vector<Task>& tasks, const EngineState& state);
+    void finish();
+};
+
+// priority_queue that exposes its heap array, so a checkpoint can save and restore
+// the exact layout and ties keep popping in the same order after a resume
+template <class Compare>
+struct TaskHeap : priority_queue<Task*, vector<Task*>, Compare> {
+    explicit TaskHeap(Compare comp) : priority_queue<Task*, vector<Task*>, Compare>(comp) {}
+    using priority_queue<Task*, vector<Task*>, Compare>::c;
+};
+
+// Hot-path counters for the engines; build with -DSIM_STATS=0 to compile them out.
+// Phase timers are always kept since they cost a clock read per phase.
+#ifndef SIM_STATS
+#define SIM_STATS 1
+#endif
+#define STAT(statement) do { if (SIM_STATS) { statement; } } while (0)
+
+struct SimStats {
+    long long events = 0;       // arrivals, dispatches, preemptions and completions
+    long long pushes = 0;
+    long long pops = 0;
+    long long peak_queue = 0;
+    long long trace_bytes = 0;
+    double parse_ms = 0, sort_ms = 0, loop_ms = 0, report_ms = 0;
+
+    void add(const SimStats& other) {
+        events += other.events;
+        pushes += other.pushes;
+        pops += other.pops;
+        peak_queue = max(peak_queue, other.peak_queue);
+        trace_bytes += other.trace_bytes;
+        parse_ms += other.parse_ms;
+        sort_ms += other.sort_ms;
+        loop_ms += other.loop_ms;
+        report_ms += other.report_ms;
+    }
+};
+
+// Per thread so batch workers can run engines side by side
+thread_local SimStats stats;
+
+// Counts the bytes of trace output written through a stream while it is alive
+class TraceCounter : public streambuf {
+public:
+    explicit TraceCounter(ostream& out) : out(out), dest(out.rdbuf()) { if (SIM_STATS && dest) out.rdbuf(this); }
+    ~TraceCounter() { stop(); }
+    void stop() {
+        if (SIM_STATS && dest) {
+            out.rdbuf(dest);
+            stats.trace_bytes += count;
+            dest = nullptr;
+        }
+    }
+protected:
+    int overflow(int c) override {
+        if (c == EOF) return 0;
+        count++;
+        return dest->sputc(c);
+    }
+    streamsize xsputn(const char* s, streamsize n) override {
+        count += n;
+        return dest->sputn(s, n);
+    }
+    int sync() override { return dest->pubsync(); }
+private:
+    ostream& out;
+    streambuf* dest;
+    long long count = 0;
+};
+
+static double elapsed_ms(chrono::steady_clock::time_point since) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - since).count();
+}
+
+void print_stats(const SimStats& stats);
+
+// Binary min-heap of task indices that remembers each task's slot, so a task whose
+// key changes while it waits is sifted in place instead of rebuilding the heap.
+// Ties go to the lower index, i.e. the earlier arrival.
+class IndexedHeap {
+public:
+    IndexedHeap(const vector<double>& key) : key(key), pos(key.size(), -1) {}
+
+    bool empty() const { return heap.empty(); }
+    size_t size() const { return heap.size(); }
+    int top() const { return heap[0]; }
+    bool contains(int task) const { return pos[task] >= 0; }
+    const vector<int>& items() const { return heap; }
+
+    void push(int task) {
+        pos[task] = heap.size();
+        heap.push_back(task);
+        sift_up(pos[task]);
+    }
+
+    int pop() {
+        int task = heap[0];
+        swap_slots(0, heap.size() - 1);
+        heap.pop_back();
+        pos[task] = -1;
+        if (!heap.empty()) sift_down(0);
+        return task;
+    }
+
+    // Call after key[task] was lowered
+    void decrease_key(int task) { sift_up(pos[task]); }
+    // Call after key[task] was raised
+    void increase_key(int task) { sift_down(pos[task]); }
+
+private:
+    bool before(int a, int b) const { return key[a] < key[b] || (key[a] == key[b] && a < b); }
+
+    void swap_slots(int i, int j) {
+        swap(heap[i], heap[j]);
+        pos[heap[i]] = i;
+        pos[heap[j]] = j;
+    }
+
+    void sift_up(int i) {
+        while (i > 0 && before(heap[i], heap[(i - 1) / 2])) {
+            swap_slots(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    void sift_down(int i) {
+        int n = heap.size();
+        while (true) {
+            int best = i, left = 2 * i + 1, right = left + 1;
+            if (left < n && before(heap[left], heap[best])) best = left;
+            if (right < n && before(heap[right], heap[best])) best = right;
+            if (best == i) return;
+            swap_slots(i, best);
+            i = best;
+        }
+    }
+
+    const vector<double>& key;
+    vector<int> heap;
+    vector<int> pos;
+};
+
+// Ready set for priority scheduling with aging. A waiting task gains one level per
+// epoch it waits, so its key, static priority + the epoch it was queued in, stays
+// fixed while it waits and the ready set is ordered by key alone; nothing is touched
+// as tasks age. Keys live in a circular window of FIFO buckets with a bitmap of the
+// non-empty ones. When the epoch advances, the bucket that fell behind it holds tasks
+// that reached the top level and is spliced onto the front of the new first bucket.
+class PriorityArray {
+public:
+    static const int LEVELS = 140;      // 0 is the highest priority
+    static const int BUCKETS = 192;     // more than LEVELS, in three bitmap words
+
+    explicit PriorityArray(int tasks) : next(tasks, -1), prev(tasks, -1) {
+        fill(head, head + BUCKETS, -1);
+        fill(tail, tail + BUCKETS, -1);
+    }
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+    // Queues a task at the back of its level for the current epoch
+    void push(int task, int priority) {
+        int b = (base + priority) % BUCKETS;
+        next[task] = -1;
+        prev[task] = tail[b];
+        if (tail[b] >= 0) next[tail[b]] = task;
+        else head[b] = task;
+        tail[b] = task;
+        bits[b / 64] |= 1ULL << (b % 64);
+        count++;
+    }
+
+    // Effective level of the best waiting task, 0 for any that have fully aged
+    int top_level() const { return (first() - base % BUCKETS + BUCKETS) % BUCKETS; }
+
+    int pop() {
+        int b = first();
+        int task = head[b];
+        head[b] = next[task];
+        if (head[b] >= 0) prev[head[b]] = -1;
+        else {
+            tail[b] = -1;
+            bits[b / 64] &= ~(1ULL << (b % 64));
+        }
+        count--;
+        return task;
+    }
+
+    void advance(long long epoch) {
+        if (count == 0) base = max(base, epoch);
+        for (; base < epoch; base++) {
+            int from = base % BUCKETS, to = (base + 1) % BUCKETS;
+            if (head[from] < 0) continue;
+            if (head[to] >= 0) {
+                next[tail[from]] = head[to];
+                prev[head[to]] = tail[from];
+            } else {
+                tail[to] = tail[from];
+                bits[to / 64] |= 1ULL << (to % 64);
+            }
+            head[to] = head[from];
+            head[from] = tail[from] = -1;
+            bits[from / 64] &= ~(1ULL << (from % 64));
+        }
+    }
+
+    // Waiting tasks best first
+    vector<int> items() const {
+        vector<int> order;
+        for (int offset = 0; offset < BUCKETS; offset++) {
+            for (int task = head[(base + offset) % BUCKETS]; task >= 0; task = next[task]) order.push_back(task);
+        }
+        return order;
+    }
+
+private:
+    // First non-empty bucket at or after the current epoch's, wrapping around
+    int first() const {
+        int start = base % BUCKETS;
+        for (int k = 0; k <= BUCKETS / 64; k++) {
+            int w = (start / 64 + k) % (BUCKETS / 64);
+            uint64_t word = bits[w];
+            if (k == 0) word &= ~0ULL << (start % 64);
+            else if (k == BUCKETS / 64) word &= ~(~0ULL << (start % 64));
+            if (word) return w * 64 + __builtin_ctzll(word);
+        }
+        return -1;
+    }
+
+    vector<int> next, prev;
+    int head[BUCKETS], tail[BUCKETS];
+    uint64_t bits[BUCKETS / 64] = {};
+    long long base = 0;         // current epoch
+    size_t count = 0;
+};
+
+bool write_snapshot(const string& path, const Checkpointer& ckpt, const vector<Task>& tasks, const EngineState& state);
+bool read_snapshot(const string& path, Checkpointer& ckpt, vector<Task>& tasks);
+bool export_csv(const string& path, const vector<Task>& tasks);
+bool export_columns(const string& path, const vector<Task>& tasks);
+
+// Settings of the policies that take parameters
+struct PolicyOptions {
+    double alpha = 0.5;             // srtf
+    double tau0 = 10;
+    vector<double> speeds = { 1 };  // hetero
+    double short_service = -1;
+    int quantum = 1;                // rr
+    int switch_cost = 0;
+    int age = 10;                   // prio: ticks per level of aging
+};
+
+// Aggregates of one finished run, summable across traces
+struct TraceSummary {
+    long long tasks = 0;
+    long long makespan = 0;
+    long long wait_sum = 0, response_sum = 0, turnaround_sum = 0;
+    long long max_wait = 0;
+
+    void add(const TraceSummary& other) {
+        tasks += other.tasks;
+        makespan = max(makespan, other.makespan);
+        wait_sum += other.wait_sum;
+        response_sum += other.response_sum;
+        turnaround_sum += other.turnaround_sum;
+        max_wait = max(max_wait, other.max_wait);
+    }
+};
+
+bool read_tasks(istream& in, vector<Task>& tasks);
+bool read_sched_trace(const string& path, int jobs, double tick_us, vector<Task>& tasks);
+TraceSummary summarize(const vector<Task>& tasks);
+int run_batch(const string& source, int jobs, char policy, const PolicyOptions& options, SimStats& total);
+int run_compare(const vector<Task>& tasks, const PolicyOptions& options, SimStats& total);
+bool parse_quanta(const string& spec, vector<int>& quanta);
+int run_tune(vector<Task>& tasks, const PolicyOptions& options, bool p99, const vector<int>& quanta, int jobs,
+             SimStats& total);
+int run_whatif(const vector<Task>& input, char policy, const PolicyOptions& options, const string& query_path, int interval,
+               bool verify);
+
+void run_policy(char policy, vector<Task>& tasks, Checkpointer& ckpt, const PolicyOptions& options, ostream& out);
+void simulate_fifo(vector<Task>& tasks, Checkpointer& ckpt, ostream& out);
+void simulate_sjf(vector<Task>& tasks, Checkpointer& ckpt, ostream& out);
+void simulate_rr(vector<Task>& tasks, Checkpointer& ckpt, int quantum, int switch_cost, ostream& out);
+void simulate_srtf(vector<Task>& tasks, double alpha, double tau0, ostream& out);
+void simulate_prio(vector<Task>& tasks, int age, ostream& out);
+bool parse_cores(const string& spec, vector<double>& speeds);
+void simulate_hetero(vector<Task>& tasks, const vector<double>& speeds, double short_service, ostream& out);
+int run_cluster(int servers, const string& route, int choices, unsigned long long seed, char policy);
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        cerr << "Usage: " << argv[0] << " -fifo | -sjf | -rr\n";
+    string policy;
+    Checkpointer ckpt;
+    string resume_path;
+    bool show_stats = false;
+    PolicyOptions options;
+    string batch_source;
+    int jobs = thread::hardware_concurrency();
+    string whatif_path;
+    int whatif_interval = 1000;
+    bool whatif_verify = false;
+    string sched_path;
+    double tick_us = 1000;
+    int cluster_servers = 0;
+    string route = "jsq";
+    int choices = 2;
+    unsigned long long seed = 1;
+    string objective;
+    vector<int> quanta = { 1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64 };
+    string csv_path, columns_path;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-stats") {
+            show_stats = true;
+        } else if (arg == "-checkpoint" && i + 2 < argc) {
+            ckpt.path = argv[++i];
+            ckpt.interval = atoi(argv[++i]);
+        } else if (arg == "-resume" && i + 1 < argc) {
+            resume_path = argv[++i];
+        } else if (arg == "-alpha" && i + 1 < argc) {
+            options.alpha = atof(argv[++i]);
+        } else if (arg == "-tau0" && i + 1 < argc) {
+            options.tau0 = atof(argv[++i]);
+        } else if (arg == "-cores" && i + 1 < argc) {
+            if (!parse_cores(argv[++i], options.speeds)) options.speeds.clear();
+        } else if (arg == "-short" && i + 1 < argc) {
+            options.short_service = atof(argv[++i]);
+        } else if (arg == "-batch" && i + 1 < argc) {
+            batch_source = argv[++i];
+        } else if (arg == "-jobs" && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (arg == "-sched" && i + 1 < argc) {
+            sched_path = argv[++i];
+        } else if (arg == "-tick" && i + 1 < argc) {
+            tick_us = atof(argv[++i]);
+        } else if (arg == "-whatif" && i + 1 < argc) {
+            whatif_path = argv[++i];
+        } else if (arg == "-every" && i + 1 < argc) {
+            whatif_interval = atoi(argv[++i]);
+        } else if (arg == "-verify") {
+            whatif_verify = true;
+        } else if (arg == "-age" && i + 1 < argc) {
+            options.age = atoi(argv[++i]);
+        } else if (arg == "-quantum" && i + 1 < argc) {
+            options.quantum = atoi(argv[++i]);
+        } else if (arg == "-switch" && i + 1 < argc) {
+            options.switch_cost = atoi(argv[++i]);
+        } else if (arg == "-tune" && i + 1 < argc) {
+            objective = argv[++i];
+        } else if (arg == "-quanta" && i + 1 < argc) {
+            if (!parse_quanta(argv[++i], quanta)) quanta.clear();
+        } else if (arg == "-csv" && i + 1 < argc) {
+            csv_path = argv[++i];
+        } else if (arg == "-columns" && i + 1 < argc) {
+            columns_path = argv[++i];
+        } else if (arg == "-cluster" && i + 1 < argc) {
+            cluster_servers = atoi(argv[++i]);
+        } else if (arg == "-route" && i + 1 < argc) {
+            route = argv[++i];
+        } else if (arg == "-choices" && i + 1 < argc) {
+            choices = atoi(argv[++i]);
+        } else if (arg == "-seed" && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 10);
+        } else if (policy.empty() && arg[0] == '-') {
+            policy = arg;
+        } else {
+            policy = "?";
+        }
+    }
+
+    if ((policy.empty() && resume_path.empty()) || (!ckpt.path.empty() && ckpt.interval <= 0)
+        || options.alpha < 0 || options.alpha > 1 || options.tau0 < 0 || options.speeds.empty()
+        || whatif_interval <= 0 || (whatif_verify && whatif_path.empty()) || tick_us <= 0 || cluster_servers < 0 || choices < 1
+        || (route != "random" && route != "roundrobin" && route != "jsq" && route != "pod")
+        || options.quantum < 1 || options.age < 0 || options.switch_cost < 0 || quanta.empty()
+        || (!objective.empty() && objective != "wait" && objective != "p99")) {
+        cerr << "Usage: " << argv[0] << " -fifo | -sjf | -rr [-checkpoint file ticks] [-stats]\n";
+        cerr << "       " << argv[0] << " -rr [-quantum ticks] [-switch ticks] [-checkpoint file ticks] [-stats]\n";
+        cerr << "       " << argv[0] << " -resume file [-checkpoint file ticks] [-stats]\n";
+        cerr << "       " << argv[0] << " -srtf [-alpha a] [-tau0 ticks] [-stats]\n";
+        cerr << "       " << argv[0] << " -prio [-age ticks] [-stats]\n";
+        cerr << "       " << argv[0] << " -hetero -cores speed[*count],... [-short ticks] [-stats]\n";
+        cerr << "       " << argv[0] << " <policy> -batch directory|listfile [-jobs n] [-stats]\n";
+        cerr << "       " << argv[0] << " -fifo | -sjf | -rr -whatif queryfile [-every ticks] [-verify] [-stats]\n";
+        cerr << "       " << argv[0] << " <policy> | -compare [-sched tracefile [-tick usec] [-jobs n]] [-stats]\n";
+        cerr << "       " << argv[0] << " -fifo | -sjf | -rr -cluster servers [-route random|roundrobin|jsq|pod]\n";
+        cerr << "           [-choices d] [-seed n] [-stats]\n";
+        cerr << "       " << argv[0] << " -rr -tune wait|p99 [-quanta q,q,...] [-switch ticks] [-jobs n] [-stats]\n";
+        cerr << "a single run also takes [-csv file] [-columns file] to export per-task results\n";
+        cerr << "input lines are: arrival service [pid [priority]], priority 0 (highest) to 139, default 120\n";
+        cerr << "-sched reads a perf sched or ftrace sched_switch text dump instead, in ticks of usec (1000)\n";
+        cerr << "what-if lines are: line arrival service, queries separated by a blank line\n";
         return 1;
     }
 
-    string policy = argv[1];
-    vector<Task> tasks;
-    int arrival, service;
-    char id = 'A';
+    if (!sched_path.empty() && (!resume_path.empty() || !batch_source.empty())) {
+        cerr << "-sched does not combine with -resume or -batch\n";
+        return 1;
+    }
+
+    if (cluster_servers > 0 && (!ckpt.path.empty() || !resume_path.empty() || !batch_source.empty()
+                                || !whatif_path.empty() || !sched_path.empty() || !objective.empty())) {
+        cerr << "Cluster mode streams stdin and does not combine with other modes\n";
+        return 1;
+    }
 
-    while (cin >> arrival >> service) {
-        tasks.emplace_back(id++, arrival, service);
+    vector<Task> tasks;
+    auto phase = chrono::steady_clock::now();
+
+    if (!resume_path.empty()) {
+        // The snapshot carries the policy, its rr settings and the whole task set, so
+        // stdin is not read and -quantum and -switch are ignored
+        if (!read_snapshot(resume_path, ckpt, tasks)) {
+            cerr << "Invalid checkpoint file: " << resume_path << "\n";
+            return 1;
+        }
+        string saved = ckpt.policy == 'f' ? "-fifo" : ckpt.policy == 's' ? "-sjf" : "-rr";
+        if (!policy.empty() && policy != saved) {
+            cerr << "Checkpoint was taken with " << saved << "\n";
+            return 1;
+        }
+        policy = saved;
+        options.quantum = ckpt.quantum;
+        options.switch_cost = ckpt.switch_cost;
+        ckpt.resuming = true;
+    } else if (!sched_path.empty()) {
+        if (!read_sched_trace(sched_path, max(jobs, 1), tick_us, tasks)) {
+            cerr << "Cannot read sched trace: " << sched_path << "\n";
+            return 1;
+        }
+    } else if (batch_source.empty() && cluster_servers == 0) {
+        if (!read_tasks(cin, tasks)) return 1;
     }
+    stats.parse_ms = elapsed_ms(phase);
 
-    if (policy == "-fifo") simulate_fifo(tasks);
-    else if (policy == "-sjf") simulate_sjf(tasks);
-    else if (policy == "-rr") simulate_rr(tasks);
+    if (policy == "-fifo") ckpt.policy = 'f';
+    else if (policy == "-sjf") ckpt.policy = 's';
+    else if (policy == "-rr") ckpt.policy = 'r';
+    else if (policy == "-srtf") ckpt.policy = 'p';
+    else if (policy == "-hetero") ckpt.policy = 'h';
+    else if (policy == "-prio") ckpt.policy = 'a';
+    else if (policy == "-compare") ckpt.policy = 'c';
 
     // error handling
     else {
         cerr << "Invalid scheduling policy\n";
         return 1;
     }
+    ckpt.quantum = options.quantum;
+    ckpt.switch_cost = options.switch_cost;
+
+    if ((ckpt.policy == 'p' || ckpt.policy == 'h' || ckpt.policy == 'a' || ckpt.policy == 'c') && !ckpt.path.empty()) {
+        cerr << "Checkpointing supports -fifo, -sjf and -rr only\n";
+        return 1;
+    }
+
+    if ((!csv_path.empty() || !columns_path.empty())
+        && (cluster_servers > 0 || !objective.empty() || !batch_source.empty() || !whatif_path.empty() || ckpt.policy == 'c')) {
+        cerr << "-csv and -columns export a single run\n";
+        return 1;
+    }
+
+    if (cluster_servers > 0) {
+        if (ckpt.policy != 'f' && ckpt.policy != 's' && ckpt.policy != 'r') {
+            cerr << "Cluster servers run -fifo, -sjf or -rr\n";
+            return 1;
+        }
+        if (options.quantum != 1 || options.switch_cost != 0) {
+            cerr << "Cluster rr servers use a quantum of 1 and no switch cost\n";
+            return 1;
+        }
+        int status = run_cluster(cluster_servers, route, choices, seed, ckpt.policy);
+        if (show_stats) print_stats(stats);
+        return status;
+    }
+
+    if (!objective.empty()) {
+        if (ckpt.policy != 'r' || !ckpt.path.empty() || ckpt.resuming || !batch_source.empty() || !whatif_path.empty()) {
+            cerr << "The tuner runs -rr alone, on a trace from stdin or -sched\n";
+            return 1;
+        }
+        SimStats total = stats;
+        int status = run_tune(tasks, options, objective == "p99", quanta, max(jobs, 1), total);
+        if (show_stats) print_stats(total);
+        return status;
+    }
+
+    if (!batch_source.empty()) {
+        if (ckpt.policy == 'c') {
+            cerr << "Batch mode runs a single policy\n";
+            return 1;
+        }
+        if (!ckpt.path.empty() || ckpt.resuming || !whatif_path.empty()) {
+            cerr << "Batch mode does not checkpoint, resume or what-if\n";
+            return 1;
+        }
+        SimStats total;
+        int status = run_batch(batch_source, max(jobs, 1), ckpt.policy, options, total);
+        if (show_stats) print_stats(total);
+        return status;
+    }
+
+    if (!whatif_path.empty()) {
+        if (!ckpt.path.empty() || ckpt.resuming) {
+            cerr << "What-if mode does not checkpoint or resume\n";
+            return 1;
+        }
+        if (ckpt.policy != 'f' && ckpt.policy != 's' && ckpt.policy != 'r') {
+            cerr << "What-if supports -fifo, -sjf and -rr only\n";
+            return 1;
+        }
+        int status = run_whatif(tasks, ckpt.policy, options, whatif_path, whatif_interval, whatif_verify);
+        if (show_stats) print_stats(stats);
+        return status;
+    }
+
+    if (ckpt.policy == 'c') {
+        SimStats total = stats;
+        int status = run_compare(tasks, options, total);
+        if (show_stats) print_stats(total);
+        return status;
+    }
+
+    run_policy(ckpt.policy, tasks, ckpt, options, cout);
+
+    phase = chrono::steady_clock::now();
+    if (!csv_path.empty() && !export_csv(csv_path, tasks)) {
+        cerr << "Failed to write " << csv_path << "\n";
+        return 1;
+    }
+    if (!columns_path.empty() && !export_columns(columns_path, tasks)) {
+        cerr << "Failed to write " << columns_path << "\n";
+        return 1;
+    }
+    stats.report_ms += elapsed_ms(phase);
+
+    if (show_stats) print_stats(stats);
 
     return 0;
 }
 
-void simulate_fifo(vector<Task>& tasks) {
-    int time = 0, start_time = 0;
-    queue<Task*> task_queue;
-    vector<Task>::iterator it = tasks.begin();
-    Task* current_task = nullptr; 
-    bool hasRemainingTasks = it != tasks.end();
-    bool isQueueNotEmpty = !task_queue.empty();
-    bool isProcessingTask = current_task != nullptr;
+// Reads "arrival service [pid [priority]]" lines, skipping blank ones. Priorities are
+// clamped to 0..139 and default to 120. Any other line is reported and fails the read.
+bool read_tasks(istream& in, vector<Task>& tasks) {
+    int arrival, service, pid, priority;
+    char id = 'A';
+    string line;
+    int number = 0;
+
+    while (getline(in, line)) {
+        number++;
+        if (line.find_first_not_of(" \t\r") == string::npos) continue;
+        istringstream fields(line);
+        if (!(fields >> arrival >> service)) {
+            cerr << "Invalid task on line " << number << ": " << line << "\n";
+            return false;
+        }
+        if (!(fields >> pid)) pid = -1;
+        if (!(fields >> priority)) priority = 120;
+        if (!fields.eof() && !(fields >> ws).eof()) {
+            cerr << "Invalid task on line " << number << ": " << line << "\n";
+            return false;
+        }
+        priority = min(max(priority, 0), PriorityArray::LEVELS - 1);
+        tasks.emplace_back(id++, arrival, service, pid, tasks.size(), priority);
+    }
+    return true;
+}
+
+// One scheduler event from an ftrace or perf sched text dump
+struct SchedEvent {
+    long long ns;       // timestamp
+    int pid;            // switch: task leaving the cpu, wakeup: task woken
+    int next_pid;       // switch: task entering the cpu, -1 for a wakeup
+    bool runnable;      // switch: the leaving task was preempted rather than blocked
+};
+
+static const char* find_text(const char* begin, const char* end, const char* text) {
+    return search(begin, end, text, text + strlen(text));
+}
+
+static bool parse_int(const char* p, const char* end, int& value) {
+    if (p >= end || !isdigit((unsigned char)*p)) return false;
+    value = 0;
+    while (p < end && isdigit((unsigned char)*p)) value = value * 10 + (*p++ - '0');
+    return true;
+}
+
+// Parses the number that ends just before p
+static bool parse_int_before(const char* begin, const char* p, int& value) {
+    const char* digits = p;
+    while (digits > begin && isdigit((unsigned char)digits[-1])) digits--;
+    return parse_int(digits, p, value);
+}
+
+// The "secs.usecs:" field just before the event name; perf puts "sched:" between them
+static bool parse_timestamp(const char* begin, const char* event, long long& ns) {
+    const char* p = event;
+    while (p > begin && p[-1] == ' ') p--;
+    if (p - begin >= 6 && equal(p - 6, p, "sched:")) p -= 6;
+    while (p > begin && p[-1] == ' ') p--;
+    if (p == begin || p[-1] != ':') return false;
+    const char* end = --p;
+    while (p > begin && (isdigit((unsigned char)p[-1]) || p[-1] == '.')) p--;
+
+    long long secs = 0, frac = 0;
+    int digits = 0;
+    for (; p < end && *p != '.'; p++) secs = secs * 10 + (*p - '0');
+    if (p < end) p++;
+    for (; p < end && digits < 9; p++, digits++) frac = frac * 10 + (*p - '0');
+    if (p != end) return false;
+    for (; digits < 9; digits++) frac *= 10;
+    ns = secs * 1000000000LL + frac;
+    return true;
+}
+
+// Accepts the key=value field format of ftrace and perf script, and the compact
+//   prev_comm:prev_pid [prio] state ==> next_comm:next_pid [prio]
+//   comm:pid [prio] success=1 CPU:nnn
+// format of older perf. Lines with other events are skipped.
+static void parse_sched_line(const char* begin, const char* end, vector<SchedEvent>& events) {
+    if (begin == end || *begin == '#') return;
+
+    SchedEvent ev;
+    const char* event = find_text(begin, end, "sched_switch:");
+    if (event != end) {
+        const char* fields = event + 13;
+        const char* prev = find_text(fields, end, "prev_pid=");
+        if (prev != end) {
+            const char* state = find_text(prev, end, "prev_state=");
+            const char* next = find_text(prev, end, "next_pid=");
+            if (state == end || next == end || state + 11 == end) return;
+            if (!parse_int(prev + 9, end, ev.pid) || !parse_int(next + 9, end, ev.next_pid)) return;
+            ev.runnable = state[11] == 'R';
+        } else {
+            const char* arrow = find_text(fields, end, " ==> ");
+            const char* prev_prio = find_end(fields, arrow, " [", " [" + 2);
+            const char* next_prio = find_end(arrow, end, " [", " [" + 2);
+            const char* state = find_text(prev_prio, arrow, "] ");
+            if (arrow == end || prev_prio == arrow || next_prio == end || state + 2 >= arrow) return;
+            if (!parse_int_before(fields, prev_prio, ev.pid) || !parse_int_before(arrow, next_prio, ev.next_pid)) return;
+            ev.runnable = state[2] == 'R';
+        }
+    } else {
+        // sched_waking, sched_wakeup and sched_wakeup_new all open a burst
+        event = find_text(begin, end, "sched_wak");
+        const char* fields = find(event, end, ':');
+        if (fields == end) return;
+        const char* pid = find_text(fields, end, " pid=");
+        if (pid != end) {
+            if (!parse_int(pid + 5, end, ev.pid)) return;
+        } else {
+            const char* prio = find_text(fields, end, " [");
+            if (prio == end || !parse_int_before(fields, prio, ev.pid)) return;
+        }
+        ev.next_pid = -1;
+        ev.runnable = true;
+    }
+    if (parse_timestamp(begin, event, ev.ns)) events.push_back(ev);
+}
+
+// Turns a sched_switch dump into tasks: a burst opens when a pid is woken (or first
+// switched in) and closes when it switches out blocked. Its arrival is the wakeup and
+// its service the on-cpu time in between, both in ticks of tick_us microseconds.
+// The file is mapped and split into one chunk per job at line boundaries, and the
+// chunks are parsed in parallel; only the pass over the merged events is serial.
+bool read_sched_trace(const string& path, int jobs, double tick_us, vector<Task>& tasks) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = info.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    madvise(map, size, MADV_SEQUENTIAL);
+    const char* data = (const char*)map;
+
+    jobs = max<size_t>(1, min<size_t>(jobs, size / (1 << 20) + 1));
+    vector<vector<SchedEvent>> chunks(jobs);
+    vector<thread> workers;
+    // A chunk owns the lines that start inside its byte range
+    auto line_start = [&](int j) {
+        if (j == 0) return data;
+        const char* newline = find(data + size * j / jobs - 1, data + size, '\n');
+        return newline == data + size ? newline : newline + 1;
+    };
+    for (int j = 0; j < jobs; j++) {
+        workers.emplace_back([&, j]() {
+            const char* begin = line_start(j);
+            const char* end = j + 1 < jobs ? line_start(j + 1) : data + size;
+            while (begin < end) {
+                const char* eol = find(begin, end, '\n');
+                parse_sched_line(begin, eol, chunks[j]);
+                begin = eol + 1;
+            }
+        });
+    }
+    for (thread& t : workers) t.join();
+
+    vector<SchedEvent> events;
+    size_t count = 0;
+    for (const auto& chunk : chunks) count += chunk.size();
+    events.reserve(count);
+    for (auto& chunk : chunks) {
+        events.insert(events.end(), chunk.begin(), chunk.end());
+        vector<SchedEvent>().swap(chunk);
+    }
+    munmap(map, size);
+
+    // Dumps are in time order already apart from per-cpu buffer interleaving
+    auto earlier = [](const SchedEvent& a, const SchedEvent& b) { return a.ns < b.ns; };
+    if (!is_sorted(events.begin(), events.end(), earlier)) {
+        stable_sort(events.begin(), events.end(), earlier);
+    }
+    if (events.empty()) return true;
+
+    struct Burst {
+        long long arrival = -1;     // -1 while the pid is asleep
+        long long on_cpu = 0;
+        long long since = -1;       // switch-in time while on the cpu
+    };
+    struct Done {
+        long long arrival, on_cpu;
+        int pid;
+    };
+    unordered_map<int, Burst> bursts;
+    vector<Done> done;
+
+    for (const SchedEvent& ev : events) {
+        if (ev.next_pid < 0) {
+            Burst& burst = bursts[ev.pid];
+            if (burst.arrival < 0) burst.arrival = ev.ns;
+            continue;
+        }
+        // pid 0 is the idle task
+        if (ev.pid != 0) {
+            Burst& burst = bursts[ev.pid];
+            if (burst.since >= 0) burst.on_cpu += ev.ns - burst.since;
+            burst.since = -1;
+            if (!ev.runnable && burst.arrival >= 0) {
+                if (burst.on_cpu > 0) done.push_back({ burst.arrival, burst.on_cpu, ev.pid });
+                burst = Burst();
+            }
+        }
+        if (ev.next_pid != 0) {
+            Burst& burst = bursts[ev.next_pid];
+            if (burst.arrival < 0) burst.arrival = ev.ns;
+            burst.since = ev.ns;
+        }
+    }
+    // Bursts still open when the trace stops end there
+    long long last = events.back().ns;
+    for (auto& entry : bursts) {
+        Burst& burst = entry.second;
+        if (burst.since >= 0) burst.on_cpu += last - burst.since;
+        if (burst.arrival >= 0 && burst.on_cpu > 0) done.push_back({ burst.arrival, burst.on_cpu, entry.first });
+    }
+
+    stable_sort(done.begin(), done.end(), [](const Done& a, const Done& b) {
+        return a.arrival < b.arrival || (a.arrival == b.arrival && a.pid < b.pid);
+    });
+    long long origin = events.front().ns;
+    long long tick_ns = max(1LL, llround(tick_us * 1000));
+    char id = 'A';
+    tasks.reserve(tasks.size() + done.size());
+    for (const Done& burst : done) {
+        int arrival = (burst.arrival - origin) / tick_ns;
+        int service = max(1LL, (burst.on_cpu + tick_ns / 2) / tick_ns);
+        tasks.emplace_back(id++, arrival, service, burst.pid, tasks.size());
+    }
+    return true;
+}
+
+void run_policy(char policy, vector<Task>& tasks, Checkpointer& ckpt, const PolicyOptions& options, ostream& out) {
+    if (policy == 'f') simulate_fifo(tasks, ckpt, out);
+    else if (policy == 's') simulate_sjf(tasks, ckpt, out);
+    else if (policy == 'r') simulate_rr(tasks, ckpt, options.quantum, options.switch_cost, out);
+    else if (policy == 'p') simulate_srtf(tasks, options.alpha, options.tau0, out);
+    else if (policy == 'a') simulate_prio(tasks, options.age, out);
+    else simulate_hetero(tasks, options.speeds, options.short_service, out);
+}
+
+TraceSummary summarize(const vector<Task>& tasks) {
+    TraceSummary summary;
+    summary.tasks = tasks.size();
+    for (const Task& task : tasks) {
+        summary.makespan = max(summary.makespan, (long long)task.completion_time);
+        summary.wait_sum += task.wait_time;
+        summary.response_sum += task.response_time;
+        summary.turnaround_sum += task.completion_time - task.arrival_time;
+        summary.max_wait = max(summary.max_wait, (long long)task.wait_time);
+    }
+    return summary;
+}
+
+// Runs one policy over many trace files on a pool of worker threads. The source is
+// a directory (every regular file in it) or a file listing one trace path per line.
+// Each worker holds a single trace at a time and keeps only its summary row, so memory
+// grows with the number of workers rather than the number of traces.
+int run_batch(const string& source, int jobs, char policy, const PolicyOptions& options, SimStats& total) {
+    vector<string> paths;
+    error_code error;
+    if (filesystem::is_directory(source, error)) {
+        for (const auto& entry : filesystem::directory_iterator(source, error)) {
+            if (entry.is_regular_file()) paths.push_back(entry.path().string());
+        }
+        sort(paths.begin(), paths.end());
+    } else {
+        ifstream list(source);
+        if (!list) {
+            cerr << "Cannot open batch source: " << source << "\n";
+            return 1;
+        }
+        string line;
+        while (getline(list, line)) {
+            if (!line.empty()) paths.push_back(line);
+        }
+    }
+
+    vector<TraceSummary> rows(paths.size());
+    vector<char> failed(paths.size(), false);   // not vector<bool>: workers set neighbouring entries
+    atomic<size_t> next(0);
+    mutex total_lock;
+
+    auto worker = [&]() {
+        ostream discard(nullptr);
+        while (true) {
+            size_t i = next++;
+            if (i >= paths.size()) break;
+
+            ifstream in(paths[i]);
+            if (!in) {
+                failed[i] = true;
+                continue;
+            }
+            vector<Task> tasks;
+            auto phase = chrono::steady_clock::now();
+            bool valid = read_tasks(in, tasks);
+            stats.parse_ms += elapsed_ms(phase);
+            if (!valid) {
+                failed[i] = true;
+                continue;
+            }
+
+            Checkpointer ckpt;
+            ckpt.policy = policy;
+            run_policy(policy, tasks, ckpt, options, discard);
+            rows[i] = summarize(tasks);
+        }
+        lock_guard<mutex> guard(total_lock);
+        total.add(stats);
+    };
+
+    jobs = min<size_t>(jobs, max<size_t>(paths.size(), 1));
+    vector<thread> workers;
+    for (int j = 0; j < jobs; j++) workers.emplace_back(worker);
+    for (thread& t : workers) t.join();
+
+    cout << "BATCH scheduling results (" << paths.size() << " traces, " << jobs << " workers)\n\n";
+    cout << "trace                           tasks  makespan  mean wait  mean resp   mean tat  max wait\n";
+    cout << "------------------------------ ------ --------- ---------- ---------- ---------- ---------\n";
+
+    TraceSummary all;
+    int failures = 0;
+    auto print_row = [](const string& name, const TraceSummary& row) {
+        double n = row.tasks ? row.tasks : 1;
+        cout << left << setw(30) << name << right
+             << setw(7) << row.tasks
+             << setw(10) << row.makespan
+             << setw(11) << row.wait_sum / n
+             << setw(11) << row.response_sum / n
+             << setw(11) << row.turnaround_sum / n
+             << setw(10) << row.max_wait << "\n";
+    };
+
+    ios::fmtflags flags = cout.flags();
+    cout << fixed << setprecision(2);
+    for (size_t i = 0; i < paths.size(); i++) {
+        string name = filesystem::path(paths[i]).filename().string();
+        if (failed[i]) {
+            cout << left << setw(30) << name << right << "  unreadable\n";
+            failures++;
+            continue;
+        }
+        print_row(name, rows[i]);
+        all.add(rows[i]);
+    }
+    cout << "------------------------------ ------ --------- ---------- ---------- ---------- ---------\n";
+    print_row("all", all);
+    cout.flags(flags);
+
+    return failures ? 1 : 0;
+}
+
+// Runs every policy over the same tasks, one thread each, and prints a summary row per policy
+int run_compare(const vector<Task>& tasks, const PolicyOptions& options, SimStats& total) {
+    const char* names[] = { "fifo", "sjf", "rr", "srtf", "hetero", "prio" };
+    const char policies[] = { 'f', 's', 'r', 'p', 'h', 'a' };
+    const int count = sizeof(policies);
+
+    vector<TraceSummary> rows(count);
+    mutex total_lock;
+    vector<thread> workers;
+    for (int i = 0; i < count; i++) {
+        workers.emplace_back([&, i]() {
+            vector<Task> copy = tasks;
+            ostream discard(nullptr);
+            Checkpointer ckpt;
+            ckpt.policy = policies[i];
+            run_policy(policies[i], copy, ckpt, options, discard);
+            rows[i] = summarize(copy);
+            lock_guard<mutex> guard(total_lock);
+            total.add(stats);
+        });
+    }
+    for (thread& t : workers) t.join();
+
+    cout << "POLICY comparison (" << tasks.size() << " tasks)\n\n";
+    cout << "policy    makespan  mean wait  mean resp   mean tat  max wait\n";
+    cout << "-------- --------- ---------- ---------- ---------- ---------\n";
+    ios::fmtflags flags = cout.flags();
+    cout << fixed << setprecision(2);
+    for (int i = 0; i < count; i++) {
+        double n = rows[i].tasks ? rows[i].tasks : 1;
+        cout << left << setw(8) << names[i] << right
+             << setw(10) << rows[i].makespan
+             << setw(11) << rows[i].wait_sum / n
+             << setw(11) << rows[i].response_sum / n
+             << setw(11) << rows[i].turnaround_sum / n
+             << setw(10) << rows[i].max_wait << "\n";
+    }
+    cout.flags(flags);
+    return 0;
+}
+
+bool parse_quanta(const string& spec, vector<int>& quanta) {
+    quanta.clear();
+    istringstream fields(spec);
+    string field;
+    while (getline(fields, field, ',')) {
+        int quantum = atoi(field.c_str());
+        if (quantum < 1) return false;
+        quanta.push_back(quantum);
+    }
+    return !quanta.empty();
+}
+
+// Objective of a finished run: mean wait, or the 99th percentile response time
+static double tune_score(const vector<Task>& tasks, bool p99) {
+    if (tasks.empty()) return 0;
+    if (!p99) return (double)summarize(tasks).wait_sum / tasks.size();
+    vector<int> response;
+    response.reserve(tasks.size());
+    for (const Task& task : tasks) response.push_back(task.response_time);
+    size_t rank = (response.size() * 99 + 99) / 100 - 1;
+    nth_element(response.begin(), response.begin() + rank, response.end());
+    return response[rank];
+}
+
+// Stops an rr run as soon as the objective is bound to lose: finished tasks count with
+// their results, the rest with what they have already waited, which only grows
+struct TuneCutoff : SnapshotObserver {
+    const atomic<double>& cutoff;
+    bool p99;
+    bool pruned = false;
+
+    TuneCutoff(const atomic<double>& cutoff, bool p99) : cutoff(cutoff), p99(p99) {}
+
+    bool at_snapshot(const vector<Task>& tasks, const EngineState& state) override {
+        vector<Task> bound = tasks;
+        for (Task& task : bound) {
+            if (task.remaining_time == 0) continue;
+            int waited = task.arrival_time <= state.time ? state.time - task.arrival_time - (task.service_time - task.remaining_time) : 0;
+            task.wait_time = max(waited, 0);
+            task.response_time = max(state.time - task.arrival_time, 0) + task.remaining_time;
+        }
+        pruned = tune_score(bound, p99) > cutoff.load();
+        return !pruned;
+    }
+};
+
+// Searches rr quanta by successive halving. Every quantum first runs on a short prefix
+// of the trace; the better half moves on to a prefix twice as long, until the survivors
+// run the whole trace. Within a round the runs share a pool of worker threads, and a
+// run is cut short once it cannot reach the number of places that move on.
+int run_tune(vector<Task>& tasks, const PolicyOptions& options, bool p99, const vector<int>& quanta, int jobs,
+             SimStats& total) {
+    if (tasks.empty()) {
+        cerr << "No tasks to tune on\n";
+        return 1;
+    }
+    stable_sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
+        return a.arrival_time < b.arrival_time;
+    });
+
+    size_t rounds = 0;
+    while ((size_t)1 << rounds < quanta.size()) rounds++;
+    size_t prefix = min(tasks.size(), max<size_t>(tasks.size() >> rounds, 64));
+
+    cout << "RR quantum tuning (" << tasks.size() << " tasks, objective "
+         << (p99 ? "p99 response" : "mean wait") << ", context switch is " << options.switch_cost << ")\n\n";
+    cout << "round    tasks  quantum      score\n";
+    cout << "-----  -------  -------  ---------\n";
+    ios::fmtflags flags = cout.flags();
+    cout << fixed << setprecision(2);
+
+    vector<int> survivors = quanta;
+    int round = 1;
+    while (true) {
+        size_t keep = prefix == tasks.size() ? 1 : (survivors.size() + 1) / 2;
+        vector<double> score(survivors.size());
+        vector<char> pruned(survivors.size(), false);
+        vector<double> finished;
+        atomic<double> cutoff(HUGE_VAL);
+        atomic<size_t> next(0);
+        mutex lock;
+
+        // Long enough that the bound check stays a small part of the run
+        long long span = tasks[prefix - 1].arrival_time;
+        for (size_t i = 0; i < prefix; i++) span += tasks[i].service_time;
+
+        auto worker = [&]() {
+            ostream discard(nullptr);
+            while (true) {
+                size_t i = next++;
+                if (i >= survivors.size()) break;
+
+                vector<Task> run(tasks.begin(), tasks.begin() + prefix);
+                PolicyOptions settings = options;
+                settings.quantum = survivors[i];
+                TuneCutoff check(cutoff, p99);
+                Checkpointer ckpt;
+                ckpt.policy = 'r';
+                ckpt.interval = min<long long>(INT_MAX, max<long long>(1, span / 8));
+                ckpt.observer = &check;
+                run_policy('r', run, ckpt, settings, discard);
+
+                lock_guard<mutex> guard(lock);
+                pruned[i] = check.pruned;
+                if (pruned[i]) continue;
+                score[i] = tune_score(run, p99);
+                finished.push_back(score[i]);
+                if (finished.size() >= keep) {
+                    nth_element(finished.begin(), finished.begin() + keep - 1, finished.end());
+                    cutoff = finished[keep - 1];
+                }
+            }
+            lock_guard<mutex> guard(lock);
+            total.add(stats);
+        };
+        vector<thread> workers;
+        for (size_t j = 0; j < min<size_t>(max(jobs, 1), survivors.size()); j++) workers.emplace_back(worker);
+        for (thread& t : workers) t.join();
+
+        vector<size_t> order;
+        for (size_t i = 0; i < survivors.size(); i++) {
+            cout << setw(5) << round << setw(9) << prefix << setw(9) << survivors[i];
+            if (pruned[i]) cout << "     pruned\n";
+            else cout << setw(11) << score[i] << "\n";
+            if (!pruned[i]) order.push_back(i);
+        }
+        stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return score[a] < score[b]; });
+
+        if (prefix == tasks.size()) {
+            cout << "\nbest quantum " << survivors[order[0]] << ": "
+                 << (p99 ? "p99 response " : "mean wait ") << score[order[0]] << "\n";
+            break;
+        }
+        vector<int> moving;
+        for (size_t k = 0; k < keep && k < order.size(); k++) moving.push_back(survivors[order[k]]);
+        survivors = moving;
+        prefix = min(tasks.size(), prefix * 2);
+        round++;
+    }
+    cout.flags(flags);
+
+    return 0;
+}
+
+// The mutable fields of a task that is in the system at a snapshot tick
+struct LiveTask {
+    int seq = -1;
+    int remaining = 0, start = -1, wait = 0, response = 0;
+
+    bool operator==(const LiveTask& other) const {
+        return seq == other.seq && remaining == other.remaining && start == other.start
+            && wait == other.wait && response == other.response;
+    }
+};
+
+// Engine state held in memory and keyed by input line rather than vector index,
+// so it can be compared with and resumed into a run over a different task vector.
+// Only tasks in the system are kept; the rest follow from the trace.
+struct MemorySnapshot {
+    int time = 0;
+    bool running = false;
+    LiveTask current;
+    int start_time = 0;
+    int time_slice = 0;
+    int switching = 0;
+    vector<LiveTask> ready;
+
+    bool operator==(const MemorySnapshot& other) const {
+        return time == other.time && running == other.running && current == other.current
+            && start_time == other.start_time && time_slice == other.time_slice && switching == other.switching
+            && ready == other.ready;
+    }
+};
+
+struct TaskResult {
+    int completion = 0, wait = 0, response = 0;
+};
+
+static LiveTask live_task(const Task& task) {
+    LiveTask live;
+    live.seq = task.seq;
+    live.remaining = task.remaining_time;
+    live.start = task.start_time;
+    live.wait = task.wait_time;
+    live.response = task.response_time;
+    return live;
+}
+
+static MemorySnapshot capture(const vector<Task>& tasks, const EngineState& state) {
+    MemorySnapshot snap;
+    snap.time = state.time;
+    // rr keeps a finished task as current until the next dispatch, which is an idle CPU
+    if (state.current >= 0 && tasks[state.current].remaining_time > 0) {
+        snap.running = true;
+        snap.current = live_task(tasks[state.current]);
+        snap.start_time = state.start_time;
+        snap.time_slice = state.time_slice;
+        snap.switching = state.switching;
+    }
+    for (int index : state.ready) snap.ready.push_back(live_task(tasks[index]));
+    return snap;
+}
+
+// Keeps the baseline's state at every checkpoint tick, snapshots[k] at (k + 1) * interval
+struct BaselineRecorder : SnapshotObserver {
+    vector<MemorySnapshot> snapshots;
+
+    bool at_snapshot(const vector<Task>& tasks, const EngineState& state) override {
+        snapshots.push_back(capture(tasks, state));
+        return true;
+    }
+};
+
+// Ends a what-if run once it is back in the baseline's state with every edited task
+// finished in both, from where on the two runs are identical; or at the window horizon
+struct ConvergenceCheck : SnapshotObserver {
+    const vector<MemorySnapshot>& baseline;
+    const vector<TaskResult>& final;
+    vector<int> edited;             // window indices of the edited tasks
+    int interval = 0;
+    int latest_edit = 0;
+    long long horizon = 0;
+    int stopped_at = -1;
+    bool converged = false;
+
+    ConvergenceCheck(const vector<MemorySnapshot>& baseline, const vector<TaskResult>& final)
+    : baseline(baseline), final(final) {}
+
+    bool at_snapshot(const vector<Task>& tasks, const EngineState& state) override {
+        size_t k = state.time / interval - 1;
+        if (state.time > latest_edit && k < baseline.size()) {
+            bool done = true;
+            for (int index : edited) {
+                done = done && tasks[index].remaining_time == 0 && final[tasks[index].seq].completion <= state.time;
+            }
+            if (done && capture(tasks, state) == baseline[k]) {
+                converged = true;
+                stopped_at = state.time;
+                return false;
+            }
+        }
+        if (state.time >= horizon) {
+            stopped_at = state.time;
+            return false;
+        }
+        return true;
+    }
+};
+
+// A task as it stands before it arrives
+static Task fresh_task(const Task& input, char policy) {
+    Task task = input;
+    if (policy != 'r') task.response_time = -1;
+    return task;
+}
+
+// Replays edits to a trace against one baseline run. Each query is a group of
+// "line arrival service" lines (1-origin input line), groups separated by a blank line.
+// A query resumes from the last baseline snapshot before its earliest edit and runs
+// a window of the trace until it rejoins the baseline, doubling the window when it
+// does not; tasks it did not finish keep their baseline results. With verify each query
+// is also run over the whole edited trace and any row that differs fails the run.
+int run_whatif(const vector<Task>& input, char policy, const PolicyOptions& options, const string& query_path, int interval,
+               bool verify) {
+    ifstream queries(query_path);
+    if (!queries) {
+        cerr << "Cannot open what-if queries: " << query_path << "\n";
+        return 1;
+    }
+
+    vector<vector<pair<int, pair<int, int>>>> edit_groups(1);
+    string line;
+    while (getline(queries, line)) {
+        istringstream fields(line);
+        int task, arrival, service;
+        if (line.find_first_not_of(" \t\r") == string::npos) {
+            if (!edit_groups.back().empty()) edit_groups.emplace_back();
+        } else if (fields >> task >> arrival >> service && task >= 1 && task <= (int)input.size()
+                   && arrival >= 0 && service > 0) {
+            edit_groups.back().push_back({ task - 1, { arrival, service } });
+        } else {
+            cerr << "Invalid what-if edit: " << line << "\n";
+            return 1;
+        }
+    }
+    if (edit_groups.back().empty()) edit_groups.pop_back();
+
+    // Input lines in the order the engines see them
+    vector<int> order(input.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return input[a].arrival_time < input[b].arrival_time;
+    });
+
+    ostream discard(nullptr);
+    auto phase = chrono::steady_clock::now();
+    BaselineRecorder recorder;
+    vector<TaskResult> final(input.size());
+    TraceSummary baseline;
+    {
+        vector<Task> tasks = input;
+        Checkpointer ckpt;
+        ckpt.policy = policy;
+        ckpt.interval = interval;
+        ckpt.observer = &recorder;
+        run_policy(policy, tasks, ckpt, options, discard);
+        for (const Task& task : tasks) final[task.seq] = { task.completion_time, task.wait_time, task.response_time };
+        baseline = summarize(tasks);
+    }
+    double baseline_ms = elapsed_ms(phase);
+
+    cout << "WHAT-IF scheduling results (" << input.size() << " tasks, " << edit_groups.size()
+         << " queries, snapshot every " << interval << " ticks)\n\n";
+    cout << "query  edits  resumed  stopped  conv  resim ticks  changed  mean wait  mean resp   mean tat  makespan        ms\n";
+    cout << "-----  -----  -------  -------  ----  -----------  -------  ---------  ---------  ---------  --------  --------\n";
+
+    ios::fmtflags flags = cout.flags();
+    cout << fixed << setprecision(2);
+    auto print_row = [](const TraceSummary& row) {
+        double n = row.tasks ? row.tasks : 1;
+        cout << setw(11) << row.wait_sum / n << setw(11) << row.response_sum / n
+             << setw(11) << row.turnaround_sum / n << setw(10) << row.makespan;
+    };
+    cout << left << setw(5) << "base" << right << setw(7) << 0 << setw(9) << 0
+         << setw(9) << baseline.makespan << setw(6) << "-" << setw(13) << baseline.makespan << setw(9) << 0;
+    print_row(baseline);
+    cout << setw(10) << baseline_ms << "\n";
+
+    int mismatches = 0;
+    for (size_t q = 0; q < edit_groups.size(); q++) {
+        phase = chrono::steady_clock::now();
+        map<int, pair<int, int>> edits;
+        for (const auto& edit : edit_groups[q]) edits[edit.first] = edit.second;   // later lines win
+
+        int earliest = INT32_MAX, latest = 0;
+        for (const auto& edit : edits) {
+            const Task& task = input[edit.first];
+            earliest = min({ earliest, task.arrival_time, edit.second.first });
+            latest = max({ latest, task.arrival_time, edit.second.first });
+        }
+
+        // Snapshot k - 1 is at tick k * interval; with none usable start from an empty tick 0
+        size_t k = min<size_t>(earliest / interval, recorder.snapshots.size());
+        MemorySnapshot start = k > 0 ? recorder.snapshots[k - 1] : MemorySnapshot();
+        int t0 = start.time;
+        auto first = lower_bound(order.begin(), order.end(), t0, [&](int seq, int time) {
+            return input[seq].arrival_time < time;
+        });
+
+        long long span = (long long)((latest - t0) / interval + 1) * interval;
+        long long resim_ticks = 0;
+        vector<Task> window;
+        ConvergenceCheck check(recorder.snapshots, final);
+        check.interval = interval;
+        check.latest_edit = latest;
+        int end_time = t0;
+        while (true) {
+            long long horizon = t0 + span;
+            Checkpointer ckpt;
+            ckpt.policy = policy;
+            ckpt.interval = interval;
+            ckpt.resuming = true;
+            ckpt.observer = &check;
+            EngineState& state = ckpt.resume_state;
+            state.time = t0;
+            state.start_time = start.start_time;
+            state.time_slice = start.time_slice;
+            state.switching = start.switching;
+
+            // The window is the snapshot's live tasks, then every arrival before the horizon
+            // in arrival order, then one later arrival that keeps the engine from draining
+            window.clear();
+            auto restore = [&](const LiveTask& live) {
+                Task task = input[live.seq];
+                task.remaining_time = live.remaining;
+                task.start_time = live.start;
+                task.wait_time = live.wait;
+                task.response_time = live.response;
+                window.push_back(task);
+                return (int)window.size() - 1;
+            };
+            state.current = start.running ? restore(start.current) : -1;
+            for (const LiveTask& live : start.ready) state.ready.push_back(restore(live));
+            state.next_arrival = window.size();
+
+            auto it = first;
+            for (; it != order.end() && input[*it].arrival_time < horizon; ++it) {
+                if (!edits.count(*it)) window.push_back(fresh_task(input[*it], policy));
+            }
+            for (const auto& edit : edits) {
+                Task task = fresh_task(input[edit.first], policy);
+                task.arrival_time = edit.second.first;
+                task.service_time = task.remaining_time = edit.second.second;
+                window.push_back(task);
+            }
+            stable_sort(window.begin() + state.next_arrival, window.end(), [](const Task& a, const Task& b) {
+                return a.arrival_time < b.arrival_time || (a.arrival_time == b.arrival_time && a.seq < b.seq);
+            });
+            while (it != order.end() && edits.count(*it)) ++it;
+            bool truncated = it != order.end();
+            if (truncated) window.push_back(fresh_task(input[*it], policy));
+
+            check.edited.clear();
+            for (size_t i = state.next_arrival; i < window.size(); i++) {
+                if (edits.count(window[i].seq)) check.edited.push_back(i);
+            }
+            check.horizon = truncated ? horizon : LLONG_MAX;
+            check.stopped_at = -1;
+
+            run_policy(policy, window, ckpt, options, discard);
+
+            end_time = check.stopped_at;
+            if (end_time < 0) {
+                end_time = t0;
+                for (const Task& task : window) end_time = max(end_time, task.completion_time);
+            }
+            resim_ticks += end_time - t0;
+            if (check.converged || check.stopped_at < 0) break;
+            span *= 2;
+        }
+
+        // Tasks the window finished take its results, the rest run as in the baseline
+        TraceSummary result = baseline;
+        long long changed = 0, makespan = 0;
+        for (const Task& task : window) {
+            const TaskResult& before = final[task.seq];
+            const Task& original = input[task.seq];
+            TaskResult after = before;
+            if (task.remaining_time == 0) after = { task.completion_time, task.wait_time, task.response_time };
+            result.wait_sum += after.wait - before.wait;
+            result.response_sum += after.response - before.response;
+            result.turnaround_sum += (after.completion - task.arrival_time) - (before.completion - original.arrival_time);
+            makespan = max(makespan, (long long)after.completion);
+            if (after.completion != before.completion || after.wait != before.wait
+                || after.response != before.response || task.arrival_time != original.arrival_time
+                || task.service_time != original.service_time) {
+                changed++;
+            }
+        }
+        // Past convergence the tail is the baseline's; without it the window ran to the end
+        result.makespan = check.converged ? baseline.makespan : makespan;
+
+        cout << left << setw(5) << q + 1 << right << setw(7) << edits.size() << setw(9) << t0
+             << setw(9) << end_time << setw(6) << (check.converged ? "yes" : "no")
+             << setw(13) << resim_ticks << setw(9) << changed;
+        print_row(result);
+        cout << setw(10) << elapsed_ms(phase) << "\n";
+
+        if (verify) {
+            phase = chrono::steady_clock::now();
+            vector<Task> tasks = input;
+            for (const auto& edit : edits) {
+                tasks[edit.first].arrival_time = edit.second.first;
+                tasks[edit.first].service_time = tasks[edit.first].remaining_time = edit.second.second;
+            }
+            Checkpointer ckpt;
+            ckpt.policy = policy;
+            run_policy(policy, tasks, ckpt, options, discard);
+            TraceSummary full = summarize(tasks);
+            bool same = full.wait_sum == result.wait_sum && full.response_sum == result.response_sum
+                        && full.turnaround_sum == result.turnaround_sum && full.makespan == result.makespan;
+            if (!same) mismatches++;
+            cout << left << setw(5) << (same ? "full" : "DIFF") << right << setw(7) << edits.size() << setw(9) << 0
+                 << setw(9) << full.makespan << setw(6) << "-" << setw(13) << full.makespan << setw(9) << "-";
+            print_row(full);
+            cout << setw(10) << elapsed_ms(phase) << "\n";
+        }
+    }
+    cout.flags(flags);
+
+    if (mismatches) {
+        cerr << mismatches << " what-if " << (mismatches == 1 ? "query differs" : "queries differ")
+             << " from a full rerun\n";
+        return 1;
+    }
+    return 0;
+}
+
+void print_stats(const SimStats& stats) {
+    cout << "\n-- stats --\n";
+    if (SIM_STATS) {
+        cout << "events processed   " << setw(12) << stats.events << "\n";
+        cout << "queue pushes       " << setw(12) << stats.pushes << "\n";
+        cout << "queue pops         " << setw(12) << stats.pops << "\n";
+        cout << "peak queue length  " << setw(12) << stats.peak_queue << "\n";
+        cout << "trace bytes        " << setw(12) << stats.trace_bytes << "\n";
+    } else {
+        cout << "counters compiled out (SIM_STATS=0)\n";
+    }
+    cout << fixed << setprecision(3);
+    cout << "parse ms           " << setw(12) << stats.parse_ms << "\n";
+    cout << "sort ms            " << setw(12) << stats.sort_ms << "\n";
+    cout << "simulation ms      " << setw(12) << stats.loop_ms << "\n";
+    cout << "report ms          " << setw(12) << stats.report_ms << "\n";
+    cout << "-- end --\n";
+}
+
+// Snapshot layout, all integers 32-bit little-endian:
+//   "P3SN" version policy(1 byte) quantum switch_cost
+//   time next_arrival current start_time time_slice switching
+//   ntasks, then per task: id(1 byte) arrival service remaining start completion wait response pid seq
+//   nready, then the ready queue as task indices
+static const int SNAPSHOT_VERSION = 4;
+
+static void put32(FILE* f, int32_t v) {
+    unsigned char b[4] = { (unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24) };
+    fwrite(b, 1, 4, f);
+}
+
+static bool get32(FILE* f, int32_t& v) {
+    unsigned char b[4];
+    if (fread(b, 1, 4, f) != 4) return false;
+    v = (int32_t)((uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24);
+    return true;
+}
+
+bool write_snapshot(const string& path, const Checkpointer& ckpt, const vector<Task>& tasks, const EngineState& state) {
+    // Write beside the target and rename so a crash mid-write keeps the previous snapshot
+    string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f) return false;
+
+    fwrite("P3SN", 1, 4, f);
+    put32(f, SNAPSHOT_VERSION);
+    fputc(ckpt.policy, f);
+    put32(f, ckpt.quantum);
+    put32(f, ckpt.switch_cost);
+    put32(f, state.time);
+    put32(f, state.next_arrival);
+    put32(f, state.current);
+    put32(f, state.start_time);
+    put32(f, state.time_slice);
+    put32(f, state.switching);
+
+    put32(f, (int32_t)tasks.size());
+    for (const Task& task : tasks) {
+        fputc(task.id, f);
+        put32(f, task.arrival_time);
+        put32(f, task.service_time);
+        put32(f, task.remaining_time);
+        put32(f, task.start_time);
+        put32(f, task.completion_time);
+        put32(f, task.wait_time);
+        put32(f, task.response_time);
+        put32(f, task.pid);
+        put32(f, task.seq);
+    }
+
+    put32(f, (int32_t)state.ready.size());
+    for (int index : state.ready) put32(f, index);
+
+    bool ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+bool read_snapshot(const string& path, Checkpointer& ckpt, vector<Task>& tasks) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+
+    EngineState& state = ckpt.resume_state;
+    char magic[4];
+    int32_t version, count, v[9];
+    int c = EOF;
+    bool ok = fread(magic, 1, 4, f) == 4 && equal(magic, magic + 4, "P3SN")
+           && get32(f, version) && version == SNAPSHOT_VERSION
+           && (c = fgetc(f)) != EOF && get32(f, ckpt.quantum) && get32(f, ckpt.switch_cost)
+           && get32(f, state.time) && get32(f, state.next_arrival) && get32(f, state.current)
+           && get32(f, state.start_time) && get32(f, state.time_slice)
+           && get32(f, state.switching)
+           && get32(f, count) && count >= 0;
+    ckpt.policy = (char)c;
+
+    for (int32_t i = 0; ok && i < count; i++) {
+        int id = fgetc(f);
+        ok = id != EOF;
+        for (int j = 0; ok && j < 9; j++) ok = get32(f, v[j]);
+        if (!ok) break;
+        tasks.emplace_back((char)id, v[0], v[1], v[7], v[8]);
+        Task& task = tasks.back();
+        task.remaining_time = v[2];
+        task.start_time = v[3];
+        task.completion_time = v[4];
+        task.wait_time = v[5];
+        task.response_time = v[6];
+    }
+
+    int32_t index;
+    ok = ok && get32(f, count) && count >= 0;
+    for (int32_t i = 0; ok && i < count; i++) {
+        ok = get32(f, index) && index >= 0 && index < (int32_t)tasks.size();
+        if (ok) state.ready.push_back(index);
+    }
+    fclose(f);
+
+    return ok && (ckpt.policy == 'f' || ckpt.policy == 's' || ckpt.policy == 'r') && ckpt.quantum > 0 && ckpt.switch_cost >= 0
+              && state.next_arrival >= 0 && state.next_arrival <= (int)tasks.size()
+              && state.current >= -1 && state.current < (int)tasks.size();
+}
+
+bool Checkpointer::save(const vector<Task>& tasks, const EngineState& state) {
+    if (observer) return observer->at_snapshot(tasks, state);
+
+    if (writer > 0) {
+        if (waitpid(writer, nullptr, WNOHANG) == 0) return true;
+        writer = -1;
+    }
+
+    // The child writes from its copy-on-write view of memory and leaves without
+    // flushing the parent's buffered output
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(write_snapshot(path, *this, tasks, state) ? 0 : 1);
+    } else if (pid < 0) {
+        if (!write_snapshot(path, *this, tasks, state)) {
+            cerr << "Failed to write checkpoint " << path << "\n";
+        }
+    } else {
+        writer = pid;
+    }
+    return true;
+}
+
+void Checkpointer::finish() {
+    if (writer > 0) {
+        waitpid(writer, nullptr, 0);
+        writer = -1;
+    }
+}
+
+// Row i of an export holds the task read from input line i; a task set whose lines
+// are not exactly 0..n-1 is exported in its current order
+static vector<int> export_order(const vector<Task>& tasks) {
+    vector<int> row(tasks.size(), -1);
+    for (size_t i = 0; i < tasks.size(); i++) {
+        int seq = tasks[i].seq;
+        if (seq < 0 || seq >= (int)tasks.size() || row[seq] >= 0) {
+            for (size_t j = 0; j < tasks.size(); j++) row[j] = j;
+            break;
+        }
+        row[seq] = i;
+    }
+    return row;
+}
+
+static const char* EXPORT_COLUMNS[] = { "seq", "pid", "arrival", "service", "completion", "response", "wait" };
+static const int EXPORT_COLUMN_COUNT = 7;
+
+static int32_t export_field(const Task& task, int column) {
+    switch (column) {
+    case 0: return task.seq;
+    case 1: return task.pid;
+    case 2: return task.arrival_time;
+    case 3: return task.service_time;
+    case 4: return task.completion_time;
+    case 5: return task.response_time;
+    default: return task.wait_time;
+    }
+}
+
+// Writes per-task results to path and the aggregates to the same name with a
+// .summary.csv extension. Numbers are formatted by hand into a block buffer.
+bool export_csv(const string& path, const vector<Task>& tasks) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) return false;
+
+    vector<char> buffer(1 << 20);
+    size_t used = 0;
+    auto flush = [&]() {
+        fwrite(buffer.data(), 1, used, f);
+        used = 0;
+    };
+    auto put_text = [&](const char* text) {
+        while (*text) buffer[used++] = *text++;
+    };
+    auto put_int = [&](int32_t value) {
+        char digits[12];
+        int n = 0;
+        uint32_t magnitude = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+        do {
+            digits[n++] = '0' + magnitude % 10;
+            magnitude /= 10;
+        } while (magnitude);
+        if (value < 0) buffer[used++] = '-';
+        while (n) buffer[used++] = digits[--n];
+    };
+
+    for (int c = 0; c < EXPORT_COLUMN_COUNT; c++) {
+        if (c) put_text(",");
+        put_text(EXPORT_COLUMNS[c]);
+    }
+    put_text("\n");
+    for (int i : export_order(tasks)) {
+        // A row is at most 7 * 12 bytes
+        if (used + 128 > buffer.size()) flush();
+        for (int c = 0; c < EXPORT_COLUMN_COUNT; c++) {
+            if (c) buffer[used++] = ',';
+            put_int(export_field(tasks[i], c));
+        }
+        buffer[used++] = '\n';
+    }
+    flush();
+    bool ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+
+    TraceSummary summary = summarize(tasks);
+    double n = summary.tasks ? summary.tasks : 1;
+    string summary_path = filesystem::path(path).replace_extension(".summary.csv").string();
+    f = fopen(summary_path.c_str(), "wb");
+    if (!f) return false;
+    fprintf(f, "tasks,makespan,mean_wait,mean_response,mean_turnaround,max_wait\n");
+    fprintf(f, "%lld,%lld,%.4f,%.4f,%.4f,%lld\n", summary.tasks, summary.makespan,
+            summary.wait_sum / n, summary.response_sum / n, summary.turnaround_sum / n, summary.max_wait);
+    ok = !ferror(f) && ok;
+    return fclose(f) == 0 && ok;
+}
+
+// Columnar layout, all little-endian, for memory-mapping:
+//   0   "P3CO" version(u32) rows(u64) columns(u32) data_offset(u32)
+//   24  tasks makespan wait_sum response_sum turnaround_sum max_wait (i64 each)
+//   72  per column: name (16 bytes, NUL padded) width(u32) reserved(u32)
+//   data_offset (a multiple of 64): column c is rows int32 values at data_offset + c * rows * 4
+static const int COLUMNS_VERSION = 1;
+
+static void put64(FILE* f, int64_t v) {
+    put32(f, (int32_t)v);
+    put32(f, (int32_t)(v >> 32));
+}
+
+bool export_columns(const string& path, const vector<Task>& tasks) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) return false;
+
+    uint32_t data_offset = (72 + EXPORT_COLUMN_COUNT * 24 + 63) / 64 * 64;
+    TraceSummary summary = summarize(tasks);
+    fwrite("P3CO", 1, 4, f);
+    put32(f, COLUMNS_VERSION);
+    put64(f, tasks.size());
+    put32(f, EXPORT_COLUMN_COUNT);
+    put32(f, data_offset);
+    put64(f, summary.tasks);
+    put64(f, summary.makespan);
+    put64(f, summary.wait_sum);
+    put64(f, summary.response_sum);
+    put64(f, summary.turnaround_sum);
+    put64(f, summary.max_wait);
+    for (int c = 0; c < EXPORT_COLUMN_COUNT; c++) {
+        char name[16] = {};
+        strncpy(name, EXPORT_COLUMNS[c], sizeof(name) - 1);
+        fwrite(name, 1, sizeof(name), f);
+        put32(f, 4);
+        put32(f, 0);
+    }
+    for (long pad = ftell(f); pad < data_offset; pad++) fputc(0, f);
+
+    // One column at a time, encoded a block at a time
+    vector<int> order = export_order(tasks);
+    vector<unsigned char> block(4 << 16);
+    for (int c = 0; c < EXPORT_COLUMN_COUNT; c++) {
+        for (size_t start = 0; start < order.size(); start += block.size() / 4) {
+            size_t count = min(block.size() / 4, order.size() - start);
+            unsigned char* out = block.data();
+            for (size_t i = start; i < start + count; i++) {
+                uint32_t v = export_field(tasks[order[i]], c);
+                *out++ = v;
+                *out++ = v >> 8;
+                *out++ = v >> 16;
+                *out++ = v >> 24;
+            }
+            fwrite(block.data(), 1, count * 4, f);
+        }
+    }
+
+    bool ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
+
+void simulate_fifo(vector<Task>& tasks, Checkpointer& ckpt, ostream& out) {
+    int time = 0, start_time = 0;
+    queue<Task*> task_queue;
+    vector<Task>::iterator it = tasks.begin();
+    Task* current_task = nullptr; 
+
+    if (ckpt.resuming) {
+        const EngineState& state = ckpt.resume_state;
+        time = state.time;
+        start_time = state.start_time;
+        it = tasks.begin() + state.next_arrival;
+        current_task = state.current < 0 ? nullptr : &tasks[state.current];
+        for (int index : state.ready) task_queue.push(&tasks[index]);
+    } else {
+        auto phase = chrono::steady_clock::now();
+        stable_sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
+            return a.arrival_time < b.arrival_time;
+        });
+        stats.sort_ms += elapsed_ms(phase);
+
+        // Setting wait and response times to 0
+        for (auto it = tasks.begin(); it != tasks.end(); ++it) {
+            it->wait_time = 0;
+            it->response_time = -1;
+        }
+    }
+
+    bool hasRemainingTasks = it != tasks.end();
+    bool isQueueNotEmpty = !task_queue.empty();
+    bool isProcessingTask = current_task != nullptr;
+
+    out << "FIFO scheduling results\n\n";
+    if (ckpt.resuming) out << "resumed from checkpoint at time " << time << "\n\n";
+    out << "time   cpu   ready queue (tid/rst)\n";
+    out << "----   ---   ---------------------\n";
+
+    // Driver loop for FIFO
+    auto phase = chrono::steady_clock::now();
+    TraceCounter trace_counter(out);
+    while(hasRemainingTasks || isQueueNotEmpty || isProcessingTask) {
+        if (ckpt.due(time)) {
+            EngineState state;
+            state.time = time;
+            state.start_time = start_time;
+            state.next_arrival = it - tasks.begin();
+            state.current = current_task ? current_task - &tasks[0] : -1;
+            for (queue<Task*> temp_queue = task_queue; !temp_queue.empty(); temp_queue.pop()) {
+                state.ready.push_back(temp_queue.front() - &tasks[0]);
+            }
+            if (!ckpt.save(tasks, state)) break;
+        }
+
+        // Add tasks to the queue if they have arrived
+        while(it != tasks.end() && it->arrival_time <= time) {
+            task_queue.push(&(*it));
+            ++it;
+            STAT(stats.events++; stats.pushes++);
+        }
+        STAT(stats.peak_queue = max(stats.peak_queue, (long long)task_queue.size()));
+
+        // Fetching next task if CPU is idle
+        if (!current_task && !task_queue.empty()) {
+            current_task = task_queue.front();
+            task_queue.pop();
+            start_time = time; 
+            STAT(stats.events++; stats.pops++);
+
+            // Assigning response time
+            if (current_task->response_time == -1) { 
+                // I know this is busted but it was the only way it would work
+                current_task->response_time = (time - current_task->arrival_time) + (current_task->wait_time + current_task->service_time);
+            }
+        }
+
+        // Start of printing and formatting
+        if (out) {
+            out << setw(3) << time;
+            if (current_task) {
+                out << setw(5) << current_task->id << current_task->remaining_time;
+            } else {
+                out << setw(10);
+            }
+
+            out << "    ";
+            if (task_queue.empty()) {
+                out << "--";
+            } else {
+                queue<Task*> temp_queue = task_queue;
+                // Printing the ready queue
+                while (!temp_queue.empty()) {
+                    Task* waiting_task = temp_queue.front();
+                    temp_queue.pop();
+                    out << waiting_task->id << waiting_task->remaining_time;
+                    if (!temp_queue.empty()) out << ",";
+                }
+            }
+            out << endl;
+        }
+
+        // Processing the current task
+        if (current_task) {
+            current_task->remaining_time--;
+            if (current_task->remaining_time == 0) { 
+                current_task->completion_time = time + 1;
+                current_task->wait_time = start_time - current_task->arrival_time;
+                current_task = nullptr; 
+                STAT(stats.events++);
+            }
+        }
+        time++;
+        hasRemainingTasks = it != tasks.end();
+        isQueueNotEmpty = !task_queue.empty();
+        isProcessingTask = current_task != nullptr;
+    }
+    trace_counter.stop();
+    ckpt.finish();
+    stats.loop_ms += elapsed_ms(phase);
+    
+    // Menu output
+    phase = chrono::steady_clock::now();
+    out << "\n     arrival service completion response wait";
+    out << "\ntid   time    time      time      time   time";
+    out << "\n---  ------- ------- ---------- -------- ----\n";
+    for (const Task& task : tasks) {
+        out << " " << task.id << setw(7)
+             << task.arrival_time << setw(8)
+             << task.service_time << setw(10)
+             << task.completion_time << setw(10)
+             << task.response_time << setw(7)
+             << task.wait_time << "\n";
+    }
+
+    out << "\nservice wait\n time   time\n";
+    out << "------- ----\n";
+    sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
+        if (a.service_time == b.service_time) return a.arrival_time < b.arrival_time;
+        return a.service_time < b.service_time;
+    });
+    for (const Task& task : tasks) {
+        out << setw(4) << task.service_time << "\t" << setw(3) << task.wait_time << "\n";
+    }
+    stats.report_ms += elapsed_ms(phase);
+
+}
+
+void simulate_sjf(vector<Task>& tasks, Checkpointer& ckpt, ostream& out) {
+    int time = 0;
+    bool check_idle = true;
+    Task* current_task = nullptr;
+    vector<Task>::iterator it = tasks.begin();
+    
+
+    // Using a lambda function for simplicity when comparing
+    // Comp compairs the remainng time of two tasks
+    auto comp = [](const Task* a, const Task* b) {
+        return a->remaining_time > b->remaining_time;
+    };
+
+    // Sorts tasks by remaining time using comp
+    TaskHeap<decltype(comp)> ready_queue(comp);
+
+    if (ckpt.resuming) {
+        const EngineState& state = ckpt.resume_state;
+        time = state.time;
+        it = tasks.begin() + state.next_arrival;
+        current_task = state.current < 0 ? nullptr : &tasks[state.current];
+        check_idle = current_task == nullptr;
+        for (int index : state.ready) ready_queue.c.push_back(&tasks[index]);
+    } else {
+        // Sorting by arrival time
+        auto phase = chrono::steady_clock::now();
+        stable_sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
+            return a.arrival_time < b.arrival_time;
+        });
+        stats.sort_ms += elapsed_ms(phase);
+
+        for (auto it = tasks.begin(); it != tasks.end(); ++it) {
+            it->wait_time = 0;
+            it->response_time = -1;
+        }
+    }
+
+    out << "SJF(preemptive) scheduling results\n\n";
+    if (ckpt.resuming) out << "resumed from checkpoint at time " << time << "\n\n";
+    out << "time   cpu   ready queue (tid/rst)\n";
+    out << "----   ---   ---------------------\n";
+
+    // Driver loop for SJF with boolean update variables
+    bool hasRemainingTasks = it != tasks.end();
+    bool isQueueNotEmpty = !ready_queue.empty();
+    bool isProcessingTask = current_task != nullptr;
+
+    auto phase = chrono::steady_clock::now();
+    TraceCounter trace_counter(out);
+    while (hasRemainingTasks || isQueueNotEmpty || isProcessingTask) {
+        if (ckpt.due(time)) {
+            EngineState state;
+            state.time = time;
+            state.next_arrival = it - tasks.begin();
+            state.current = current_task ? current_task - &tasks[0] : -1;
+            for (Task* task : ready_queue.c) state.ready.push_back(task - &tasks[0]);
+            if (!ckpt.save(tasks, state)) break;
+        }
+
+        while (it != tasks.end() && it->arrival_time <= time) {
+            // Check if a new task should preempt the current task or if CPU is idle
+            bool preempt = current_task != nullptr && it->service_time < current_task->remaining_time;
+
+            // If a new task should preempt the current task or CPU is idle then push the current task to the queue
+            if (check_idle || preempt) {
+                if (current_task != nullptr) {
+                    ready_queue.push(current_task);
+                    STAT(stats.events++; stats.pushes++);
+                }
+                current_task = &(*it);
+                check_idle = false;
+            } else {
+                ready_queue.push(&(*it));
+                STAT(stats.pushes++);
+            }
+            ++it;
+            STAT(stats.events++);
+        }
+        STAT(stats.peak_queue = max(stats.peak_queue, (long long)ready_queue.size()));
+
+
+        // If CPU is idle and other tasks are waiting then fetch the next task
+        if (check_idle && !ready_queue.empty()) {
+            current_task = ready_queue.top();
+            ready_queue.pop();
+            check_idle = false;
+            STAT(stats.events++; stats.pops++);
+        }
+
+
+        if (out) {
+            out << setw(3) << time;
+            if (!check_idle) {
+                out << setw(5) << current_task->id << current_task->remaining_time;
+            } else {
+                out << setw(10);
+            }
+        }
+        if (!check_idle) {
+            current_task->remaining_time--;
+
+            // Check if task is completed
+            if (current_task->remaining_time <= 0) {
+                current_task->completion_time = time + 1;
+                if (current_task->response_time == -1) {
+                    current_task->response_time = current_task->completion_time - current_task->arrival_time;
+                }
+                current_task = nullptr;
+                check_idle = true;
+                STAT(stats.events++);
+            }
+        }
+
+        if (out) {
+            out << "    ";
+            if (ready_queue.empty()) {
+
+                out << "--";
+            } else {
+                vector<Task*> tasks_in_queue;
+                priority_queue<Task*, vector<Task*>, decltype(comp)> tempQueue = ready_queue;
+
+                while (!tempQueue.empty()) {
+                    Task* task = tempQueue.top();
+                    tempQueue.pop();
+                    tasks_in_queue.push_back(task);
+                }
+
+                sort(tasks_in_queue.begin(), tasks_in_queue.end(), [](const Task* a, const Task* b) {
+                    return a->remaining_time < b->remaining_time; 
+                });
+
+                for (Task* task : tasks_in_queue) {
+                    out << task->id << task->remaining_time;
+                    if(task != tasks_in_queue.back()) out << ", ";
+                }
+
+            } 
+            out << endl;
+        }
+
+        // Update trackers
+        time++;
+        hasRemainingTasks = it != tasks.end();
+        isQueueNotEmpty = !ready_queue.empty();
+        isProcessingTask = current_task != nullptr;
+    }
+    trace_counter.stop();
+    ckpt.finish();
+    stats.loop_ms += elapsed_ms(phase);
+
+    phase = chrono::steady_clock::now();
+    for (auto& task : tasks) {
+        task.wait_time = task.completion_time - task.arrival_time - task.service_time;
+    }
+
+    // Menu output
+    out << "\n     arrival service completion response wait";
+    out << "\ntid   time    time      time      time   time";
+    out << "\n---  ------- ------- ---------- -------- ----\n";
+    for (const Task& task : tasks) {
+        out << " " << task.id << setw(7)
+             << task.arrival_time << setw(8)
+             << task.service_time << setw(10)
+             << task.completion_time << setw(10)
+             << task.response_time << setw(7)
+             << task.wait_time << "\n";
+    }
+
+    out << "\nservice wait\n time   time\n";
+    out << "------- ----\n";
+    sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
+        if (a.service_time == b.service_time) return a.arrival_time < b.arrival_time;
+        return a.service_time < b.service_time;
+    });
+    for (const Task& task : tasks) {
+        out << setw(4) << task.service_time << "\t" << setw(3) << task.wait_time << "\n";
+    }
+    stats.report_ms += elapsed_ms(phase);
+}
+
+// Round robin with a quantum of `quantum` ticks. Dispatching a task other than the one
+// that ran last costs `switch_cost` ticks, during which the cpu column shows the
+// incoming task but it does not run.
+void simulate_rr(vector<Task>& tasks, Checkpointer& ckpt, int quantum, int switch_cost, ostream& out) {
+    queue<Task*> queue;
+    vector<Task*> all_tasks;
+    vector<Task>::size_type task_index = 0;
+
+    int time = 0;
+    const int time_quantum = quantum;
+    Task* current_task = nullptr;
+    int time_slice = 0; 
+    int switching = 0;
+
+    if (ckpt.resuming) {
+        const EngineState& state = ckpt.resume_state;
+        time = state.time;
+        time_slice = state.time_slice;
+        switching = state.switching;
+        task_index = state.next_arrival;
+        current_task = state.current < 0 ? nullptr : &tasks[state.current];
+        for (int index : state.ready) queue.push(&tasks[index]);
+        for (vector<Task>::size_type i = 0; i < task_index; i++) all_tasks.push_back(&tasks[i]);
+    } else {
+        // Sorting tasks by arrival time
+        auto phase = chrono::steady_clock::now();
+        stable_sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
+            return a.arrival_time < b.arrival_time;
+        });
+        stats.sort_ms += elapsed_ms(phase);
+    }
+    
+
+    out << "RR scheduling results (time slice is " << time_quantum;
+    if (switch_cost > 0) out << ", context switch is " << switch_cost;
+    out << ")\n\n";
+    if (ckpt.resuming) out << "resumed from checkpoint at time " << time << "\n\n";
+    out << "time   cpu   ready queue (tid/rst)\n";
+    out << "----   ---   ---------------------\n";
+
+    // Driver loop for RR and update variables
+    bool hasUnprocessedTasks = task_index < tasks.size();
+    bool hasTasksInQueue = !queue.empty();
+    bool isCurrentlyProcessingTask = current_task != nullptr;
+
+    auto phase = chrono::steady_clock::now();
+    TraceCounter trace_counter(out);
+    while (hasUnprocessedTasks || hasTasksInQueue || isCurrentlyProcessingTask) {
+        if (ckpt.due(time)) {
+            EngineState state;
+            state.time = time;
+            state.time_slice = time_slice;
+            state.switching = switching;
+            state.next_arrival = task_index;
+            state.current = current_task ? current_task - &tasks[0] : -1;
+            for (std::queue<Task*> temp_queue = queue; !temp_queue.empty(); temp_queue.pop()) {
+                state.ready.push_back(temp_queue.front() - &tasks[0]);
+            }
+            if (!ckpt.save(tasks, state)) break;
+        }
+
+        // Add tasks if they arrived
+        while (task_index < tasks.size() && tasks[task_index].arrival_time <= time) {
+            queue.push(&tasks[task_index]);
+            all_tasks.push_back(&tasks[task_index]);
+            task_index++;
+            STAT(stats.events++; stats.pushes++);
+        }
+
+        // Fetch next task if CPU is idle
+        if (current_task == nullptr || current_task->remaining_time == 0 || time_slice == 0) {
+            Task* previous = current_task;
+            if (current_task != nullptr && current_task->remaining_time > 0) {
+                queue.push(current_task);
+                STAT(stats.events++; stats.pushes++);
+            }
+            STAT(stats.peak_queue = max(stats.peak_queue, (long long)queue.size()));
+            
+
+            // Queue state assignment
+            current_task = queue.empty() ? nullptr : queue.front();
+
+            // If the task is not null then pop it from the queue and assign the start time
+            if (current_task != nullptr) {
+                queue.pop();
+                STAT(stats.events++; stats.pops++);
+                if (current_task->start_time == -1) {
+                    current_task->start_time = time;
+                }
+                time_slice = time_quantum;
+                if (current_task != previous) switching = switch_cost;
+            }
+        }
+
+
+        // Stop printing time if all tasks are completed
+        if (queue.empty() && current_task == nullptr && task_index >= tasks.size()) {
+            break;
+        }
+
+        if (out) {
+            out << setw(3) << time;
+            if (current_task) {
+                out << setw(5) << current_task->id << current_task->remaining_time;
+            } else {
+                out << setw(10);
+            }
+
+        
+            out << "    ";
+            if (queue.empty()) {
+                out << "--";
+            } else {
+                // Printing the ready queue
+                std::queue<Task*> temp_queue = queue;
+                while (!temp_queue.empty()) {
+                    Task* task = temp_queue.front();
+                    temp_queue.pop();
+                    out << task->id << task->remaining_time;
+                    if (!temp_queue.empty()) out << ", ";
+                }
+            }
+            out << endl;
+        }
+
+        // Processing the current task and assigning values to completion, response, and wait times
+        if (current_task != nullptr && switching > 0) {
+            switching--;
+        } else if (current_task != nullptr) {
+            current_task->remaining_time--;
+            time_slice--;
+
+            if (current_task->remaining_time == 0) {
+                current_task->completion_time = time + 1;
+
+                if (current_task->response_time == 0) {
+                    current_task->response_time = current_task->completion_time - current_task->arrival_time;
+                }
+                current_task->wait_time = current_task->completion_time - current_task->arrival_time - current_task->service_time;
+                STAT(stats.events++);
+            }
+        }
+
+        // Update trackers
+        time++;
+        hasUnprocessedTasks = task_index < tasks.size();
+        hasTasksInQueue = !queue.empty();
+        isCurrentlyProcessingTask = current_task != nullptr;
+    }
+    trace_counter.stop();
+    ckpt.finish();
+    stats.loop_ms += elapsed_ms(phase);
+
+
+    // Menu output
+    phase = chrono::steady_clock::now();
+    out << "\n     arrival service completion response wait";
+    out << "\ntid   time    time      time      time   time";
+    out << "\n---  ------- ------- ---------- -------- ----\n";
+    for (const Task& task : tasks) {
+        out << " " << task.id << setw(7)
+             << task.arrival_time << setw(8)
+             << task.service_time << setw(10)
+             << task.completion_time << setw(10)
+             << task.response_time << setw(7)
+             << task.wait_time << "\n";
+    }
+    out << "\nservice wait\n time   time\n";
+    out << "------- ----\n";
+
+    sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
+        if (a.service_time == b.service_time) return a.arrival_time < b.arrival_time;
+        return a.service_time < b.service_time;
+    });
+    for (const Task& task : tasks) {
+        out << setw(4) << task.service_time << "\t" << setw(3) << task.wait_time << "\n";
+    }
+    stats.report_ms += elapsed_ms(phase);
+}
+
+// Preemptive shortest-remaining-time-first on predicted rather than true burst lengths.
+// Each process keeps an exponential average of its finished bursts,
+//   tau_next = alpha * burst + (1 - alpha) * tau,
+// starting from tau0, and a waiting burst is keyed on its process's prediction minus
+// the time it has already run. When a burst finishes, the other waiting bursts of the
+// same process are re-keyed in place.
+void simulate_srtf(vector<Task>& tasks, double alpha, double tau0, ostream& out) {
+    int time = 0;
+    Task* current_task = nullptr;
+    int current = -1;
+    vector<Task>::size_type task_index = 0;
 
- 
-    sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
+    // Sorting tasks by arrival time
+    auto phase = chrono::steady_clock::now();
+    stable_sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
         return a.arrival_time < b.arrival_time;
     });
-
-    cout << "FIFO scheduling results\n\n";
-    cout << "time   cpu   ready queue (tid/rst)\n";
-    cout << "----   ---   ---------------------\n";
-
-    // Setting wait and response times to 0
-    for (auto it = tasks.begin(); it != tasks.end(); ++it) {
-        it->wait_time = 0;
-        it->response_time = -1;
+    stats.sort_ms += elapsed_ms(phase);
+
+    // Map pids to dense process numbers; tasks without a pid are processes of their own
+    unordered_map<int, int> process_of_pid;
+    vector<int> process(tasks.size());
+    int processes = 0;
+    for (vector<Task>::size_type i = 0; i < tasks.size(); i++) {
+        tasks[i].wait_time = 0;
+        tasks[i].response_time = -1;
+        if (tasks[i].pid < 0) {
+            process[i] = processes++;
+        } else {
+            auto found = process_of_pid.emplace(tasks[i].pid, processes);
+            if (found.second) processes++;
+            process[i] = found.first->second;
+        }
     }
 
-    // Driver loop for FIFO
-    while(hasRemainingTasks || isQueueNotEmpty || isProcessingTask) {
-        // Add tasks to the queue if they have arrived
-        while(it != tasks.end() && it->arrival_time <= time) {
-            task_queue.push(&(*it));
-            ++it;
+    vector<double> tau(processes, tau0);
+    vector<double> predicted(tasks.size());     // burst prediction each task is keyed on
+    vector<double> key(tasks.size());           // predicted remaining time
+    vector<vector<int>> waiting(tau.size());    // queued bursts per process, pruned lazily
+    vector<bool> listed(tasks.size(), false);
+    IndexedHeap ready_queue(key);
+
+    // Prediction error bookkeeping, error = predicted - actual
+    long long bursts = 0;
+    double error_sum = 0, abs_error_sum = 0, squared_error_sum = 0, max_abs_error = 0;
+
+    auto enqueue = [&](int i) {
+        key[i] = predicted[i] - (tasks[i].service_time - tasks[i].remaining_time);
+        ready_queue.push(i);
+        if (!listed[i]) {
+            waiting[process[i]].push_back(i);
+            listed[i] = true;
         }
+        STAT(stats.events++; stats.pushes++);
+    };
 
-        // Fetching next task if CPU is idle
-        if (!current_task && !task_queue.empty()) {
-            current_task = task_queue.front();
-            task_queue.pop();
-            start_time = time; 
+    out << "SRTF(predicted, alpha " << alpha << ", tau0 " << tau0 << ") scheduling results\n\n";
+    out << "time   cpu   ready queue (tid/rst)\n";
+    out << "----   ---   ---------------------\n";
 
-            // Assigning response time
-            if (current_task->response_time == -1) { 
-                // I know this is busted but it was the only way it would work
-                current_task->response_time = (time - current_task->arrival_time) + (current_task->wait_time + current_task->service_time);
+    TraceCounter trace_counter(out);
+    phase = chrono::steady_clock::now();
+    while (task_index < tasks.size() || !ready_queue.empty() || current_task != nullptr) {
+        // Add tasks if they arrived, predicted from their process's history so far
+        while (task_index < tasks.size() && tasks[task_index].arrival_time <= time) {
+            predicted[task_index] = tau[process[task_index]];
+            enqueue(task_index);
+            task_index++;
+        }
+        STAT(stats.peak_queue = max(stats.peak_queue, (long long)ready_queue.size()));
+
+        // Preempt when a waiting burst is predicted to finish sooner than the running one
+        if (current_task != nullptr && !ready_queue.empty()) {
+            double running_key = predicted[current] - (current_task->service_time - current_task->remaining_time);
+            if (key[ready_queue.top()] < running_key) {
+                enqueue(current);
+                current_task = nullptr;
             }
         }
 
-        // Start of printing and formatting
-        cout << setw(3) << time;
-        if (current_task) {
-            cout << setw(5) << current_task->id << current_task->remaining_time;
-        } else {
-            cout << setw(10);
+        // If CPU is idle and other tasks are waiting then fetch the next task
+        if (current_task == nullptr && !ready_queue.empty()) {
+            current = ready_queue.pop();
+            current_task = &tasks[current];
+            STAT(stats.events++; stats.pops++);
         }
 
-        if(!v)
+        if (out) {
+            out << setw(3) << time;
+            if (current_task != nullptr) {
+                out << setw(5) << current_task->id << current_task->remaining_time;
+            } else {
+                out << setw(10);
+            }
 
-        cout << "    ";
-        if (task_queue.empty()) {
-            cout << "--";
-        } else {
-            queue<Task*> temp_queue = task_queue;
-            // Printing the ready queue
-            while (!temp_queue.empty()) {
-                Task* waiting_task = temp_queue.front();
-                temp_queue.pop();
-                cout << waiting_task->id << waiting_task->remaining_time;
-                if (!temp_queue.empty()) cout << ",";
+            out << "    ";
+            if (ready_queue.empty()) {
+                out << "--";
+            } else {
+                // Printing the ready queue in predicted order
+                vector<int> tasks_in_queue = ready_queue.items();
+                sort(tasks_in_queue.begin(), tasks_in_queue.end(), [&](int a, int b) {
+                    return key[a] < key[b] || (key[a] == key[b] && a < b);
+                });
+                for (int i : tasks_in_queue) {
+                    out << tasks[i].id << tasks[i].remaining_time;
+                    if (i != tasks_in_queue.back()) out << ", ";
+                }
             }
+            out << endl;
         }
-        cout << endl;
 
-        // Processing the current task
-        if (current_task) {
+        if (current_task != nullptr) {
             current_task->remaining_time--;
-            if (current_task->remaining_time == 0) { 
+
+            if (current_task->remaining_time == 0) {
                 current_task->completion_time = time + 1;
-                current_task->wait_time = start_time - current_task->arrival_time;
-                current_task = nullptr; 
+                current_task->response_time = current_task->completion_time - current_task->arrival_time;
+                STAT(stats.events++);
+
+                double error = predicted[current] - current_task->service_time;
+                bursts++;
+                error_sum += error;
+                abs_error_sum += fabs(error);
+                squared_error_sum += error * error;
+                max_abs_error = max(max_abs_error, fabs(error));
+
+                // Fold the finished burst into its process's estimate and re-key the
+                // process's other waiting bursts where they sit in the heap
+                int p = process[current];
+                tau[p] = alpha * current_task->service_time + (1 - alpha) * tau[p];
+                vector<int>& queued = waiting[p];
+                for (vector<int>::size_type j = 0; j < queued.size(); ) {
+                    int i = queued[j];
+                    if (!ready_queue.contains(i)) {
+                        listed[i] = false;
+                        queued[j] = queued.back();
+                        queued.pop_back();
+                        continue;
+                    }
+                    double old_key = key[i];
+                    predicted[i] = tau[p];
+                    key[i] = predicted[i] - (tasks[i].service_time - tasks[i].remaining_time);
+                    if (key[i] < old_key) ready_queue.decrease_key(i);
+                    else if (key[i] > old_key) ready_queue.increase_key(i);
+                    j++;
+                }
+
+                current_task = nullptr;
+                current = -1;
             }
         }
+
         time++;
-        hasRemainingTasks = it != tasks.end();
-        isQueueNotEmpty = !task_queue.empty();
-        isProcessingTask = current_task != nullptr;
     }
-    
+    trace_counter.stop();
+    stats.loop_ms += elapsed_ms(phase);
+
+    phase = chrono::steady_clock::now();
+    for (auto& task : tasks) {
+        task.wait_time = task.completion_time - task.arrival_time - task.service_time;
+    }
+
     // Menu output
-    cout << "\n     arrival service completion response wait";
-    cout << "\ntid   time    time      time      time   time";
-    cout << "\n---  ------- ------- ---------- -------- ----\n";
+    out << "\n     arrival service completion response wait";
+    out << "\ntid   time    time      time      time   time";
+    out << "\n---  ------- ------- ---------- -------- ----\n";
     for (const Task& task : tasks) {
-        cout << " " << task.id << setw(7)
+        out << " " << task.id << setw(7)
              << task.arrival_time << setw(8)
              << task.service_time << setw(10)
              << task.completion_time << setw(10)
@@ -158,141 +2492,200 @@ void simulate_fifo(vector<Task>& tasks) {
              << task.wait_time << "\n";
     }
 
-    cout << "\nservice wait\n time   time\n";
-    cout << "------- ----\n";
+    out << "\nprediction error (predicted - actual burst)\n";
+    out << "bursts  mean error  mean abs   rms   max abs\n";
+    out << "------  ---------- -------- ------- -------\n";
+    if (bursts > 0) {
+        ios::fmtflags flags = out.flags();
+        out << fixed << setprecision(2)
+             << setw(6) << bursts
+             << setw(12) << error_sum / bursts
+             << setw(9) << abs_error_sum / bursts
+             << setw(8) << sqrt(squared_error_sum / bursts)
+             << setw(8) << max_abs_error << "\n";
+        out.flags(flags);
+    }
+
+    out << "\nservice wait\n time   time\n";
+    out << "------- ----\n";
     sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
         if (a.service_time == b.service_time) return a.arrival_time < b.arrival_time;
         return a.service_time < b.service_time;
     });
     for (const Task& task : tasks) {
-        cout << setw(4) << task.service_time << "\t" << setw(3) << task.wait_time << "\n";
+        out << setw(4) << task.service_time << "\t" << setw(3) << task.wait_time << "\n";
     }
-
+    stats.report_ms += elapsed_ms(phase);
 }
 
-void simulate_sjf(vector<Task>& tasks) {
-    int time = 0;
-    bool check_idle = true;
-    Task* current_task = nullptr;
-    vector<Task>::iterator it = tasks.begin();
-    
+// Core topology: comma separated speed factors, each optionally repeated with *count,
+// e.g. "2*4,1*4" is four cores at twice the speed of the other four
+bool parse_cores(const string& spec, vector<double>& speeds) {
+    speeds.clear();
+    istringstream fields(spec);
+    string core;
+    while (getline(fields, core, ',')) {
+        double speed;
+        int count = 1;
+        char star;
+        istringstream parts(core);
+        if (!(parts >> speed) || speed <= 0) return false;
+        if (parts >> star && (star != '*' || !(parts >> count) || count <= 0)) return false;
+        speeds.insert(speeds.end(), count, speed);
+    }
+    return !speeds.empty();
+}
 
-    // Using a lambda function for simplicity when comparing
-    // Comp compairs the remainng time of two tasks
-    auto comp = [](const Task* a, const Task* b) {
-        return a->remaining_time > b->remaining_time;
+// Non-preemptive FIFO over cores of different speeds. A core of speed s completes s
+// units of service per tick. Placement: a task whose service is at most short_service
+// goes to the fastest idle core, a longer one to the slowest idle core, which keeps the
+// fast cores free for short work. short_service < 0 means the trace's mean service.
+//
+// Energy is a proxy, not joules: a busy core draws speed^3 per tick (dynamic power under
+// voltage/frequency scaling) and an idle core a tenth of that.
+void simulate_hetero(vector<Task>& tasks, const vector<double>& speeds, double short_service, ostream& out) {
+    struct Core {
+        double speed;
+        int task = -1;
+        double work_left = 0;
+        long long busy_ticks = 0;
+    };
+    struct CoreClass {
+        int cores = 0;
+        long long busy_ticks = 0;
+        long long tasks_done = 0;
+        long long work_done = 0;
+        long long turnaround_sum = 0;
     };
+    const double IDLE_POWER = 0.1;
 
-    // Sorts tasks by remaining time using comp
-    priority_queue<Task*, vector<Task*>, decltype(comp)> ready_queue(comp);
+    int time = 0;
+    queue<int> ready_queue;
+    vector<Task>::size_type task_index = 0;
+    int busy = 0;
+
+    vector<Core> cores;
+    map<double, CoreClass, greater<double>> classes;
+    set<pair<double, int>> idle;    // (speed, core) so both ends are the fastest and slowest
+    for (double speed : speeds) {
+        Core core;
+        core.speed = speed;
+        idle.insert({ speed, (int)cores.size() });
+        cores.push_back(core);
+        classes[speed].cores++;
+    }
 
-    // Sorting by arrival time
-    sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
+    // Sorting tasks by arrival time
+    auto phase = chrono::steady_clock::now();
+    stable_sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
         return a.arrival_time < b.arrival_time;
     });
+    stats.sort_ms += elapsed_ms(phase);
 
-    for (auto it = tasks.begin(); it != tasks.end(); ++it) {
-        it->wait_time = 0;
-        it->response_time = -1;
+    if (short_service < 0) {
+        double total = 0;
+        for (const Task& task : tasks) total += task.service_time;
+        short_service = tasks.empty() ? 0 : total / tasks.size();
     }
 
-    cout << "SJF(preemptive) scheduling results\n\n";
-    cout << "time   cpu   ready queue (tid/rst)\n";
-    cout << "----   ---   ---------------------\n";
-
-    // Driver loop for SJF with boolean update variables
-    bool hasRemainingTasks = it != tasks.end();
-    bool isQueueNotEmpty = !ready_queue.empty();
-    bool isProcessingTask = current_task != nullptr;
-
-    while (hasRemainingTasks || isQueueNotEmpty || isProcessingTask) {
-        while (it != tasks.end() && it->arrival_time <= time) {
-            // Check if a new task should preempt the current task or if CPU is idle
-            bool preempt = current_task != nullptr && it->service_time < current_task->remaining_time;
+    out << "HETERO scheduling results (core speeds";
+    for (const Core& core : cores) out << " " << core.speed;
+    out << ", short tasks <= " << short_service << ")\n\n";
+    out << "time   cpus (tid/rst)   ready queue (tid/rst)\n";
+    out << "----   --------------   ---------------------\n";
 
-            // If a new task should preempt the current task or CPU is idle then push the current task to the queue
-            if (check_idle || preempt) {
-                if (current_task != nullptr) {
-                    ready_queue.push(current_task);
-                }
-                current_task = &(*it);
-                check_idle = false;
-            } else {
-                ready_queue.push(&(*it));
-            }
-            ++it;
+    TraceCounter trace_counter(out);
+    phase = chrono::steady_clock::now();
+    while (task_index < tasks.size() || !ready_queue.empty() || busy > 0) {
+        // Add tasks if they arrived
+        while (task_index < tasks.size() && tasks[task_index].arrival_time <= time) {
+            ready_queue.push(task_index++);
+            STAT(stats.events++; stats.pushes++);
         }
+        STAT(stats.peak_queue = max(stats.peak_queue, (long long)ready_queue.size()));
 
-
-        // If CPU is idle and other tasks are waiting then fetch the next task
-        if (check_idle && !ready_queue.empty()) {
-            current_task = ready_queue.top();
+        // Place waiting tasks on idle cores in arrival order
+        while (!idle.empty() && !ready_queue.empty()) {
+            int i = ready_queue.front();
             ready_queue.pop();
-            check_idle = false;
+            auto slot = tasks[i].service_time <= short_service ? prev(idle.end()) : idle.begin();
+            Core& core = cores[slot->second];
+            idle.erase(slot);
+
+            core.task = i;
+            core.work_left = tasks[i].service_time;
+            tasks[i].start_time = time;
+            tasks[i].wait_time = time - tasks[i].arrival_time;
+            busy++;
+            STAT(stats.events++; stats.pops++);
         }
 
-
-        cout << setw(3) << time;
-        if (!check_idle) {
-            cout << setw(5) << current_task->id << current_task->remaining_time;
-            current_task->remaining_time--;
-
-            // Check if task is completed
-            if (current_task->remaining_time <= 0) {
-                current_task->completion_time = time + 1;
-                if (current_task->response_time == -1) {
-                    current_task->response_time = current_task->completion_time - current_task->arrival_time;
+        if (out) {
+            out << setw(3) << time << "   ";
+            for (const Core& core : cores) {
+                if (core.task >= 0) {
+                    out << " " << tasks[core.task].id << setw(3) << left << tasks[core.task].remaining_time << right;
+                } else {
+                    out << " --  ";
                 }
-                current_task = nullptr;
-                check_idle = true;
             }
-        } else {
-            cout << setw(10);
-        }
-
-        cout << "    ";
-        if (ready_queue.empty()) {
 
-            cout << "--";
-        } else {
-            vector<Task*> tasks_in_queue;
-            priority_queue<Task*, vector<Task*>, decltype(comp)> tempQueue = ready_queue;
-
-            while (!tempQueue.empty()) {
-                Task* task = tempQueue.top();
-                tempQueue.pop();
-                tasks_in_queue.push_back(task);
+            out << "   ";
+            if (ready_queue.empty()) {
+                out << "--";
+            } else {
+                // Printing the ready queue
+                queue<int> temp_queue = ready_queue;
+                while (!temp_queue.empty()) {
+                    const Task& task = tasks[temp_queue.front()];
+                    temp_queue.pop();
+                    out << task.id << task.remaining_time;
+                    if (!temp_queue.empty()) out << ", ";
+                }
             }
+            out << endl;
+        }
 
-            sort(tasks_in_queue.begin(), tasks_in_queue.end(), [](const Task* a, const Task* b) {
-                return a->remaining_time < b->remaining_time; 
-            });
-
-            for (Task* task : tasks_in_queue) {
-                cout << task->id << task->remaining_time;
-                if(task != tasks_in_queue.back()) cout << ", ";
+        // Each busy core does speed units of work this tick
+        for (vector<Core>::size_type c = 0; c < cores.size(); c++) {
+            Core& core = cores[c];
+            if (core.task < 0) continue;
+
+            Task& task = tasks[core.task];
+            core.busy_ticks++;
+            core.work_left -= core.speed;
+            task.remaining_time = (int)ceil(max(core.work_left, 0.0) - 1e-9);
+
+            if (task.remaining_time == 0) {
+                task.completion_time = time + 1;
+                task.response_time = task.completion_time - task.arrival_time;
+
+                CoreClass& cls = classes[core.speed];
+                cls.tasks_done++;
+                cls.work_done += task.service_time;
+                cls.turnaround_sum += task.completion_time - task.arrival_time;
+
+                core.task = -1;
+                idle.insert({ core.speed, (int)c });
+                busy--;
+                STAT(stats.events++);
             }
+        }
 
-        } 
-        cout << endl;
-
-        // Update trackers
         time++;
-        hasRemainingTasks = it != tasks.end();
-        isQueueNotEmpty = !ready_queue.empty();
-        isProcessingTask = current_task != nullptr;
     }
+    trace_counter.stop();
+    stats.loop_ms += elapsed_ms(phase);
 
-    for (auto& task : tasks) {
-        task.wait_time = task.completion_time - task.arrival_time - task.service_time;
-    }
+    phase = chrono::steady_clock::now();
+    for (const Core& core : cores) classes[core.speed].busy_ticks += core.busy_ticks;
 
     // Menu output
-    cout << "\n     arrival service completion response wait";
-    cout << "\ntid   time    time      time      time   time";
-    cout << "\n---  ------- ------- ---------- -------- ----\n";
+    out << "\n     arrival service completion response wait";
+    out << "\ntid   time    time      time      time   time";
+    out << "\n---  ------- ------- ---------- -------- ----\n";
     for (const Task& task : tasks) {
-        cout << " " << task.id << setw(7)
+        out << " " << task.id << setw(7)
              << task.arrival_time << setw(8)
              << task.service_time << setw(10)
              << task.completion_time << setw(10)
@@ -300,141 +2693,429 @@ void simulate_sjf(vector<Task>& tasks) {
              << task.wait_time << "\n";
     }
 
-    cout << "\nservice wait\n time   time\n";
-    cout << "------- ----\n";
+    // Per core class: utilization over the whole run, tasks finished per 1000 ticks,
+    // mean turnaround of the tasks that ran there, and the energy proxy
+    out << "\nspeed cores   busy   util  tasks   work  tasks/1k  mean tat   energy\n";
+    out << "----- ----- ------ ------ ------ ------ --------- --------- --------\n";
+    ios::fmtflags flags = out.flags();
+    out << fixed << setprecision(2);
+    for (const auto& entry : classes) {
+        double speed = entry.first;
+        const CoreClass& cls = entry.second;
+        long long capacity = (long long)cls.cores * time;
+        double power = speed * speed * speed;
+        double energy = cls.busy_ticks * power + (capacity - cls.busy_ticks) * power * IDLE_POWER;
+        out << setw(5) << speed
+             << setw(6) << cls.cores
+             << setw(7) << cls.busy_ticks
+             << setw(7) << (capacity ? (double)cls.busy_ticks / capacity : 0.0)
+             << setw(7) << cls.tasks_done
+             << setw(7) << cls.work_done
+             << setw(10) << (time ? 1000.0 * cls.tasks_done / time : 0.0)
+             << setw(10) << (cls.tasks_done ? (double)cls.turnaround_sum / cls.tasks_done : 0.0)
+             << setw(9) << energy << "\n";
+    }
+    out.flags(flags);
+
+    out << "\nservice wait\n time   time\n";
+    out << "------- ----\n";
     sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
         if (a.service_time == b.service_time) return a.arrival_time < b.arrival_time;
         return a.service_time < b.service_time;
     });
     for (const Task& task : tasks) {
-        cout << setw(4) << task.service_time << "\t" << setw(3) << task.wait_time << "\n";
+        out << setw(4) << task.service_time << "\t" << setw(3) << task.wait_time << "\n";
     }
+    stats.report_ms += elapsed_ms(phase);
 }
 
-void simulate_rr(vector<Task>& tasks) {
-    queue<Task*> queue;
-    vector<Task*> all_tasks;
-    vector<Task>::size_type task_index = 0;
-
+// Preemptive static priority scheduling with aging. Every `age` ticks a waiting task
+// moves up a level; a task runs at the level it was dispatched at and drops back to its
+// static priority if it is preempted. A waiting task preempts the running one when its
+// level is strictly better. An age of 0 turns aging off.
+void simulate_prio(vector<Task>& tasks, int age, ostream& out) {
     int time = 0;
-    const int time_quantum = 1; 
     Task* current_task = nullptr;
-    int time_slice = 0; 
+    int current = -1, current_level = 0;
+    vector<Task>::size_type task_index = 0;
 
     // Sorting tasks by arrival time
-    sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
+    auto phase = chrono::steady_clock::now();
+    stable_sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
         return a.arrival_time < b.arrival_time;
     });
-    
+    stats.sort_ms += elapsed_ms(phase);
+
+    for (auto& task : tasks) {
+        task.wait_time = 0;
+        task.response_time = -1;
+    }
 
-    cout << "RR scheduling results (time slice is 1)\n\n";
-    cout << "time   cpu   ready queue (tid/rst)\n";
-    cout << "----   ---   ---------------------\n";
+    PriorityArray ready_queue(tasks.size());
 
-    // Driver loop for RR and update variables
-    bool hasUnprocessedTasks = task_index < tasks.size();
-    bool hasTasksInQueue = !queue.empty();
-    bool isCurrentlyProcessingTask = current_task != nullptr;
+    out << "PRIORITY(preemptive, ";
+    if (age > 0) out << "aging every " << age << " ticks";
+    else out << "no aging";
+    out << ") scheduling results\n\n";
+    out << "time   cpu   ready queue (tid/rst)\n";
+    out << "----   ---   ---------------------\n";
+
+    TraceCounter trace_counter(out);
+    phase = chrono::steady_clock::now();
+    while (task_index < tasks.size() || !ready_queue.empty() || current_task != nullptr) {
+        if (age > 0) ready_queue.advance(time / age);
 
-    while (hasUnprocessedTasks || hasTasksInQueue || isCurrentlyProcessingTask) {
         // Add tasks if they arrived
         while (task_index < tasks.size() && tasks[task_index].arrival_time <= time) {
-            queue.push(&tasks[task_index]);
-            all_tasks.push_back(&tasks[task_index]);
+            ready_queue.push(task_index, tasks[task_index].priority);
             task_index++;
+            STAT(stats.events++; stats.pushes++);
         }
+        STAT(stats.peak_queue = max(stats.peak_queue, (long long)ready_queue.size()));
 
-        // Fetch next task if CPU is idle
-        if (current_task == nullptr || current_task->remaining_time == 0 || time_slice == 0) {
-            if (current_task != nullptr && current_task->remaining_time > 0) {
-                queue.push(current_task);
-            }
-            
-
-            // Queue state assignment
-            current_task = queue.empty() ? nullptr : queue.front();
-
-            // If the task is not null then pop it from the queue and assign the start time
-            if (current_task != nullptr) {
-                queue.pop();
-                if (current_task->start_time == -1) {
-                    current_task->start_time = time;
-                }
-                time_slice = time_quantum;
-            }
+        if (current_task != nullptr && !ready_queue.empty() && ready_queue.top_level() < current_level) {
+            ready_queue.push(current, current_task->priority);
+            current_task = nullptr;
+            STAT(stats.events++; stats.pushes++);
         }
 
-
-        // Stop printing time if all tasks are completed
-        if (queue.empty() && current_task == nullptr && task_index >= tasks.size()) {
-            break;
+        // If CPU is idle and other tasks are waiting then fetch the next task
+        if (current_task == nullptr && !ready_queue.empty()) {
+            current_level = ready_queue.top_level();
+            current = ready_queue.pop();
+            current_task = &tasks[current];
+            STAT(stats.events++; stats.pops++);
         }
 
-        cout << setw(3) << time;
-        if (current_task) {
-            cout << setw(5) << current_task->id << current_task->remaining_time;
-        } else {
-            cout << setw(10);
-        }
+        if (out) {
+            out << setw(3) << time;
+            if (current_task != nullptr) {
+                out << setw(5) << current_task->id << current_task->remaining_time;
+            } else {
+                out << setw(10);
+            }
 
-        
-        cout << "    ";
-        if (queue.empty()) {
-            cout << "--";
-        } else {
-            // Printing the ready queue
-            std::queue<Task*> temp_queue = queue;
-            while (!temp_queue.empty()) {
-                Task* task = temp_queue.front();
-                temp_queue.pop();
-                cout << task->id << task->remaining_time;
-                if (!temp_queue.empty()) cout << ", ";
+            out << "    ";
+            if (ready_queue.empty()) {
+                out << "--";
+            } else {
+                // Printing the ready queue best level first
+                vector<int> tasks_in_queue = ready_queue.items();
+                for (int i : tasks_in_queue) {
+                    out << tasks[i].id << tasks[i].remaining_time;
+                    if (i != tasks_in_queue.back()) out << ", ";
+                }
             }
+            out << endl;
         }
-        cout << endl;
 
-        // Processing the current task and assigning values to completion, response, and wait times
         if (current_task != nullptr) {
             current_task->remaining_time--;
-            time_slice--;
 
             if (current_task->remaining_time == 0) {
                 current_task->completion_time = time + 1;
-
-                if (current_task->response_time == 0) {
-                    current_task->response_time = current_task->completion_time - current_task->arrival_time;
-                }
-                current_task->wait_time = current_task->completion_time - current_task->arrival_time - current_task->service_time;
+                current_task->response_time = current_task->completion_time - current_task->arrival_time;
+                current_task = nullptr;
+                current = -1;
+                STAT(stats.events++);
             }
         }
 
-        // Update trackers
         time++;
-        hasUnprocessedTasks = task_index < tasks.size();
-        hasTasksInQueue = !queue.empty();
-        isCurrentlyProcessingTask = current_task != nullptr;
+    }
+    trace_counter.stop();
+    stats.loop_ms += elapsed_ms(phase);
+
+    phase = chrono::steady_clock::now();
+    for (auto& task : tasks) {
+        task.wait_time = task.completion_time - task.arrival_time - task.service_time;
     }
 
     // Menu output
-    cout << "\n     arrival service completion response wait";
-    cout << "\ntid   time    time      time      time   time";
-    cout << "\n---  ------- ------- ---------- -------- ----\n";
+    out << "\n     arrival service priority completion response wait";
+    out << "\ntid   time    time             time      time   time";
+    out << "\n---  ------- ------- -------- ---------- -------- ----\n";
     for (const Task& task : tasks) {
-        cout << " " << task.id << setw(7)
+        out << " " << task.id << setw(7)
              << task.arrival_time << setw(8)
-             << task.service_time << setw(10)
+             << task.service_time << setw(9)
+             << task.priority << setw(10)
              << task.completion_time << setw(10)
              << task.response_time << setw(7)
              << task.wait_time << "\n";
     }
-    cout << "\nservice wait\n time   time\n";
-    cout << "------- ----\n";
 
+    // Per priority level, to compare latency-critical and batch classes
+    map<int, pair<long long, long long>> by_priority;   // priority -> tasks, wait sum
+    map<int, int> max_wait;
+    for (const Task& task : tasks) {
+        by_priority[task.priority].first++;
+        by_priority[task.priority].second += task.wait_time;
+        max_wait[task.priority] = max(max_wait[task.priority], task.wait_time);
+    }
+    out << "\npriority tasks mean wait max wait\n";
+    out << "-------- ----- --------- --------\n";
+    ios::fmtflags flags = out.flags();
+    out << fixed << setprecision(2);
+    for (const auto& level : by_priority) {
+        out << setw(8) << level.first << setw(6) << level.second.first
+             << setw(10) << (double)level.second.second / level.second.first
+             << setw(9) << max_wait[level.first] << "\n";
+    }
+    out.flags(flags);
+
+    out << "\nservice wait\n time   time\n";
+    out << "------- ----\n";
     sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
         if (a.service_time == b.service_time) return a.arrival_time < b.arrival_time;
         return a.service_time < b.service_time;
     });
     for (const Task& task : tasks) {
-        cout << setw(4) << task.service_time << "\t" << setw(3) << task.wait_time << "\n";
+        out << setw(4) << task.service_time << "\t" << setw(3) << task.wait_time << "\n";
+    }
+    stats.report_ms += elapsed_ms(phase);
+}
+
+// A task on one server of the cluster. Only its completion time is tracked: under
+// all three server policies wait is turnaround - service and response is turnaround.
+struct ClusterJob {
+    int arrival;
+    int service;
+    int remaining;
+};
+
+// One single-cpu server running fifo, sjf or rr with the same queue order and tie
+// rules as the engines. Servers advance lazily: the state is that at the top of tick
+// `now`, before the tick's arrivals, so a dispatch due at `now` waits for them.
+struct Server {
+    long long now = 0;
+    bool busy = false;
+    ClusterJob current;
+    deque<ClusterJob> queue;        // fifo and rr
+    vector<ClusterJob> heap;        // sjf, laid out like simulate_sjf's priority_queue
+    long long served = 0;
+    long long peak = 0;
+
+    size_t in_system() const { return queue.size() + heap.size() + busy; }
+};
+
+class Cluster {
+public:
+    Cluster(int servers, char policy) : servers(servers), policy(policy) {}
+
+    vector<Server> servers;
+    TraceSummary summary;
+
+    // Runs server s up to the top of tick t
+    void advance(int s, long long t) {
+        Server& server = servers[s];
+        if (policy == 'r') {
+            // Quantum 1: whatever ran last tick goes behind the tick's arrivals
+            while (server.now < t) {
+                if (server.busy) {
+                    server.queue.push_back(server.current);
+                    server.busy = false;
+                    STAT(stats.events++; stats.pushes++);
+                }
+                if (server.queue.empty()) break;
+                server.current = server.queue.front();
+                server.queue.pop_front();
+                server.busy = true;
+                STAT(stats.events++; stats.pops++);
+                if (--server.current.remaining == 0) {
+                    server.busy = false;
+                    complete(server, server.now + 1);
+                }
+                server.now++;
+            }
+        } else {
+            while (true) {
+                if (!server.busy) {
+                    if ((server.queue.empty() && server.heap.empty()) || server.now >= t) break;
+                    if (policy == 'f') {
+                        server.current = server.queue.front();
+                        server.queue.pop_front();
+                    } else {
+                        pop_heap(server.heap.begin(), server.heap.end(), shorter);
+                        server.current = server.heap.back();
+                        server.heap.pop_back();
+                    }
+                    server.busy = true;
+                    STAT(stats.events++; stats.pops++);
+                }
+                long long done = server.now + server.current.remaining;
+                if (done > t) {
+                    server.current.remaining -= t - server.now;
+                    break;
+                }
+                server.now = done;
+                server.busy = false;
+                complete(server, done);
+            }
+        }
+        server.now = max(server.now, t);
+    }
+
+    // Queues a job on server s, which must have been advanced to its arrival
+    void arrive(int s, const ClusterJob& job) {
+        Server& server = servers[s];
+        if (policy != 's') {
+            server.queue.push_back(job);
+        } else if (!server.busy) {
+            server.current = job;
+            server.busy = true;
+        } else if (job.service < server.current.remaining) {
+            server.heap.push_back(server.current);
+            push_heap(server.heap.begin(), server.heap.end(), shorter);
+            server.current = job;
+        } else {
+            server.heap.push_back(job);
+            push_heap(server.heap.begin(), server.heap.end(), shorter);
+        }
+        server.peak = max(server.peak, (long long)server.in_system());
+        STAT(stats.events++; stats.pushes++; stats.peak_queue = max(stats.peak_queue, server.peak));
+    }
+
+    // Tick at which server s next finishes a job if nothing else arrives
+    double next_change(int s) const {
+        const Server& server = servers[s];
+        if (policy == 'r') {
+            // Jobs take one tick each in queue order, then the one that just ran, and
+            // around again; position p with r ticks left finishes after (r - 1) * n + p + 1
+            long long n = server.in_system(), best = LLONG_MAX;
+            for (size_t p = 0; p < server.queue.size(); p++) {
+                best = min(best, (server.queue[p].remaining - 1) * n + (long long)p + 1);
+            }
+            if (server.busy) best = min(best, (server.current.remaining - 1) * n + (long long)server.queue.size() + 1);
+            return best == LLONG_MAX ? HUGE_VAL : server.now + best;
+        }
+        if (server.busy) return server.now + server.current.remaining;
+        if (!server.queue.empty()) return server.now + server.queue.front().remaining;
+        if (!server.heap.empty()) return server.now + server.heap.front().remaining;
+        return HUGE_VAL;
+    }
+
+private:
+    static bool shorter(const ClusterJob& a, const ClusterJob& b) { return a.remaining > b.remaining; }
+
+    void complete(Server& server, long long time) {
+        long long turnaround = time - server.current.arrival;
+        long long wait = turnaround - server.current.service;
+        summary.tasks++;
+        summary.makespan = max(summary.makespan, time);
+        summary.wait_sum += wait;
+        summary.response_sum += turnaround;
+        summary.turnaround_sum += turnaround;
+        summary.max_wait = max(summary.max_wait, wait);
+        server.served++;
+        STAT(stats.events++);
     }
-}
\ No newline at end of file
+
+    char policy;
+};
+
+// Streams "arrival service" lines from stdin, which must be in arrival order, through
+// a front-end dispatcher onto single-cpu servers. Only live jobs are held in memory.
+// jsq keeps every server's job count in an indexed heap, and the servers' next
+// completion ticks in another so counts are brought up to date without a pass over
+// all servers per arrival; the other routes only touch the servers they pick.
+int run_cluster(int servers, const string& route, int choices, unsigned long long seed, char policy) {
+    Cluster cluster(servers, policy);
+    vector<double> load(servers, 0), change(servers, HUGE_VAL);
+    IndexedHeap shortest(load), next(change);
+    bool jsq = route == "jsq";
+    if (jsq) {
+        for (int s = 0; s < servers; s++) {
+            shortest.push(s);
+            next.push(s);
+        }
+    }
+    auto refresh = [&](int s) {
+        double count = cluster.servers[s].in_system(), at = cluster.next_change(s);
+        swap(load[s], count);
+        if (load[s] < count) shortest.decrease_key(s);
+        else if (load[s] > count) shortest.increase_key(s);
+        swap(change[s], at);
+        if (change[s] < at) next.decrease_key(s);
+        else if (change[s] > at) next.increase_key(s);
+    };
+
+    mt19937_64 rng(seed);
+    uniform_int_distribution<int> pick(0, servers - 1);
+    long long dispatched = 0;
+    long previous = 0;
+    char* line = nullptr;
+    size_t capacity = 0;
+    int status = 0;
+
+    auto phase = chrono::steady_clock::now();
+    while (getline(&line, &capacity, stdin) > 0) {
+        char* end;
+        long arrival = strtol(line, &end, 10);
+        char* field = end;
+        long service = strtol(field, &end, 10);
+        if (field == line || end == field || service < 1) break;
+        if (arrival < previous) {
+            cerr << "Cluster input must be in arrival order (line " << dispatched + 1 << ")\n";
+            status = 1;
+            break;
+        }
+        previous = arrival;
+
+        int target;
+        if (jsq) {
+            while (!next.empty() && change[next.top()] <= arrival) {
+                int s = next.top();
+                cluster.advance(s, arrival);
+                refresh(s);
+            }
+            target = shortest.top();
+        } else if (route == "roundrobin") {
+            target = dispatched % servers;
+        } else {
+            target = pick(rng);
+            if (route == "pod") {
+                // Ties keep the first server drawn
+                cluster.advance(target, arrival);
+                for (int i = 1; i < choices; i++) {
+                    int s = pick(rng);
+                    cluster.advance(s, arrival);
+                    if (cluster.servers[s].in_system() < cluster.servers[target].in_system()) target = s;
+                }
+            }
+        }
+        cluster.advance(target, arrival);
+        cluster.arrive(target, { (int)arrival, (int)service, (int)service });
+        if (jsq) refresh(target);
+        dispatched++;
+    }
+    free(line);
+    for (int s = 0; s < servers; s++) cluster.advance(s, LLONG_MAX);
+    stats.loop_ms += elapsed_ms(phase);
+
+    const char* names[] = { "FIFO", "SJF", "RR" };
+    const char* name = names[policy == 'f' ? 0 : policy == 's' ? 1 : 2];
+    cout << "CLUSTER scheduling results (" << servers << " " << name << " servers, "
+         << route << " routing" << (route == "pod" ? ", d = " + to_string(choices) : "") << ")\n\n";
+    cout << "    tasks   makespan  mean wait  mean resp   mean tat   max wait\n";
+    cout << "--------- ---------- ---------- ---------- ---------- ----------\n";
+
+    const TraceSummary& row = cluster.summary;
+    double n = row.tasks ? row.tasks : 1;
+    ios::fmtflags flags = cout.flags();
+    cout << fixed << setprecision(2)
+         << setw(9) << row.tasks << setw(11) << row.makespan
+         << setw(11) << row.wait_sum / n << setw(11) << row.response_sum / n
+         << setw(11) << row.turnaround_sum / n << setw(11) << row.max_wait << "\n";
+    cout.flags(flags);
+
+    auto by_served = [](const Server& a, const Server& b) { return a.served < b.served; };
+    auto busiest = max_element(cluster.servers.begin(), cluster.servers.end(), by_served);
+    auto idlest = min_element(cluster.servers.begin(), cluster.servers.end(), by_served);
+    long long peak = 0;
+    for (const Server& server : cluster.servers) peak = max(peak, server.peak);
+    cout << "\ntasks per server   " << idlest->served << " to " << busiest->served << "\n";
+    cout << "peak jobs on one server   " << peak << "\n";
+
+    return status;
+}
@@ -4,33 +4,53 @@
  *
  * - the directory is a single-level table
  * - storage blocks are mapped with a file allocation table
- * - a file can only have one open at a time => the current byte
- *     offset (i.e., the file pointer) can be placed in the
- *     directory entry instead of a per-open data structure
+ * - a file can be open several times at once (many readers and
+ *     one writer); the current byte offset (i.e., the file pointer)
+ *     of each open is kept in an in-memory open file table, and a
+ *     directory entry holds only what is stored on the volume
  * - there are no file permissions and no permission checking
  * - file name aliases are not supported
  *
- * - for this file system, we define 256 storage blocks of 128
- *     bytes each
- * - the storage blocks are assigned as:
- *     0 - 1:   directory, 16 entries of 16 bytes each
- *     2 - 3:   file allocation table, 256 entries of 1 byte each
- *     4 - 255: storage blocks containing file data; note that a
- *                storage block is assigned to an individual file
- *                and cannot be shared between files
- *
- * - the directory would normally occupy the first two storage
- *     blocks, although in this program we keep the directory as
- *     an in-memory table
- * - a directory entry is 16 bytes (with 9 bytes for the name string)
- *
- *     +--------+--------+--------+--------+--------+---------...-+
- *     | status | first_ |  size  |  byte_ | current|  name       |
- *     |        | block  |        | offset | _block |             |
- *     +--------+--------+--------+--------+--------+---------...-+
- *       1 byte   1 byte   2 bytes  2 bytes  1 byte    9 bytes
- *
- * - the status is encoded as: 0 = unused, 1 = closed, 2 = open
+ * - the geometry of a volume is chosen when it is formatted by
+ *     tfs_format(): the number of storage blocks, the block size
+ *     (a power of two from 64 bytes up to 64 KB), and the number
+ *     of directory entries; tfs_init() formats the default volume
+ *     of 256 storage blocks of 128 bytes each with 16 directory
+ *     entries
+ * - the storage blocks are assigned in this order, with each
+ *     region rounded up to a whole number of blocks:
+ *     directory:               N_DIRECTORY_ENTRIES entries of
+ *                                32 bytes each, starting at block 0
+ *     file allocation table:   N_BLOCKS entries of 4 bytes each,
+ *                                starting at FAT_BLOCK
+ *     FIRST_VALID_BLOCK - LAST_VALID_BLOCK:
+ *                              storage blocks containing file data;
+ *                                note that a storage block is
+ *                                assigned to an individual file and
+ *                                cannot be shared between files
+ *     for the default volume this gives blocks 0 - 3 for the
+ *       directory, 4 - 11 for the FAT, and 12 - 255 for file data
+ * - directory entry 0 is never a file, so its slot holds the
+ *     superblock, which records the geometry of the volume
+ *
+ * - a volume is either held in memory (tfs_init() or tfs_format())
+ *     or is a volume image file mapped with tfs_mount(), in which
+ *     case the mapping is the storage and changes persist in the
+ *     file; tfs_sync() writes back the directory, the FAT, and the
+ *     data blocks written since the last sync, and tfs_unmount()
+ *     syncs and releases the mapping
+ *
+ * - a directory entry is 32 bytes (with 9 bytes for the name string)
+ *
+ *     +---------+--------+--------+--------+------...-+
+ *     |  size   | first_ |  last_ | status |  name    |
+ *     |         | block  | block  |        |          |
+ *     +---------+--------+--------+--------+------...-+
+ *       8 bytes  4 bytes  4 bytes  1 byte   9 bytes
+ *                                          (+ 6 bytes padding)
+ *
+ * - the status is encoded as: 0 = unused, 1 = in use; whether the
+ *     file is open is not recorded on the volume
  * - the first storage block of the file, if allocated; zero
  *     means that no storage blocks are currently allocated to the
  *     file; otherwise this is the (0-orgin) index of a storage
@@ -40,6 +60,8 @@
  *     block size; in the cases when it is not, the last block of
  *     the file will have unused bytes (i.e., it will have internal
  *     fragmentation)
+ * - an open file table entry holds the byte offset and current
+ *     storage block of one open of a file
  * - the byte offset is the current file pointer within the file,
  *     which is the (0-origin) index within the length of the
  *     file of the next byte to read or write (note that this
@@ -51,6 +73,9 @@
  *     bits of the byte offset; note that this value is 0 when
  *     the first storage block index is 0 and is 1 when the byte
  *     offset points just beyond the last block of the file
+ * - the last block is the (0-origin) index of the final storage
+ *     block of the file (0 when no blocks are allocated), so a
+ *     block can be appended without walking the chain
  *
  *     example of possible layout of a file using 4-byte blocks
  *       and several non-sequential storage blocks
@@ -78,8 +103,10 @@
  *
  *       directory  first storage block of file is 136
  *         entry    size of file is 18
- *                  byte offset of file is 9
- *                  current storage block of file is 129
+ *
+ *       open file  byte offset of file is 9
+ *         table    current storage block of file is 129
+ *         entry
  *
  *             128 129 130 131 132 133 134 135 136 137 138 139
  *            +---+---+---+---+---+---+---+---+---+---+---+---+---
@@ -93,45 +120,131 @@
  *     contain alphanumeric characters, underscores, and periods;
  *     there are no additional rules for the naming syntax
  *
- * - file descriptors are used as (0-origin) indices into the
- *     directory
- * - a file descriptor has a valid range of 1-15 since in many
- *     cases a return value of 0 indicates an error
+ * - file descriptors are used as (0-origin) indices into the open
+ *     file table, whose first N_DIRECTORY_ENTRIES entries pair up
+ *     with the directory entries: tfs_create() and an open of a file
+ *     that is not already open return the directory index of the
+ *     file, and each further open of the same file gets a descriptor
+ *     past LAST_VALID_FD; a closed file is still named by its
+ *     directory index (e.g., for tfs_delete())
+ * - a directory index has a valid range of 1 to LAST_VALID_FD
+ *     (1-15 for the default volume) since in many cases a return
+ *     value of 0 indicates an error
+ * - every open may read, but only one open of a file may write:
+ *     the first open to write becomes the writer of the file until
+ *     it is closed, and writes through other opens fail meanwhile
  *
- * - the file allocation table would normally occupy the second
- *     two storage blocks, although in this program we keep the
- *     file allocation table as an in-memory table
+ * - block numbers and FAT entries are 32 bits wide, and file
+ *     sizes and byte offsets are 64 bits wide
  * - a storage block number for a file has a valid range of
- *     4-255; a block number of 0 indicates a free block, and
- *     a block number of 1 indicates the last block of a file
+ *     FIRST_VALID_BLOCK to LAST_VALID_BLOCK; a block number of 0
+ *     indicates a free block, and a block number of 1 indicates
+ *     the last block of a file (neither can be a data block since
+ *     the directory and FAT always come first)
+ *
+ * - file names are kept zero-padded to the full name field so that
+ *     two names compare as one 8-byte word; an in-memory hash
+ *     index with one chain per bucket maps a name to its file
+ *     descriptor without scanning the directory
+ *
+ * - the free storage blocks are also tracked in an in-memory
+ *     bitmap (one bit per block, set when the block is free)
+ *     along with a count of free blocks, so that allocation
+ *     scans 64 blocks at a time and a full volume is detected
+ *     without any scan; the bitmap and count agree with the FREE
+ *     entries of the file allocation table, apart from blocks that
+ *     another thread is in the middle of claiming or freeing
+ * - a write that needs several new blocks allocates them as
+ *     extents, runs of blocks that are contiguous in storage and
+ *     chained in ascending order; an extent needs no record of
+ *     its own since the FAT shows it as a block whose entry is
+ *     the next block number, and reads and writes move a whole
+ *     extent with one copy
+ *
+ * - a process may host many volumes, each with its own storage,
+ *     tables, and locks; every call operates on the current volume
+ *     of the calling thread (see struct tfs_volume below), and a
+ *     file descriptor is only meaningful on the volume it came from
+ * - the public functions may be called on one volume from several
+ *     threads at once, except tfs_init(), tfs_format(), tfs_mount(),
+ *     and tfs_unmount(), which replace the volume, and
+ *     tfs_list_blocks(), which is a debugging aid; a descriptor is
+ *     used by one thread at a time, so each thread opens the files it
+ *     uses
+ *   - directory_lock serializes changes to the directory, the name
+ *       index, and the open file table (create, open, close, delete,
+ *       copy, and defrag); it is recursive so that tfs_copy() can
+ *       hold it across the calls it makes
+ *   - each file has a reader-writer lock, held shared by read, seek,
+ *       and size and exclusive by write, so different files are read
+ *       and written in parallel; when both are needed, the directory
+ *       lock is taken first
+ *   - the block allocator takes no lock: blocks are claimed by
+ *       clearing their bits in the free block bitmap with
+ *       compare-and-swap, and the dirty block bitmap and counters
+ *       are updated with atomic operations
+ *
+ * - a mounted image is normally mapped whole, leaving the caching of
+ *     its blocks to the operating system; with a block cache (see
+ *     tfs_set_cache()), only the directory and FAT are mapped, and
+ *     data blocks are read into a fixed number of in-memory frames
+ *     on use, replaced in CLOCK order, and written back to the image
+ *     when a dirty frame is replaced and on tfs_sync(); all access
+ *     to data blocks goes through tfs_block_read(), tfs_block_write(),
+ *     and their span versions, which use the cache when there is one;
+ *     the cache lock is dropped while a frame is read or written back,
+ *     so one thread waiting on the device does not hold up the others
  */
 
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+
+/* default geometry and geometry limits */
 
+#define DEFAULT_N_DIRECTORY_ENTRIES 16
+#define DEFAULT_N_BLOCKS 256
+#define DEFAULT_BLOCK_SIZE 128
+#define MIN_BLOCK_SIZE 64
+#define MAX_BLOCK_SIZE 65536
+#define MAX_N_DIRECTORY_ENTRIES (1<<20)
+#define TFS_MAGIC 0x32534654
 
-/* defined sizes and limits */
 
-#define N_DIRECTORY_ENTRIES 16
-#define N_BLOCKS 256
-#define BLOCK_SIZE 128
-#define BLOCK_SIZE_AS_POWER_OF_2 7
-#define STORAGE_SIZE (256*128)
-#define MAX_FILE_SIZE (252*128)
+/* sizes and limits of the formatted volume */
+
+#define N_DIRECTORY_ENTRIES (TFS_V(geometry).n_directory_entries)
+#define N_BLOCKS (TFS_V(geometry).n_blocks)
+#define BLOCK_SIZE (TFS_V(geometry).block_size)
+#define BLOCK_SIZE_AS_POWER_OF_2 (TFS_V(geometry).block_shift)
+#define STORAGE_SIZE ((unsigned long long) N_BLOCKS * BLOCK_SIZE)
+#define MAX_FILE_SIZE \
+  ((unsigned long long)( N_BLOCKS - FIRST_VALID_BLOCK ) * BLOCK_SIZE)
 #define FILENAME_LENGTH 8
 #define FIRST_VALID_FD 1
-#define LAST_VALID_FD 15
-#define FIRST_VALID_BLOCK 4
-#define LAST_VALID_BLOCK 255
+#define LAST_VALID_FD (N_DIRECTORY_ENTRIES - 1)
+#define FAT_BLOCK (TFS_V(geometry).fat_block)
+#define FIRST_VALID_BLOCK (TFS_V(geometry).first_valid_block)
+#define LAST_VALID_BLOCK (N_BLOCKS - 1)
+#define BITMAP_WORDS ((N_BLOCKS+63)/64)
+#define NAME_HASH_BITS (TFS_V(geometry).name_hash_bits)
+#define NAME_HASH_SIZE (1U<<NAME_HASH_BITS)
+#define NAME_HASH(key) \
+  ((unsigned int)(((key) * 0x9E3779B97F4A7C15ULL) >> (64 - NAME_HASH_BITS)))
 
 
 /* directory entry status */
 
 #define UNUSED 0
-#define CLOSED 1
-#define OPEN 2
+#define IN_USE 1
 
 
 /* special case block index values */
@@ -146,44 +259,269 @@
 #define FALSE 0
 
 
-/* storage for file system */
+/* struct declarations */
 
-char storage[STORAGE_SIZE];
+struct directory_entry{
+  unsigned long long size;
+  unsigned int first_block;
+  unsigned int last_block;
+  unsigned char status;
+  char name[FILENAME_LENGTH + 1];
+};
 
+/* geometry of the formatted volume; a copy is kept on the volume
+ *   as the superblock in the otherwise unused directory entry 0
+ */
 
-/* struct declarations and pointers */
+struct tfs_geometry{
+  unsigned int magic;
+  unsigned int n_blocks;
+  unsigned int block_size;
+  unsigned int n_directory_entries;
+  unsigned int fat_block;
+  unsigned int first_valid_block;
+  unsigned int block_shift;
+  unsigned int name_hash_bits;
+};
+
+/* per-file block maps: the storage block of each logical block of a
+ *   file, built from the FAT chain the first time it is needed after
+ *   an open and dropped when the last open of the file is closed
+ *   (blocks is NULL when not built)
+ */
 
-struct storage_block{
-  char bytes[BLOCK_SIZE];
+struct block_map{
+  unsigned int *blocks;
+  unsigned int count;
+  unsigned int capacity;
 };
 
-struct directory_entry{
-  unsigned char status;
-  unsigned char first_block;
-  unsigned short size;
-  unsigned short byte_offset;
-  unsigned char current_block;
-  char name[FILENAME_LENGTH + 1];
+
+/* an entry of the open file table: the file pointer of an open, and
+ *   the link to the next open of the same file (0 ends the chain); fd
+ *   is the directory index of the file, 0 for a free slot
+ */
+
+struct open_file{
+  unsigned long long byte_offset;
+  unsigned int fd;
+  unsigned int current_block;
+  unsigned int next;
+};
+
+#define OPEN_FILE_CHUNKS 32
+
+
+/* per-file open state: how many opens there are, the first open in
+ *   the chain, and the open that may write (0 for none)
+ */
+
+struct file_opens{
+  unsigned int count;
+  unsigned int head;
+  unsigned int writer;
+};
+
+
+/* per-file lock, padded to a cache line so that threads working on
+ *   different files do not share lines
+ */
+
+struct file_lock{
+  pthread_rwlock_t rwlock;
+} __attribute__(( aligned( 64 ) ));
+
+
+/* a volume: its storage and every in-memory table that describes it
+ *
+ * a process may host any number of volumes; each thread works on one
+ *   volume at a time, its current volume, which it picks with
+ *   tfs_select_volume(), and every function below operates on the
+ *   current volume of the calling thread; a thread that picks none
+ *   uses the default volume, so a program with one volume need not
+ *   know about this
+ *
+ * the library reaches the fields of the current volume through
+ *   TFS_V(), below, under the names they had when they were global
+ *   variables
+ */
+
+struct tfs_volume{
+
+  /* geometry of the formatted volume */
+
+  struct tfs_geometry geometry;
+
+  /* storage for file system and pointers into it */
+
+  char *storage;
+  struct directory_entry *directory;
+  unsigned int *file_allocation_table;
+
+  /* mapped volume image, if any */
+
+  unsigned int volume_mounted;
+  int volume_fd;
+
+  /* blocks written since the last tfs_sync() (bit set = dirty) */
+
+  unsigned long long *dirty_block_bitmap;
+
+  /* free block bitmap and count */
+
+  unsigned long long *free_block_bitmap;
+  unsigned int free_block_count;
+  unsigned int free_block_hint;   /* likely no free block below this word */
+
+  /* reverse links for blocks in use: the previous block in the chain
+   *   (0 for the first block of a file) and the owning file descriptor
+   *   (0 for a free block); kept in memory only and rebuilt from the
+   *   FAT on format and mount
+   */
+
+  unsigned int *block_prev;
+  unsigned int *block_owner;
+
+  /* incremental defragmenter state: the file being packed, the block
+   *   where it starts, how many of its blocks are in place, and the
+   *   FAT generation (bumped whenever blocks are freed) seen last
+   */
+
+  unsigned int defrag_fd;
+  unsigned int defrag_file_start;
+  unsigned int defrag_index;
+  unsigned int defrag_moved;
+  unsigned int defrag_generation;
+  unsigned int fat_generation;
+
+  /* two blocks of room for tfs_exchange_blocks(), which always runs
+   *   under the directory lock, so one buffer per volume is enough
+   */
+
+  char *swap_buffer;
+
+  /* block maps, indexed by directory index */
+
+  struct block_map *block_maps;
+
+  /* open file table, indexed by file descriptor through
+   *   tfs_open_file(); the table is kept in chunks that never move, so
+   *   slots can be added while other threads use theirs: chunk 0 holds
+   *   the first N_DIRECTORY_ENTRIES slots, and each further chunk
+   *   doubles the number of slots
+   */
+
+  struct open_file *open_file_chunks[OPEN_FILE_CHUNKS];
+  unsigned int open_file_slots;
+
+  /* open state, indexed by directory index */
+
+  struct file_opens *file_opens;
+
+  /* locks (see above): one for the directory, one per directory entry
+   *   for the file, and one for building block maps, which readers do
+   *   under a shared file lock
+   */
+
+  pthread_mutex_t directory_lock;
+  struct file_lock *file_locks;
+  pthread_mutex_t block_map_lock;
+
+  /* name index: bucket heads and per-entry chain links (0 ends a
+   *   chain)
+   */
+
+  unsigned int *name_hash_head;
+  unsigned int *name_hash_next;
+
+  /* block cache of a mounted image, used when cache_capacity is not 0
+   *   at mount time: cache_frames frames of BLOCK_SIZE bytes (the
+   *   capacity, or one per data block if fewer), the block held by
+   *   each frame (0 for none), its CLOCK reference bit, and whether
+   *   it is busy with device I/O, the frame of each block plus one (0
+   *   when not cached), the CLOCK hand, and counters; a cached block
+   *   is dirty when its bit in the dirty block bitmap is set, and
+   *   cache_lock covers all of it, but is not held across device I/O:
+   *   threads that need a busy frame wait on cache_done instead
+   *   (cache_data is NULL when there is no cache)
+   */
+
+  unsigned int cache_capacity;
+  unsigned int cache_frames;
+  char *cache_data;
+  unsigned int *cache_block;
+  unsigned char *cache_referenced;
+  unsigned char *cache_busy;
+  unsigned int *cache_frame_of;
+  unsigned int cache_hand;
+  unsigned long long cache_hits;
+  unsigned long long cache_misses;
+  unsigned long long cache_writebacks;
+  pthread_mutex_t cache_lock;
+  pthread_cond_t cache_done;
 };
 
-struct storage_block *blocks;
-struct directory_entry *directory;
-unsigned char *file_allocation_table;
+
+/* the current volume of the calling thread, and the volume that
+ *   threads start out with
+ */
+
+extern __thread struct tfs_volume *tfs_volume;
+extern struct tfs_volume tfs_default_volume;
+
+/* field of the current volume, e.g. TFS_V(directory)[fd] */
+#define TFS_V(field) (tfs_volume->field)
+
+/* address of the first byte of block b (of a data block, only when
+ *   there is no block cache)
+ */
+#define BLOCK(b) \
+  (TFS_V(storage) + ((unsigned long long)(b) << BLOCK_SIZE_AS_POWER_OF_2))
+
+/* bytes of a mounted image that are mapped: all of them, or only the
+ *   directory and FAT when there is a block cache
+ */
+#define MAPPED_SIZE \
+  ( TFS_V(cache_data) ? ( (unsigned long long) FIRST_VALID_BLOCK << \
+                   BLOCK_SIZE_AS_POWER_OF_2 ) : STORAGE_SIZE )
+
+
+/* volumes */
+
+struct tfs_volume *tfs_new_volume();
+struct tfs_volume *tfs_select_volume( struct tfs_volume *v );
+void tfs_free_volume( struct tfs_volume *v );
 
 
 /* public interface */
 
 void tfs_init();
+unsigned int tfs_format( unsigned int n_blocks,
+                         unsigned int block_size,
+                         unsigned int n_directory_entries );
+unsigned int tfs_mount( char *path );
+unsigned int tfs_sync();
+unsigned int tfs_unmount();
 void tfs_list_blocks();
 void tfs_list_directory();
 unsigned int tfs_create( char *name );
 unsigned int tfs_exists( char *name );
-unsigned int tfs_copy(   char *from_name, char *to_name );
+unsigned long long tfs_copy( char *from_name, char *to_name );
 unsigned int tfs_open(   char *name );
-unsigned int tfs_size(   unsigned int file_descriptor );
+unsigned long long tfs_size( unsigned int file_descriptor );
 
 unsigned int tfs_seek(   unsigned int file_descriptor,
-                         unsigned int offset );
+                         unsigned long long offset );
+
+unsigned int tfs_pread(  unsigned int file_descriptor,
+                         char *user_buffer,
+                         unsigned int byte_count,
+                         unsigned long long offset );
+
+unsigned int tfs_pwrite( unsigned int file_descriptor,
+                         char *user_buffer,
+                         unsigned int byte_count,
+                         unsigned long long offset );
 
 unsigned int tfs_read(   unsigned int file_descriptor,
                          char *user_buffer,
@@ -195,6 +533,9 @@ unsigned int tfs_write(  unsigned int file_descriptor,
 
 unsigned int tfs_close(  unsigned int file_descriptor );
 unsigned int tfs_delete( unsigned int file_descriptor );
+unsigned int tfs_defrag( unsigned int budget );
+unsigned int tfs_set_cache( unsigned int capacity );
+void tfs_list_cache();
 
 
 /* helper functions */
@@ -202,13 +543,55 @@ unsigned int tfs_delete( unsigned int file_descriptor );
 unsigned int tfs_is_fd_in_range(    unsigned int fd );
 unsigned int tfs_is_block_in_range( unsigned int b );
 unsigned int tfs_is_fd_open(        unsigned int fd );
+unsigned int tfs_fd_to_entry(       unsigned int fd );
 unsigned int tfs_is_valid_name(     char *name );
 
 unsigned int tfs_map_name_to_fd( char *name );
+unsigned long long tfs_name_key( char *name );
+void tfs_name_index_insert( unsigned int fd );
+void tfs_name_index_remove( unsigned int fd );
+
+unsigned int tfs_set_geometry( struct tfs_geometry *g,
+                               unsigned int n_blocks,
+                               unsigned int block_size,
+                               unsigned int n_directory_entries );
+void tfs_build_tables();
+void tfs_release_volume();
+
+struct block_map *tfs_block_map( unsigned int fd );
+void tfs_block_map_append( unsigned int fd, unsigned int b );
+void tfs_block_map_drop(   unsigned int fd );
+unsigned int tfs_offset_to_block( unsigned int fd,
+                                  unsigned long long offset );
 
 unsigned int tfs_new_directory_entry();
+struct open_file *tfs_open_file( unsigned int file_descriptor );
+unsigned int tfs_new_open_file( unsigned int fd );
+void tfs_release_open_file( unsigned int file_descriptor );
+unsigned int tfs_cursor_block( unsigned int file_descriptor );
+unsigned int tfs_read_at( unsigned int fd, unsigned long long offset,
+                          unsigned int current_block, char *user_buffer,
+                          unsigned int byte_count, unsigned int *end_block );
 unsigned int tfs_new_block();
+unsigned int tfs_new_extent( unsigned int want, unsigned int *count );
+void tfs_free_block( unsigned int b );
+unsigned int tfs_claim_run( unsigned int start, unsigned int length );
+void tfs_release_block( unsigned int b );
+void tfs_mark_dirty( unsigned int b, unsigned int count );
+void tfs_exchange_blocks( unsigned int x, unsigned int y );
 
 unsigned int tfs_block_read(  unsigned int b, char *buf );
 unsigned int tfs_block_write( unsigned int b, char *buf );
+unsigned int tfs_block_read_span(  unsigned int b, unsigned int index,
+                                   char *buf, unsigned int count );
+unsigned int tfs_block_write_span( unsigned int b, unsigned int index,
+                                   char *buf, unsigned int count );
+
+char *tfs_cache_block( unsigned int b, unsigned int whole );
+unsigned int tfs_cache_transfer( unsigned int b, unsigned int index,
+                                 char *buf, unsigned int count,
+                                 unsigned int write );
+unsigned int tfs_cache_flush();
+void tfs_build_cache();
+void tfs_release_cache();
 
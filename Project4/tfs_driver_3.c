@@ -154,7 +154,7 @@ int main(){
   tfs_seek( fd[2], tfs_size( fd[2] ) );
   count1 = tfs_write( fd[2], buffer1, 8 );
   if( count1 != 8 ) printf( "write error 11\n" );
-  printf( "file size now %d\n", tfs_size( fd[2] ) );
+  printf( "file size now %llu\n", tfs_size( fd[2] ) );
 
   /* seek to 188 and try to read 32 bytes - should get 12 */
   tfs_seek( fd[2], 188 );
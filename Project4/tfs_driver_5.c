@@ -0,0 +1,327 @@
+/* test driver - threads, defragmentation, block cache, and volumes
+ *
+ * each part runs several threads against the file system and checks
+ *   every byte read back against the pattern it should hold, so the
+ *   output is the same from run to run when all is well; build with
+ *   -pthread (and -fsanitize=thread to look for races)
+ *
+ * tfs_defrag() locks two files at once, always under the directory
+ *   lock, so the lock order warnings of -fsanitize=thread cannot come
+ *   to a deadlock; run with TSAN_OPTIONS=detect_deadlocks=0 to see
+ *   only the races
+ */
+
+#include "tfs.h"
+
+#define WORKERS 4
+#define ROUNDS 4000
+#define IMAGE "tfs_driver_5.img"
+
+unsigned int failures;
+unsigned int stop;
+
+void fail( char *what, int k ){
+  printf( "*** %s in thread %d\n", what, k );
+  __atomic_add_fetch( &failures, 1, __ATOMIC_RELAXED );
+}
+
+/* the byte that belongs at an offset of the file of thread k */
+unsigned char pattern( unsigned long long offset, int k ){
+  return( (unsigned char)( offset * 7 + k * 13 + ( offset >> 8 ) ) );
+}
+
+/* reads a whole file and checks it against the pattern */
+void check_file( char *name, int k ){
+  static unsigned char buffer[4096];
+  unsigned long long offset, size;
+  unsigned int fd, count, i;
+
+  fd = tfs_open( name );
+  if( fd == 0 ){
+    fail( "open failed", k );
+    return;
+  }
+  size = tfs_size( fd );
+  for( offset = 0; offset < size; offset += count ){
+    count = tfs_read( fd, (char *) buffer, sizeof( buffer ) );
+    if( count == 0 ){
+      fail( "short read", k );
+      break;
+    }
+    for( i = 0; i < count; i++ ){
+      if( buffer[i] != pattern( offset + i, k ) ){
+        fail( "bad byte", k );
+        break;
+      }
+    }
+  }
+  tfs_close( fd );
+}
+
+/* writes and reads back its own file at random offsets, and now and
+ *   then deletes it and starts over
+ */
+void *worker( void *arg ){
+  unsigned char buffer[3000], check[3000];
+  unsigned long long size, offset, expect;
+  unsigned int fd, length, count, i, seed;
+  int k, round;
+  char name[9];
+
+  k = (int)(long) arg;
+  seed = k;
+  sprintf( name, "w%d", k );
+  fd = tfs_create( name );
+  if( fd == 0 ){
+    fail( "create failed", k );
+    return( NULL );
+  }
+  size = 0;
+
+  for( round = 0; round < ROUNDS; round++ ){
+    length = 1 + rand_r( &seed ) % sizeof( buffer );
+    switch( rand_r( &seed ) % 10 ){
+      case 0: case 1: case 2: case 3:
+        offset = ( size == 0 ) ? 0 : rand_r( &seed ) % ( size + 1 );
+        for( i = 0; i < length; i++ ) buffer[i] = pattern( offset + i, k );
+        count = tfs_pwrite( fd, (char *) buffer, length, offset );
+        if( count != length ) fail( "short pwrite", k );
+        if( offset + count > size ) size = offset + count;
+        break;
+      case 4: case 5: case 6: case 7:
+        if( size == 0 ) break;
+        offset = rand_r( &seed ) % size;
+        count = tfs_pread( fd, (char *) check, length, offset );
+        expect = ( size - offset < length ) ? size - offset : length;
+        if( count != expect ) fail( "short pread", k );
+        for( i = 0; i < count; i++ ){
+          if( check[i] != pattern( offset + i, k ) ){
+            fail( "bad byte", k );
+            break;
+          }
+        }
+        break;
+      case 8:
+        if( tfs_size( fd ) != size ) fail( "wrong size", k );
+        break;
+      default:
+        if( rand_r( &seed ) % 20 != 0 ) break;
+        tfs_delete( fd );
+        fd = tfs_create( name );
+        if( fd == 0 ){
+          fail( "create failed", k );
+          return( NULL );
+        }
+        size = 0;
+    }
+  }
+
+  tfs_close( fd );
+  return( NULL );
+}
+
+/* appends to the shared file through its own open */
+void *appender( void *arg ){
+  unsigned char buffer[1000];
+  unsigned long long offset;
+  unsigned int fd, i;
+  int round;
+
+  (void) arg;
+  fd = tfs_open( "shared" );
+  offset = tfs_size( fd );
+  for( round = 0; round < 200; round++ ){
+    for( i = 0; i < sizeof( buffer ); i++ ){
+      buffer[i] = pattern( offset + i, 0 );
+    }
+    tfs_seek( fd, offset );
+    offset += tfs_write( fd, (char *) buffer, sizeof( buffer ) );
+  }
+  tfs_close( fd );
+  return( NULL );
+}
+
+/* reads the shared file while it grows, through opens of its own */
+void *reader( void *arg ){
+  unsigned char buffer[2000];
+  unsigned long long size, offset;
+  unsigned int fd, count, i, seed;
+
+  seed = 99 + (int)(long) arg;
+  while( !__atomic_load_n( &stop, __ATOMIC_RELAXED ) ){
+    fd = tfs_open( "shared" );
+    size = tfs_size( fd );
+    if( size != 0 ){
+      offset = rand_r( &seed ) % size;
+      count = tfs_pread( fd, (char *) buffer, sizeof( buffer ), offset );
+      for( i = 0; i < count; i++ ){
+        if( buffer[i] != pattern( offset + i, 0 ) ){
+          fail( "bad shared byte", 0 );
+          break;
+        }
+      }
+    }
+    tfs_close( fd );
+  }
+  return( NULL );
+}
+
+/* moves blocks under everyone else, and syncs a mounted image */
+void *defragger( void *arg ){
+
+  (void) arg;
+  while( !__atomic_load_n( &stop, __ATOMIC_RELAXED ) ){
+    tfs_defrag( 64 );
+    tfs_sync();
+  }
+  return( NULL );
+}
+
+/* runs the workers, the appender, two readers, and the defragger on
+ *   the default volume, which every thread starts out with
+ */
+void run_threads(){
+  pthread_t workers[WORKERS], others[4];
+  unsigned int fd;
+  long i;
+
+  fd = tfs_create( "shared" );
+  tfs_close( fd );
+
+  stop = 0;
+  for( i = 0; i < WORKERS; i++ ){
+    pthread_create( &workers[i], NULL, worker, (void *)( i + 1 ) );
+  }
+  pthread_create( &others[0], NULL, appender, NULL );
+  pthread_create( &others[1], NULL, reader, (void *) 1 );
+  pthread_create( &others[2], NULL, reader, (void *) 2 );
+  pthread_create( &others[3], NULL, defragger, NULL );
+
+  for( i = 0; i < WORKERS; i++ ) pthread_join( workers[i], NULL );
+  pthread_join( others[0], NULL );
+  __atomic_store_n( &stop, 1, __ATOMIC_RELAXED );
+  for( i = 1; i < 4; i++ ) pthread_join( others[i], NULL );
+}
+
+/* checks every file of run_threads() on the current volume */
+void check_files(){
+  char name[9];
+  int k;
+
+  check_file( "shared", 0 );
+  for( k = 1; k <= WORKERS; k++ ){
+    sprintf( name, "w%d", k );
+    check_file( name, k );
+  }
+}
+
+/* builds volumes of its own, switching among them as it goes */
+void *volume_owner( void *arg ){
+  struct tfs_volume *v[8];
+  char buffer[1200], check[1200], name[9];
+  unsigned int fd, count, length;
+  int k, i, f, round, j;
+
+  k = (int)(long) arg;
+  for( i = 0; i < 8; i++ ){
+    v[i] = tfs_new_volume();
+    tfs_select_volume( v[i] );
+    tfs_format( 256 + i * 32, 64 << ( i % 3 ), 16 );
+    for( f = 0; f < 3; f++ ){
+      sprintf( name, "f%d", f );
+      for( j = 0; j < 1200; j++ ) buffer[j] = (char)( k * 7 + i * 3 + f + j );
+      fd = tfs_create( name );
+      if( tfs_write( fd, buffer, 600 + i * 50 ) != 600u + i * 50 ){
+        fail( "short write on a volume", k );
+      }
+      tfs_close( fd );
+    }
+  }
+
+  for( round = 0; round < 10; round++ ){
+    for( i = 0; i < 8; i++ ){
+      tfs_select_volume( v[i] );
+      f = ( round + i ) % 3;
+      sprintf( name, "f%d", f );
+      fd = tfs_open( name );
+      length = 600 + i * 50;
+      count = tfs_read( fd, check, sizeof( check ) );
+      if( count != length ) fail( "wrong size on a volume", k );
+      for( j = 0; j < (int) count; j++ ){
+        if( check[j] != (char)( k * 7 + i * 3 + f + j ) ){
+          fail( "bad byte on a volume", k );
+          break;
+        }
+      }
+      tfs_close( fd );
+      tfs_defrag( 8 );
+    }
+  }
+
+  for( i = 0; i < 8; i++ ) tfs_free_volume( v[i] );
+  if( tfs_volume != &tfs_default_volume ){
+    fail( "not back on the default volume", k );
+  }
+  return( NULL );
+}
+
+
+int main(){
+  pthread_t owners[WORKERS];
+  unsigned int fd, before;
+  char buffer[16];
+  long i;
+
+  /* part 1: threads on an in-memory volume, then defragment it all */
+  tfs_format( 20000, 128, 64 );
+  run_threads();
+  check_files();
+  while( !tfs_defrag( 1000 ) );
+  check_files();
+  printf( "threads and defragmentation: %u failures\n", failures );
+
+  /* part 2: the same on a mounted image with a tiny block cache, so
+   *   frames are replaced all the time, then remounted with another
+   */
+  before = failures;
+  remove( IMAGE );
+  tfs_format( 20000, 128, 64 );
+  tfs_set_cache( 3 );
+  if( !tfs_mount( IMAGE ) ){
+    printf( "*** mount failed\n" );
+    return 1;
+  }
+  run_threads();
+  check_files();
+  tfs_unmount();
+  tfs_set_cache( 17 );
+  if( !tfs_mount( IMAGE ) ){
+    printf( "*** remount failed\n" );
+    return 1;
+  }
+  check_files();
+  tfs_unmount();
+  tfs_set_cache( 0 );
+  remove( IMAGE );
+  printf( "block cache: %u failures\n", failures - before );
+
+  /* part 3: threads with volumes of their own, while the default
+   *   volume keeps its file
+   */
+  before = failures;
+  tfs_init();
+  fd = tfs_create( "main" );
+  tfs_write( fd, "default", 8 );
+  tfs_close( fd );
+  for( i = 0; i < WORKERS; i++ ){
+    pthread_create( &owners[i], NULL, volume_owner, (void *) i );
+  }
+  for( i = 0; i < WORKERS; i++ ) pthread_join( owners[i], NULL );
+  fd = tfs_open( "main" );
+  tfs_read( fd, buffer, 8 );
+  tfs_close( fd );
+  if( strcmp( buffer, "default" ) != 0 ) fail( "default volume changed", 0 );
+  printf( "volumes: %u failures\n", failures - before );
+
+  return( failures != 0 );
+}
@@ -2,7 +2,7 @@
 
 /* implementation of helper functions - instructor supplied
  *
- * nine helper functions
+ * thirty-seven helper functions
  * - call log message prefix is log_h_i for i-th function
  * - error log message prefix is err_h_i for i-th function
  *     or err_h_i.j for j-th error case within i-th function
@@ -23,7 +23,8 @@
 
 /* tfs_is_fd_in_range()
  *
- * validates a file descriptor value using a range check
+ * validates a file descriptor value using a range check against
+ *   the open file table, which covers every directory index
  *
  * input parameter is file descriptor value
  *
@@ -36,7 +37,8 @@ unsigned int tfs_is_fd_in_range( unsigned int fd ){
     fprintf( stderr, "log_h_1: is_fd_in_range() called with: %d\n", fd );
   }
 
-  if( ( fd < FIRST_VALID_FD ) || ( fd > LAST_VALID_FD ) ){
+  if( ( fd < FIRST_VALID_FD ) ||
+      ( fd >= __atomic_load_n( &TFS_V(open_file_slots), __ATOMIC_ACQUIRE ) ) ){
     if( ERROR_LOGGING ){
       fprintf( stderr, "err_h_1: file descriptor out of range: %d\n", fd );
     }
@@ -75,7 +77,10 @@ unsigned int tfs_is_block_in_range( unsigned int b ){
 
 /* tfs_is_fd_open()
  *
- * validates that a file is open
+ * validates that a file descriptor is an open of a file
+ *
+ * precondition:
+ *   (unchecked) the file descriptor is in range
  *
  * input parameter is file descriptor
  *
@@ -88,7 +93,7 @@ unsigned int tfs_is_fd_open( unsigned int fd ){
     fprintf( stderr, "log_h_3: is_fd_open() called with: %d\n", fd );
   }
 
-  if( directory[fd].status == OPEN ){
+  if( tfs_open_file( fd )->fd != 0 ){
     return( TRUE );
   }else{
     return( FALSE );
@@ -96,6 +101,42 @@ unsigned int tfs_is_fd_open( unsigned int fd ){
 }
 
 
+/* tfs_fd_to_entry()
+ *
+ * maps a file descriptor to the directory index of its file: an
+ *   open descriptor to the file it is an open of, and a descriptor
+ *   that is not open to the directory entry of the same index, so
+ *   a closed file can still be named by its directory index
+ *
+ * input parameter is file descriptor
+ *
+ * return value is the directory index when successful or 0 when
+ *   failure (out of range, or past LAST_VALID_FD and not open)
+ */
+
+unsigned int tfs_fd_to_entry( unsigned int fd ){
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_24: fd_to_entry() called with: %d\n", fd );
+  }
+
+  if( !tfs_is_fd_in_range( fd ) ){
+    return( 0 );
+  }
+  if( tfs_is_fd_open( fd ) ){
+    return( tfs_open_file( fd )->fd );
+  }
+  if( fd > LAST_VALID_FD ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_h_24: file descriptor is not open: %d\n", fd );
+    }
+    return( 0 );
+  }
+
+  return( fd );
+}
+
+
 /* tfs_is_valid_file_name()
  *
  * validates a file name
@@ -106,7 +147,8 @@ unsigned int tfs_is_fd_open( unsigned int fd ){
  */
 
 unsigned int tfs_is_valid_name( char *name ){
-  int i, len = strlen( name );
+  int i, len = strnlen( name, FILENAME_LENGTH + 1 );
+  char c;
 
   if( CALL_LOGGING ){
     fprintf( stderr, "log_h_4: is_valid_name() called with: %s\n", name );
@@ -119,8 +161,12 @@ unsigned int tfs_is_valid_name( char *name ){
     return( FALSE );
   }
 
+  /* plain range tests instead of a locale-dependent isalnum() call */
   for( i = 0; i < len; i++ ){
-    if( !isalnum( name[i] ) && ( name[i] != '_' ) && ( name[i] != '.' ) ){
+    c = name[i];
+    if( !( ( c >= '0' ) && ( c <= '9' ) ) &&
+        !( ( ( c | 0x20 ) >= 'a' ) && ( ( c | 0x20 ) <= 'z' ) ) &&
+        ( c != '_' ) && ( c != '.' ) ){
       if( ERROR_LOGGING ){
         fprintf( stderr, "err_h_4.2: file name has non-alphanumeric," );
         fprintf( stderr, " non-underscore character\n" );
@@ -135,9 +181,14 @@ unsigned int tfs_is_valid_name( char *name ){
 
 /* tfs_map_file_name_to_fd()
  *
- * seaches the directory for a file name and returns the file
+ * looks up a file name in the name index and returns the file
  *   descriptor
  *
+ * the name is hashed as a zero-padded 8-byte word and only the
+ *   entries chained from that bucket are compared, each with a
+ *   single fixed-width word compare, so the cost does not grow
+ *   with the size of the directory
+ *
  * precondition:
  *   file name is valid
  *
@@ -152,6 +203,7 @@ unsigned int tfs_is_valid_name( char *name ){
 
 unsigned int tfs_map_name_to_fd( char *name ){
   unsigned int fd;
+  unsigned long long key, entry_key;
 
   if( CALL_LOGGING ){
     fprintf( stderr, "log_h_5: map_name_to_fd() called with: %s\n", name );
@@ -165,11 +217,14 @@ unsigned int tfs_map_name_to_fd( char *name ){
     return( 0 );
   }
 
-  for( fd = 1; fd < N_DIRECTORY_ENTRIES; fd++ ){
-    if( ( directory[fd].name != UNUSED ) &&
-        ( strcmp( name, directory[fd].name ) == 0 ) ){
+  key = tfs_name_key( name );
+  fd = TFS_V(name_hash_head)[NAME_HASH( key )];
+  while( fd != 0 ){
+    memcpy( &entry_key, TFS_V(directory)[fd].name, sizeof( entry_key ) );
+    if( entry_key == key ){
       return( fd );
     }
+    fd = TFS_V(name_hash_next)[fd];
   }
 
   if( ERROR_LOGGING ){
@@ -179,6 +234,228 @@ unsigned int tfs_map_name_to_fd( char *name ){
 }
 
 
+/* tfs_name_key()
+ *
+ * packs a file name into an 8-byte word, zero-padded past the
+ *   end of the name, which matches the layout of a name stored
+ *   in a directory entry
+ *
+ * precondition:
+ *   (unchecked) file name is valid
+ *
+ * input parameter is character string containing the file name
+ *
+ * return value is the packed name
+ */
+
+unsigned long long tfs_name_key( char *name ){
+  unsigned long long key = 0;
+
+  memcpy( &key, name, strnlen( name, FILENAME_LENGTH ) );
+
+  return( key );
+}
+
+
+/* tfs_name_index_insert()
+ *
+ * adds an active directory entry to the name index
+ *
+ * preconditions:
+ *   (1) (unchecked) the name in the entry is zero-padded
+ *   (2) (unchecked) the entry is not already in the index
+ *
+ * input parameter is file descriptor
+ *
+ * no return value
+ */
+
+void tfs_name_index_insert( unsigned int fd ){
+  unsigned int bucket;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_11: name_index_insert() called with: %d\n", fd );
+  }
+
+  bucket = NAME_HASH( tfs_name_key( TFS_V(directory)[fd].name ) );
+  TFS_V(name_hash_next)[fd] = TFS_V(name_hash_head)[bucket];
+  TFS_V(name_hash_head)[bucket] = fd;
+}
+
+
+/* tfs_name_index_remove()
+ *
+ * removes a directory entry from the name index; must be called
+ *   before the name in the entry is cleared
+ *
+ * input parameter is file descriptor
+ *
+ * no return value
+ */
+
+void tfs_name_index_remove( unsigned int fd ){
+  unsigned int *link;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_12: name_index_remove() called with: %d\n", fd );
+  }
+
+  link = &TFS_V(name_hash_head)[
+            NAME_HASH( tfs_name_key( TFS_V(directory)[fd].name ) )];
+  while( *link != 0 ){
+    if( *link == fd ){
+      *link = TFS_V(name_hash_next)[fd];
+      TFS_V(name_hash_next)[fd] = 0;
+      return;
+    }
+    link = &TFS_V(name_hash_next)[*link];
+  }
+}
+
+
+/* tfs_block_map()
+ *
+ * returns the block map of a file, building it from the FAT
+ *   chain if it has not been built since the file was opened
+ *
+ * several readers of a file may get here at once under the shared
+ *   file lock, so the map is built under the block map lock and
+ *   published by storing its blocks pointer last
+ *
+ * preconditions:
+ *   (1) (unchecked) the directory entry is active
+ *   (2) (unchecked) the caller holds the file lock
+ *
+ * input parameter is file descriptor
+ *
+ * return value is the address of the block map
+ */
+
+struct block_map *tfs_block_map( unsigned int fd ){
+  struct block_map *map = &TFS_V(block_maps)[fd];
+  unsigned int *blocks, count, capacity, b;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_18: block_map() called with: %d\n", fd );
+  }
+
+  if( __atomic_load_n( &map->blocks, __ATOMIC_ACQUIRE ) != NULL ){
+    return( map );
+  }
+
+  pthread_mutex_lock( &TFS_V(block_map_lock) );
+  if( map->blocks == NULL ){
+    count = 0;
+    capacity = 16;
+    blocks = malloc( capacity * sizeof( unsigned int ) );
+    assert( blocks );
+    for( b = TFS_V(directory)[fd].first_block;
+         ( b != FREE ) && ( b != LAST_BLOCK );
+         b = TFS_V(file_allocation_table)[b] ){
+      if( count == capacity ){
+        capacity *= 2;
+        blocks = realloc( blocks, capacity * sizeof( unsigned int ) );
+        assert( blocks );
+      }
+      blocks[count++] = b;
+    }
+    map->count = count;
+    map->capacity = capacity;
+    __atomic_store_n( &map->blocks, blocks, __ATOMIC_RELEASE );
+  }
+  pthread_mutex_unlock( &TFS_V(block_map_lock) );
+
+  return( map );
+}
+
+
+/* tfs_block_map_append()
+ *
+ * records a block added to the end of a file in the block map of
+ *   the file, if the map has been built; only a writer appends, and
+ *   it holds the file lock exclusively
+ *
+ * input parameters are file descriptor and block number
+ *
+ * no return value
+ */
+
+void tfs_block_map_append( unsigned int fd, unsigned int b ){
+  struct block_map *map = &TFS_V(block_maps)[fd];
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_19: block_map_append() called with: %d and %d\n",
+      fd, b );
+  }
+
+  if( map->blocks == NULL ){
+    return;
+  }
+  if( map->count == map->capacity ){
+    map->capacity *= 2;
+    map->blocks = realloc( map->blocks,
+                           map->capacity * sizeof( unsigned int ) );
+    assert( map->blocks );
+  }
+  map->blocks[map->count++] = b;
+}
+
+
+/* tfs_block_map_drop()
+ *
+ * discards the block map of a file; it is rebuilt on next use
+ *
+ * input parameter is file descriptor
+ *
+ * no return value
+ */
+
+void tfs_block_map_drop( unsigned int fd ){
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_20: block_map_drop() called with: %d\n", fd );
+  }
+
+  free( TFS_V(block_maps)[fd].blocks );
+  TFS_V(block_maps)[fd].blocks = NULL;
+  TFS_V(block_maps)[fd].count = 0;
+  TFS_V(block_maps)[fd].capacity = 0;
+}
+
+
+/* tfs_offset_to_block()
+ *
+ * maps a byte offset within a file to the storage block holding
+ *   that byte using the block map of the file, with the same
+ *   conventions as the current block of a directory entry: 0 if
+ *   the file has no blocks, and LAST_BLOCK if the offset is just
+ *   beyond the last block of the file
+ *
+ * precondition:
+ *   (unchecked) the offset is no larger than the file size
+ *
+ * input parameters are file descriptor and byte offset
+ *
+ * return value is the block number
+ */
+
+unsigned int tfs_offset_to_block( unsigned int fd,
+                                  unsigned long long offset ){
+  struct block_map *map = tfs_block_map( fd );
+  unsigned long long index = offset >> BLOCK_SIZE_AS_POWER_OF_2;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_21: offset_to_block() called with: %d and %llu\n",
+      fd, offset );
+  }
+
+  if( index < map->count ){
+    return( map->blocks[index] );
+  }
+  return( ( map->count == 0 ) ? FREE : LAST_BLOCK );
+}
+
+
 /* tfs_new_directory_entry()
  *
  * seaches the directory for a free entry and returns that index
@@ -197,7 +474,7 @@ unsigned int tfs_new_directory_entry(){
   }
 
   for( fd = FIRST_VALID_FD; fd < N_DIRECTORY_ENTRIES; fd++ ){
-    if( directory[fd].status == UNUSED ){
+    if( TFS_V(directory)[fd].status == UNUSED ){
       return( fd );
     }
   }
@@ -209,113 +486,1583 @@ unsigned int tfs_new_directory_entry(){
 }
 
 
-/* tfs_new_block()
+/* tfs_open_file()
  *
- * seaches FAT for a free block and returns that block number
+ * returns the address of an open file table slot; chunk 0 holds
+ *   slots 0 to N_DIRECTORY_ENTRIES - 1, and chunk k > 0 holds the
+ *   N_DIRECTORY_ENTRIES << ( k - 1 ) slots that follow
  *
- * no parameters
+ * precondition:
+ *   (unchecked) the file descriptor is in range
  *
- * return value is the block number of a free block when
- *   successful or 0 when failure
+ * input parameter is file descriptor
+ *
+ * return value is the address of the slot
  */
 
-unsigned int tfs_new_block(){
-  unsigned int b;
+struct open_file *tfs_open_file( unsigned int file_descriptor ){
+  unsigned int q, k;
 
   if( CALL_LOGGING ){
-    fprintf( stderr, "log_h_7: new_block() called\n" );
+    fprintf( stderr, "log_h_28: open_file() called with: %d\n",
+      file_descriptor );
   }
 
-  for( b = FIRST_VALID_BLOCK; b < N_BLOCKS; b++ ){
-    if( file_allocation_table[b] == FREE ) return( b );
-  }
-
-  if( ERROR_LOGGING ){
-    fprintf( stderr, "err_h_7: no free storage blocks\n" );
+  q = file_descriptor / N_DIRECTORY_ENTRIES;
+  if( q == 0 ){
+    return( &TFS_V(open_file_chunks)[0][file_descriptor] );
   }
-  return( 0 );
+  k = 32 - __builtin_clz( q );
+  return( &TFS_V(open_file_chunks)[k][file_descriptor -
+                                      ( N_DIRECTORY_ENTRIES << ( k - 1 ) )] );
 }
 
 
-/* tfs_block_read()
+/* tfs_new_open_file()
  *
- * transfers a block of data from a block in storage to an
- *   internal buffer
+ * opens a file: takes the open file table slot paired with the
+ *   directory entry of the file if it is free, or else a free slot
+ *   past LAST_VALID_FD, adding a chunk of slots when there is none,
+ *   and starts the new open at the beginning of the file
  *
  * preconditions:
- *   (1) block number is valid
- *   (2) (unchecked) buffer is internal to the file system
+ *   (1) (unchecked) the directory entry is active
+ *   (2) (unchecked) the caller holds the directory lock
  *
  * postconditions:
- *   the data is transfered from the block in storage to the
- *     buffer
+ *   (1) the open is linked into the chain of opens of the file
+ *   (2) the open count of the file is incremented
  *
- * input parameters are a block number and a byte pointer
+ * input parameter is the directory index of the file
  *
- * return value is TRUE when successful or FALSE when failure
+ * return value is the new file descriptor when successful or 0
+ *   when failure
  */
 
-unsigned int tfs_block_read( unsigned int b, char *buf ){
-  unsigned int i;
+unsigned int tfs_new_open_file( unsigned int fd ){
+  struct open_file *f;
+  unsigned int file_descriptor, k;
 
   if( CALL_LOGGING ){
-    fprintf( stderr, "log_h_8: block_read() called with %d and %p\n",
-      b, buf );
+    fprintf( stderr, "log_h_25: new_open_file() called with: %d\n", fd );
   }
 
-  /* precondition check */
-  if( !tfs_is_block_in_range( b ) ){
-    if( ERROR_LOGGING ){
-      fprintf( stderr, "err_h_8: block out or range, %d\n", b );
+  file_descriptor = fd;
+  if( tfs_open_file( file_descriptor )->fd != 0 ){
+    for( file_descriptor = N_DIRECTORY_ENTRIES;
+         ( file_descriptor < TFS_V(open_file_slots) ) &&
+         ( tfs_open_file( file_descriptor )->fd != 0 );
+         file_descriptor++ );
+    if( file_descriptor == TFS_V(open_file_slots) ){
+      k = 32 - __builtin_clz( TFS_V(open_file_slots) / N_DIRECTORY_ENTRIES );
+      if( ( k < OPEN_FILE_CHUNKS ) && ( TFS_V(open_file_slots) <= ~0U / 2 ) ){
+        TFS_V(open_file_chunks)[k] = calloc( TFS_V(open_file_slots),
+                                             sizeof( struct open_file ) );
+      }
+      if( ( k >= OPEN_FILE_CHUNKS ) || ( TFS_V(open_file_slots) > ~0U / 2 ) ||
+          ( TFS_V(open_file_chunks)[k] == NULL ) ){
+        if( ERROR_LOGGING ){
+          fprintf( stderr, "err_h_25: open file table is full\n" );
+        }
+        return( 0 );
+      }
+      /* publish the slots only once the chunk is in place */
+      __atomic_store_n( &TFS_V(open_file_slots), 2 * TFS_V(open_file_slots),
+                        __ATOMIC_RELEASE );
     }
-    return( FALSE );
   }
 
-  for( i = 0; i < BLOCK_SIZE; i++ ){
-    buf[i] = blocks[b].bytes[i];
+  f = tfs_open_file( file_descriptor );
+  f->fd = fd;
+  f->byte_offset = 0;
+  pthread_rwlock_rdlock( &TFS_V(file_locks)[fd].rwlock );
+  f->current_block = TFS_V(directory)[fd].first_block;
+  pthread_rwlock_unlock( &TFS_V(file_locks)[fd].rwlock );
+  f->next = TFS_V(file_opens)[fd].head;
+  TFS_V(file_opens)[fd].head = file_descriptor;
+  TFS_V(file_opens)[fd].count++;
+
+  return( file_descriptor );
+}
+
+
+/* tfs_release_open_file()
+ *
+ * closes one open of a file: unlinks it from the chain of opens of
+ *   the file, gives up the right to write if it held it, and frees
+ *   its slot; the block map of the file goes with the last open
+ *
+ * preconditions:
+ *   (1) (unchecked) the file descriptor is open
+ *   (2) (unchecked) the caller holds the directory lock
+ *
+ * input parameter is file descriptor
+ *
+ * no return value
+ */
+
+void tfs_release_open_file( unsigned int file_descriptor ){
+  struct open_file *f = tfs_open_file( file_descriptor );
+  unsigned int fd = f->fd, writer = file_descriptor;
+  unsigned int *link;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_26: release_open_file() called with: %d\n",
+      file_descriptor );
   }
 
-  return( TRUE );
+  for( link = &TFS_V(file_opens)[fd].head;
+       *link != file_descriptor;
+       link = &tfs_open_file( *link )->next );
+  *link = f->next;
+
+  /* writers claim the file without the directory lock */
+  __atomic_compare_exchange_n( &TFS_V(file_opens)[fd].writer, &writer, 0, FALSE,
+                               __ATOMIC_RELEASE, __ATOMIC_RELAXED );
+  TFS_V(file_opens)[fd].count--;
+  memset( f, 0, sizeof( struct open_file ) );
+
+  if( TFS_V(file_opens)[fd].count == 0 ){
+    tfs_block_map_drop( fd );
+  }
 }
 
 
-/* tfs_block_write()
+/* tfs_cursor_block()
  *
- * transfers a block of data from an internal buffer to a block
- *   in storage
+ * returns the current block of an open, looking it up again when
+ *   the cursor has no block under it (0 for an empty file, or
+ *   LAST_BLOCK just past a full last block) but another open has
+ *   since written past the cursor
  *
  * preconditions:
- *   (1) block number is valid
- *   (2) (unchecked) buffer is internal to the file system
+ *   (1) (unchecked) the file descriptor is open
+ *   (2) (unchecked) the caller holds the file lock
  *
- * postconditions:
- *   the data is transfered from the buffer to the block in
- *     storage
+ * input parameter is file descriptor
  *
- * input parameters are a block number and a byte pointer
+ * return value is the current block, with the same conventions as
+ *   tfs_offset_to_block()
+ */
+
+unsigned int tfs_cursor_block( unsigned int file_descriptor ){
+  struct open_file *f = tfs_open_file( file_descriptor );
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_27: cursor_block() called with: %d\n",
+      file_descriptor );
+  }
+
+  if( ( ( f->current_block == FREE ) || ( f->current_block == LAST_BLOCK ) ) &&
+      ( f->byte_offset < TFS_V(directory)[f->fd].size ) ){
+    f->current_block = tfs_offset_to_block( f->fd, f->byte_offset );
+  }
+
+  return( f->current_block );
+}
+
+
+/* tfs_read_at()
  *
- * return value is TRUE when successful or FALSE when failure
+ * copies bytes of a file starting at a given byte offset into
+ *   the user buffer, one tfs_block_read_span() per block or per
+ *   extent of contiguous blocks; this is the transfer loop of
+ *   tfs_read() and tfs_pread(), which differ only in where the
+ *   offset comes from and whether the open is moved afterwards
+ *
+ * the count is cut short at the end of the file
+ *
+ * preconditions:
+ *   (1) (unchecked) the caller holds the file lock
+ *   (2) (unchecked) the offset is less than the file size
+ *   (3) (unchecked) the block holds the byte at the offset
+ *   (4) (unchecked) the user buffer has enough room to
+ *         contain the requested number of bytes
+ *
+ * postcondition:
+ *   (1) the end block is set to the block holding the next byte
+ *         to read or write, with the same conventions as
+ *         tfs_offset_to_block()
+ *
+ * input parameters are file descriptor, byte offset, the block
+ *   holding that offset, the address of a buffer of bytes to
+ *   transfer, the count of bytes to transfer, and the address
+ *   of the end block
+ *
+ * return value is the number of bytes transferred
  */
 
-unsigned int tfs_block_write( unsigned int b, char *buf ){
-  unsigned int i;
+unsigned int tfs_read_at( unsigned int fd,
+                          unsigned long long offset,
+                          unsigned int current_block,
+                          char *user_buffer,
+                          unsigned int byte_count,
+                          unsigned int *end_block ){
+
+  unsigned int actual_count,   /* index into user buffer  */
+               block_index,    /* index into current block */
+               start_block;
+  unsigned long long span;       /* bytes moved in one copy */
 
   if( CALL_LOGGING ){
-    fprintf( stderr, "log_h_9: block_write() called with %d and %p\n",
-      b, buf );
+    fprintf( stderr, "log_h_37: read_at() called with: %d, %llu, %d, %p, "
+      "and %d\n", fd, offset, current_block, user_buffer, byte_count );
   }
 
-  /* precondition check */
-  if( !tfs_is_block_in_range( b ) ){
-    if( ERROR_LOGGING ){
-      fprintf( stderr, "err_h_9: block out or range, %d\n", b );
+  /* stop at end of file */
+  if( byte_count > TFS_V(directory)[fd].size - offset ){
+    byte_count = TFS_V(directory)[fd].size - offset;
+  }
+
+  /* the block index starts at the offset, which may be in the
+   *   middle of a storage block
+   */
+  actual_count = 0;
+  block_index = offset % BLOCK_SIZE;
+
+  /* loop to transfer spans from storage blocks to user buffer
+   *
+   * updates on each iteration:
+   *   (1) move to the next block if needed
+   *   (2) transfer the rest of the block, or of the extent it
+   *         begins, or the rest of the request, whichever is
+   *         shorter
+   *   (3) advance actual count and block index by the span
+   *
+   * ending edge case:
+   *   block index off edge of current block
+   */
+
+  while( actual_count < byte_count ){
+
+    /* span blocks - need the next storage block from which to read */
+    if( block_index >= BLOCK_SIZE ){
+      current_block = TFS_V(file_allocation_table)[current_block];
+      block_index = 0;
     }
-    return( FALSE );
+
+    /* extend the span over an extent, i.e., while the next block
+     *   of the file is also the next block in storage
+     */
+    start_block = current_block;
+    span = BLOCK_SIZE - block_index;
+    while( ( span < byte_count - actual_count ) &&
+           ( TFS_V(file_allocation_table)[current_block] ==
+             current_block + 1 ) ){
+      current_block++;
+      span += BLOCK_SIZE;
+    }
+    if( span > byte_count - actual_count ){
+      span = byte_count - actual_count;
+    }
+    if( !tfs_block_read_span( start_block, block_index,
+                              user_buffer + actual_count, span ) ){
+      if( ERROR_LOGGING ){
+        fprintf( stderr, "err_h_37: fail to read block: %d\n",
+          start_block );
+      }
+      current_block = start_block;
+      break;
+    }
+    actual_count += span;
+    block_index += span - ( current_block - start_block ) * BLOCK_SIZE;
   }
 
-  for( i = 0; i < BLOCK_SIZE; i++ ){
-    blocks[b].bytes[i] = buf[i];
+  if( block_index >= BLOCK_SIZE ){
+    /* set next block as new current block to prepare    */
+    /*   for next read or write with no intervening seek */
+    current_block = TFS_V(file_allocation_table)[current_block];
   }
 
-  return( TRUE );
+  *end_block = current_block;
+  return( actual_count );
+}
+
+
+/* tfs_new_block()
+ *
+ * finds a free block using the free block bitmap, marks it as
+ *   the last block of a file in the FAT, and returns that block
+ *   number
+ *
+ * the bitmap is scanned one 64-bit word at a time, starting from
+ *   the lowest word that is likely to hold a free block, and the
+ *   lowest free block within a word is found with a count of
+ *   trailing zeros, so the lowest-numbered free block is returned
+ *   just as with a linear FAT scan; a full volume is detected from
+ *   the free block count without scanning
+ *
+ * the block is claimed by clearing its bit with compare-and-swap,
+ *   so threads allocating at once get different blocks; the hint
+ *   can be stale when a block below it is freed meanwhile, so a scan
+ *   that finds nothing above the hint is repeated from word 0
+ *
+ * no parameters
+ *
+ * postconditions:
+ *   (1) the block is no longer free in the bitmap
+ *   (2) the free block count is decremented
+ *   (3) the FAT entry for the block is set to LAST_BLOCK
+ *
+ * return value is the block number of a free block when
+ *   successful or 0 when failure
+ */
+
+unsigned int tfs_new_block(){
+  unsigned long long bits;
+  unsigned int w, b, first;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_7: new_block() called\n" );
+  }
+
+  first = __atomic_load_n( &TFS_V(free_block_hint), __ATOMIC_RELAXED );
+  for( ;; ){
+    if( __atomic_load_n( &TFS_V(free_block_count), __ATOMIC_RELAXED ) == 0 ){
+      break;
+    }
+    for( w = first; w < BITMAP_WORDS; w++ ){
+      bits = __atomic_load_n( &TFS_V(free_block_bitmap)[w], __ATOMIC_RELAXED );
+      while( bits != 0 ){
+        if( __atomic_compare_exchange_n( &TFS_V(free_block_bitmap)[w], &bits,
+                                         bits & ( bits - 1 ), FALSE,
+                                         __ATOMIC_ACQUIRE,
+                                         __ATOMIC_RELAXED ) ){
+          b = w*64 + __builtin_ctzll( bits );
+          __atomic_store_n( &TFS_V(free_block_hint), w, __ATOMIC_RELAXED );
+          __atomic_sub_fetch( &TFS_V(free_block_count), 1, __ATOMIC_RELAXED );
+          TFS_V(file_allocation_table)[b] = LAST_BLOCK;
+          return( b );
+        }
+      }
+    }
+    if( first == 0 ){
+      break;
+    }
+    first = 0;
+  }
+
+  if( ERROR_LOGGING ){
+    fprintf( stderr, "err_h_7: no free storage blocks\n" );
+  }
+  return( 0 );
+}
+
+
+/* tfs_free_block()
+ *
+ * returns a block to the free pool by setting its FAT entry to
+ *   FREE and marking it free in the bitmap
+ *
+ * precondition:
+ *   block number is valid
+ *
+ * postconditions:
+ *   (1) the FAT entry for the block is set to FREE
+ *   (2) the block is free in the bitmap and counted as free
+ *         (only once, if the block was already free)
+ *   (3) the block has no owner, and the FAT generation is bumped
+ *
+ * input parameter is a block number
+ *
+ * no return value
+ */
+
+void tfs_free_block( unsigned int b ){
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_10: free_block() called with: %d\n", b );
+  }
+
+  /* precondition check */
+  if( !tfs_is_block_in_range( b ) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_h_10: block out of range, %d\n", b );
+    }
+    return;
+  }
+
+  TFS_V(file_allocation_table)[b] = FREE;
+  __atomic_store_n( &TFS_V(block_owner)[b], 0, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &TFS_V(fat_generation), 1, __ATOMIC_RELAXED );
+  tfs_release_block( b );
+}
+
+
+/* tfs_claim_run()
+ *
+ * takes a run of free blocks out of the free block bitmap, all of
+ *   them or none: the bits are cleared a word at a time with
+ *   compare-and-swap, and if another thread has taken any block of
+ *   the run meanwhile, the words already cleared are put back
+ *
+ * postconditions (when successful):
+ *   (1) the blocks of the run are no longer free in the bitmap
+ *   (2) the free block count is reduced by the run length
+ *
+ * input parameters are the first block and the length of the run
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int tfs_claim_run( unsigned int start, unsigned int length ){
+  unsigned long long bits, mask;
+  unsigned int b, u, end = start + length, next;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_29: claim_run() called with: %d and %d\n",
+      start, length );
+  }
+
+  for( b = start; b < end; b = next ){
+    next = ( b/64 + 1 ) * 64;
+    if( next > end ) next = end;
+    mask = ( ( next - b == 64 ) ? ~0ULL : ( ( 1ULL << ( next - b ) ) - 1 ) )
+           << ( b % 64 );
+    bits = __atomic_load_n( &TFS_V(free_block_bitmap)[b/64], __ATOMIC_RELAXED );
+    do{
+      if( ( bits & mask ) != mask ){
+        /* lost a block to another thread; undo the earlier words,
+         *   which end on a word boundary at b
+         */
+        for( u = start; u < b; u = ( u/64 + 1 ) * 64 ){
+          __atomic_fetch_or( &TFS_V(free_block_bitmap)[u/64],
+                             ~0ULL << ( u % 64 ), __ATOMIC_RELEASE );
+        }
+        if( ERROR_LOGGING ){
+          fprintf( stderr, "err_h_29: run taken meanwhile: %d\n", start );
+        }
+        return( FALSE );
+      }
+    }while( !__atomic_compare_exchange_n( &TFS_V(free_block_bitmap)[b/64],
+                                          &bits, bits & ~mask, FALSE,
+                                          __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED ) );
+  }
+  __atomic_sub_fetch( &TFS_V(free_block_count), length, __ATOMIC_RELAXED );
+
+  return( TRUE );
+}
+
+
+/* tfs_release_block()
+ *
+ * returns a block to the free block bitmap and count (only once, if
+ *   it is already free) and lowers the allocation hint to it; the
+ *   FAT entry is left to the caller
+ *
+ * input parameter is a block number
+ *
+ * no return value
+ */
+
+void tfs_release_block( unsigned int b ){
+  unsigned long long bit = 1ULL << ( b % 64 );
+  unsigned int hint;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_30: release_block() called with: %d\n", b );
+  }
+
+  if( __atomic_fetch_or( &TFS_V(free_block_bitmap)[b/64], bit,
+                         __ATOMIC_RELEASE ) & bit ){
+    return;
+  }
+  __atomic_add_fetch( &TFS_V(free_block_count), 1, __ATOMIC_RELAXED );
+  hint = __atomic_load_n( &TFS_V(free_block_hint), __ATOMIC_RELAXED );
+  while( ( b/64 < hint ) &&
+         !__atomic_compare_exchange_n( &TFS_V(free_block_hint), &hint, b/64,
+                                       FALSE, __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED ) );
+}
+
+
+/* tfs_mark_dirty()
+ *
+ * marks a run of blocks as written since the last sync, with one
+ *   atomic update per word of the dirty block bitmap
+ *
+ * input parameters are the first block and the number of blocks
+ *
+ * no return value
+ */
+
+void tfs_mark_dirty( unsigned int b, unsigned int count ){
+  unsigned long long mask;
+  unsigned int end = b + count, next;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_31: mark_dirty() called with: %d and %d\n",
+      b, count );
+  }
+
+  for( ; b < end; b = next ){
+    next = ( b/64 + 1 ) * 64;
+    if( next > end ) next = end;
+    mask = ( ( next - b == 64 ) ? ~0ULL : ( ( 1ULL << ( next - b ) ) - 1 ) )
+           << ( b % 64 );
+    __atomic_fetch_or( &TFS_V(dirty_block_bitmap)[b/64], mask,
+                       __ATOMIC_RELAXED );
+  }
+}
+
+
+/* tfs_exchange_blocks()
+ *
+ * swaps two blocks in storage, at least one of which is in use,
+ *   together with their FAT entries, reverse links, and owners, and
+ *   then renames every reference to either block (the neighboring
+ *   FAT entries and reverse links, and the first, current, and last
+ *   blocks of the owning files) so that each file still reads the
+ *   same bytes in the same order; when one block is free, this moves
+ *   the other block into it
+ *
+ * the block maps of the owning files are discarded, to be rebuilt
+ *   on next use
+ *
+ * a free block taking part in the exchange must already have been
+ *   claimed by the caller, so that no other thread can allocate it
+ *   meanwhile; the block left free by the exchange is released
+ *
+ * preconditions:
+ *   (1) (unchecked) both block numbers are valid and distinct
+ *   (2) (unchecked) at least one of the blocks is in use
+ *   (3) (unchecked) a free block among the two has been claimed with
+ *         tfs_claim_run()
+ *   (4) (unchecked) the caller holds the directory lock and the file
+ *         locks of the owning files exclusively
+ *
+ * input parameters are two block numbers
+ *
+ * no return value
+ */
+
+#define SWAP_ID( v ) ( ( (v) == x ) ? y : ( ( (v) == y ) ? x : (v) ) )
+
+void tfs_exchange_blocks( unsigned int x, unsigned int y ){
+  unsigned int fat_sites[4], prev_sites[4], fds[2];
+  unsigned int n_fat = 0, n_prev = 0, n_fd = 0;
+  unsigned int u, p, n, i, j, t, d;
+  char *temp_x, *temp_y;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_23: exchange_blocks() called with: %d and %d\n",
+      x, y );
+  }
+
+  /* collect the sites that refer to x or y, as positions after the
+   *   swap; the entries of x and y themselves move with the swap
+   */
+  fat_sites[n_fat++] = x;
+  fat_sites[n_fat++] = y;
+  prev_sites[n_prev++] = x;
+  prev_sites[n_prev++] = y;
+  for( i = 0; i < 2; i++ ){
+    u = ( i == 0 ) ? x : y;
+    if( TFS_V(file_allocation_table)[u] == FREE ) continue;
+    p = TFS_V(block_prev)[u];
+    n = TFS_V(file_allocation_table)[u];
+    if( p != FREE ){
+      fat_sites[n_fat++] = SWAP_ID( p );
+    }
+    if( n != LAST_BLOCK ){
+      prev_sites[n_prev++] = SWAP_ID( n );
+    }
+    fds[n_fd++] = TFS_V(block_owner)[u];
+  }
+
+  /* swap contents, links, and owners; the contents go through the
+   *   swap buffer of the volume, which the directory lock protects
+   */
+  temp_x = TFS_V(swap_buffer);
+  temp_y = temp_x + BLOCK_SIZE;
+  tfs_block_read( x, temp_x );
+  tfs_block_read( y, temp_y );
+  tfs_block_write( x, temp_y );
+  tfs_block_write( y, temp_x );
+  t = TFS_V(file_allocation_table)[x];
+  TFS_V(file_allocation_table)[x] = TFS_V(file_allocation_table)[y];
+  TFS_V(file_allocation_table)[y] = t;
+  t = TFS_V(block_prev)[x];
+  TFS_V(block_prev)[x] = TFS_V(block_prev)[y];
+  TFS_V(block_prev)[y] = t;
+  t = TFS_V(block_owner)[x];
+  TFS_V(block_owner)[x] = TFS_V(block_owner)[y];
+  TFS_V(block_owner)[y] = t;
+
+  /* rename references, once per site */
+  for( i = 0; i < n_fat; i++ ){
+    for( j = 0; ( j < i ) && ( fat_sites[j] != fat_sites[i] ); j++ );
+    if( j == i ){
+      TFS_V(file_allocation_table)[fat_sites[i]] =
+        SWAP_ID( TFS_V(file_allocation_table)[fat_sites[i]] );
+    }
+  }
+  for( i = 0; i < n_prev; i++ ){
+    for( j = 0; ( j < i ) && ( prev_sites[j] != prev_sites[i] ); j++ );
+    if( j == i ){
+      TFS_V(block_prev)[prev_sites[i]] =
+        SWAP_ID( TFS_V(block_prev)[prev_sites[i]] );
+    }
+  }
+  for( i = 0; i < n_fd; i++ ){
+    if( ( i == 1 ) && ( fds[1] == fds[0] ) ) continue;
+    TFS_V(directory)[fds[i]].first_block =
+      SWAP_ID( TFS_V(directory)[fds[i]].first_block );
+    for( d = TFS_V(file_opens)[fds[i]].head; d != 0;
+         d = tfs_open_file( d )->next ){
+      tfs_open_file( d )->current_block =
+        SWAP_ID( tfs_open_file( d )->current_block );
+    }
+    TFS_V(directory)[fds[i]].last_block =
+      SWAP_ID( TFS_V(directory)[fds[i]].last_block );
+    tfs_block_map_drop( fds[i] );
+  }
+
+  /* the block now holding the free entry goes back to the bitmap */
+  if( TFS_V(file_allocation_table)[x] == FREE ) tfs_release_block( x );
+  if( TFS_V(file_allocation_table)[y] == FREE ) tfs_release_block( y );
+}
+
+#undef SWAP_ID
+
+
+/* tfs_new_extent()
+ *
+ * allocates a run of contiguous free blocks (an extent) and chains
+ *   it in the FAT in ascending order, ending in LAST_BLOCK; the
+ *   lowest run that holds all of the wanted blocks is used, and if
+ *   there is none, the longest run there is
+ *
+ * free runs are found in the bitmap a word at a time, using counts
+ *   of trailing zeros on the bitmap and on its complement to jump to
+ *   the start and the end of each run
+ *
+ * the run is then claimed with tfs_claim_run(); if another thread
+ *   takes part of it first, the search is done again, and as in
+ *   tfs_new_block() a search that finds nothing above the hint is
+ *   repeated from word 0
+ *
+ * postconditions:
+ *   (1) the blocks of the extent are no longer free in the bitmap
+ *   (2) the free block count is reduced by the extent length
+ *   (3) the FAT entry of each block of the extent points to the
+ *         next block, and the last one is LAST_BLOCK
+ *
+ * input parameters are the number of blocks wanted and the address
+ *   where the number of blocks allocated is returned
+ *
+ * return value is the first block of the extent when successful or
+ *   0 when failure (no free blocks or nothing wanted)
+ */
+
+unsigned int tfs_new_extent( unsigned int want, unsigned int *count ){
+  unsigned long long bits;
+  unsigned int w, b, start, end, best_start, best_length, first;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_22: new_extent() called with: %d\n", want );
+  }
+
+  *count = 0;
+  if( ( want == 0 ) ||
+      ( __atomic_load_n( &TFS_V(free_block_count), __ATOMIC_RELAXED ) == 0 ) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_h_22: no free storage blocks\n" );
+    }
+    return( 0 );
+  }
+  if( want == 1 ){
+    b = tfs_new_block();
+    *count = ( b != 0 );
+    return( b );
+  }
+
+  first = __atomic_load_n( &TFS_V(free_block_hint), __ATOMIC_RELAXED );
+  for( ;; ){
+    best_start = 0;
+    best_length = 0;
+    b = first * 64;
+    while( b < N_BLOCKS ){
+
+      /* start of the next free run */
+      w = b / 64;
+      bits = __atomic_load_n( &TFS_V(free_block_bitmap)[w], __ATOMIC_RELAXED ) &
+             ( ~0ULL << ( b % 64 ) );
+      while( bits == 0 ){
+        if( ++w >= BITMAP_WORDS ) break;
+        bits = __atomic_load_n( &TFS_V(free_block_bitmap)[w],
+                                __ATOMIC_RELAXED );
+      }
+      if( bits == 0 ) break;
+      start = w*64 + __builtin_ctzll( bits );
+
+      /* end of the run: the next block that is not free */
+      w = start / 64;
+      bits = ~__atomic_load_n( &TFS_V(free_block_bitmap)[w],
+                               __ATOMIC_RELAXED ) &
+             ( ~0ULL << ( start % 64 ) );
+      while( bits == 0 ){
+        if( ++w >= BITMAP_WORDS ) break;
+        bits = ~__atomic_load_n( &TFS_V(free_block_bitmap)[w],
+                                 __ATOMIC_RELAXED );
+      }
+      end = ( bits == 0 ) ? N_BLOCKS : w*64 + __builtin_ctzll( bits );
+      if( end > N_BLOCKS ) end = N_BLOCKS;
+
+      if( end - start >= want ){
+        best_start = start;
+        best_length = want;
+        break;
+      }
+      if( end - start > best_length ){
+        best_start = start;
+        best_length = end - start;
+      }
+      b = end;
+    }
+
+    if( best_length == 0 ){
+      if( first == 0 ){
+        if( ERROR_LOGGING ){
+          fprintf( stderr, "err_h_22: no free storage blocks\n" );
+        }
+        return( 0 );
+      }
+      first = 0;
+    }else if( tfs_claim_run( best_start, best_length ) ){
+      break;
+    }
+  }
+
+  /* chain the extent */
+  for( b = best_start; b < best_start + best_length; b++ ){
+    TFS_V(file_allocation_table)[b] = b + 1;
+    TFS_V(block_prev)[b] = b - 1;
+  }
+  TFS_V(file_allocation_table)[best_start + best_length - 1] = LAST_BLOCK;
+
+  *count = best_length;
+  return( best_start );
+}
+
+
+/* tfs_block_read()
+ *
+ * transfers a block of data from a block in storage to an
+ *   internal buffer
+ *
+ * preconditions:
+ *   (1) block number is valid
+ *   (2) (unchecked) buffer is internal to the file system
+ *
+ * postconditions:
+ *   the data is transfered from the block in storage to the
+ *     buffer
+ *
+ * input parameters are a block number and a byte pointer
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int tfs_block_read( unsigned int b, char *buf ){
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_8: block_read() called with %d and %p\n",
+      b, buf );
+  }
+
+  /* precondition check */
+  if( !tfs_is_block_in_range( b ) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_h_8: block out or range, %d\n", b );
+    }
+    return( FALSE );
+  }
+
+  if( TFS_V(cache_data) != NULL ){
+    return( tfs_cache_transfer( b, 0, buf, BLOCK_SIZE, FALSE ) );
+  }
+  memcpy( buf, BLOCK( b ), BLOCK_SIZE );
+
+  return( TRUE );
+}
+
+
+/* tfs_block_write()
+ *
+ * transfers a block of data from an internal buffer to a block
+ *   in storage
+ *
+ * preconditions:
+ *   (1) block number is valid
+ *   (2) (unchecked) buffer is internal to the file system
+ *
+ * postconditions:
+ *   the data is transfered from the buffer to the block in
+ *     storage
+ *
+ * input parameters are a block number and a byte pointer
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int tfs_block_write( unsigned int b, char *buf ){
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_9: block_write() called with %d and %p\n",
+      b, buf );
+  }
+
+  /* precondition check */
+  if( !tfs_is_block_in_range( b ) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_h_9: block out or range, %d\n", b );
+    }
+    return( FALSE );
+  }
+
+  if( TFS_V(cache_data) != NULL ){
+    return( tfs_cache_transfer( b, 0, buf, BLOCK_SIZE, TRUE ) );
+  }
+  memcpy( BLOCK( b ), buf, BLOCK_SIZE );
+  tfs_mark_dirty( b, 1 );
+
+  return( TRUE );
+}
+
+
+/* tfs_block_read_span()
+ *
+ * transfers part of a block in storage directly to a buffer,
+ *   which may be a user buffer since there is no need for an
+ *   internal block-sized buffer; the span may run on into the
+ *   blocks that follow in storage, so a whole extent of a file
+ *   is transferred with a single copy (or with one copy per block
+ *   through the block cache, when there is one)
+ *
+ * preconditions:
+ *   (1) block number is valid
+ *   (2) the span ends within the volume
+ *   (3) (unchecked) the blocks the span runs into belong to the
+ *         same file, in order
+ *
+ * postconditions:
+ *   the bytes of the span are transferred from the block in
+ *     storage to the buffer
+ *
+ * input parameters are a block number, a byte index within the
+ *   block, a byte pointer, and a byte count
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int tfs_block_read_span( unsigned int b, unsigned int index,
+                                  char *buf, unsigned int count ){
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_16: block_read_span() called with %d, %d, %p,"
+      " and %d\n", b, index, buf, count );
+  }
+
+  /* precondition checks */
+  if( !tfs_is_block_in_range( b ) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_h_16.1: block out or range, %d\n", b );
+    }
+    return( FALSE );
+  }
+  if( (unsigned long long) index + count >
+      ( (unsigned long long)( N_BLOCKS - b ) << BLOCK_SIZE_AS_POWER_OF_2 ) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_h_16.2: span out of range, %d and %d\n",
+        index, count );
+    }
+    return( FALSE );
+  }
+
+  if( TFS_V(cache_data) != NULL ){
+    return( tfs_cache_transfer( b, index, buf, count, FALSE ) );
+  }
+  memcpy( buf, BLOCK( b ) + index, count );
+
+  return( TRUE );
+}
+
+
+/* tfs_block_write_span()
+ *
+ * transfers bytes from a buffer directly into part of a block
+ *   in storage; bytes of the block outside the span are left
+ *   unchanged, so no read-modify-write is needed; as with
+ *   tfs_block_read_span(), the span may cover an extent
+ *
+ * preconditions:
+ *   (1) block number is valid
+ *   (2) the span ends within the volume
+ *   (3) (unchecked) the blocks the span runs into belong to the
+ *         same file, in order
+ *
+ * postconditions:
+ *   (1) the bytes of the span are transferred from the buffer
+ *         to storage
+ *   (2) each block the span touches is marked dirty
+ *
+ * input parameters are a block number, a byte index within the
+ *   block, a byte pointer, and a byte count
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int tfs_block_write_span( unsigned int b, unsigned int index,
+                                   char *buf, unsigned int count ){
+  unsigned int last;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_17: block_write_span() called with %d, %d, %p,"
+      " and %d\n", b, index, buf, count );
+  }
+
+  /* precondition checks */
+  if( !tfs_is_block_in_range( b ) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_h_17.1: block out or range, %d\n", b );
+    }
+    return( FALSE );
+  }
+  if( (unsigned long long) index + count >
+      ( (unsigned long long)( N_BLOCKS - b ) << BLOCK_SIZE_AS_POWER_OF_2 ) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_h_17.2: span out of range, %d and %d\n",
+        index, count );
+    }
+    return( FALSE );
+  }
+
+  if( TFS_V(cache_data) != NULL ){
+    return( tfs_cache_transfer( b, index, buf, count, TRUE ) );
+  }
+  memcpy( BLOCK( b ) + index, buf, count );
+  last = b + ( ( index + count - 1 ) >> BLOCK_SIZE_AS_POWER_OF_2 );
+  if( count > 0 ) tfs_mark_dirty( b, last - b + 1 );
+
+  return( TRUE );
+}
+
+
+/* tfs_cache_block()
+ *
+ * finds the cache frame holding a data block, reading the block
+ *   from the image into a frame on a miss; the frame is chosen in
+ *   CLOCK order, passing over (and clearing the reference bit of)
+ *   each recently used frame, and a dirty block in it is written
+ *   back to the image first
+ *
+ * a block that is about to be overwritten whole need not be read
+ *
+ * cache_lock is not held across the device I/O of a miss: the frame
+ *   is marked busy, already mapped from both the old block and the
+ *   new one, and the lock is dropped for the write-back and the
+ *   read; a thread that finds either block in a busy frame waits on
+ *   cache_done and looks again, so neither block is ever read from
+ *   the image while its latest bytes are still only in the frame,
+ *   and frames that are not busy can be used by other threads
+ *   meanwhile
+ *
+ * preconditions:
+ *   (1) (unchecked) there is a block cache, and the caller holds
+ *         cache_lock
+ *   (2) (unchecked) the block number is valid
+ *
+ * postconditions:
+ *   (1) the block is in a frame that is not busy and whose reference
+ *         bit is set, the hit or miss is counted, and the caller
+ *         holds cache_lock again
+ *
+ * input parameters are a block number and whether the caller will
+ *   overwrite the whole block
+ *
+ * return value is the address of the frame when successful or NULL
+ *   when the image could not be read or written
+ */
+
+char *tfs_cache_block( unsigned int b, unsigned int whole ){
+  unsigned int f, victim, steps, dirty;
+  unsigned long long bit;
+  char *frame;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_32: cache_block() called with: %d and %d\n",
+      b, whole );
+  }
+
+  for( ;; ){
+    if( TFS_V(cache_frame_of)[b] != 0 ){
+      f = TFS_V(cache_frame_of)[b] - 1;
+      if( TFS_V(cache_busy)[f] ){
+        pthread_cond_wait( &TFS_V(cache_done), &TFS_V(cache_lock) );
+        continue;
+      }
+      TFS_V(cache_referenced)[f] = 1;
+      TFS_V(cache_hits)++;
+      return( TFS_V(cache_data) +
+              ( (unsigned long long) f << BLOCK_SIZE_AS_POWER_OF_2 ) );
+    }
+
+    /* CLOCK: take the first frame not used since the hand last
+     *   passed, passing over busy frames; two sweeps clear every
+     *   reference bit, so if nothing turns up every frame is busy
+     */
+    for( steps = 0; steps < 2 * TFS_V(cache_frames); steps++ ){
+      f = TFS_V(cache_hand);
+      TFS_V(cache_hand) = ( TFS_V(cache_hand) + 1 ) % TFS_V(cache_frames);
+      if( TFS_V(cache_busy)[f] ) continue;
+      if( !TFS_V(cache_referenced)[f] ) break;
+      TFS_V(cache_referenced)[f] = 0;
+    }
+    if( steps < 2 * TFS_V(cache_frames) ) break;
+    pthread_cond_wait( &TFS_V(cache_done), &TFS_V(cache_lock) );
+  }
+  TFS_V(cache_misses)++;
+  frame = TFS_V(cache_data) +
+          ( (unsigned long long) f << BLOCK_SIZE_AS_POWER_OF_2 );
+
+  /* claim the frame for the new block, leaving the old block mapped
+   *   to it until it is written back
+   */
+  victim = TFS_V(cache_block)[f];
+  dirty = FALSE;
+  if( victim != 0 ){
+    bit = 1ULL << ( victim % 64 );
+    dirty = ( __atomic_fetch_and( &TFS_V(dirty_block_bitmap)[victim/64],
+                                  ~bit, __ATOMIC_ACQ_REL ) & bit ) != 0;
+  }
+  TFS_V(cache_busy)[f] = 1;
+  TFS_V(cache_block)[f] = b;
+  TFS_V(cache_frame_of)[b] = f + 1;
+  pthread_mutex_unlock( &TFS_V(cache_lock) );
+
+  if( dirty &&
+      ( pwrite( TFS_V(volume_fd), frame, BLOCK_SIZE,
+                (off_t) victim << BLOCK_SIZE_AS_POWER_OF_2 ) !=
+        (ssize_t) BLOCK_SIZE ) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_h_32.1: unable to write back block %d\n",
+        victim );
+    }
+    pthread_mutex_lock( &TFS_V(cache_lock) );
+    __atomic_fetch_or( &TFS_V(dirty_block_bitmap)[victim/64],
+                       1ULL << ( victim % 64 ), __ATOMIC_RELAXED );
+    TFS_V(cache_block)[f] = victim;
+    TFS_V(cache_frame_of)[b] = 0;
+    TFS_V(cache_busy)[f] = 0;
+    pthread_cond_broadcast( &TFS_V(cache_done) );
+    return( NULL );
+  }
+
+  if( !whole &&
+      ( pread( TFS_V(volume_fd), frame, BLOCK_SIZE,
+               (off_t) b << BLOCK_SIZE_AS_POWER_OF_2 ) !=
+        (ssize_t) BLOCK_SIZE ) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_h_32.2: unable to read block %d\n", b );
+    }
+    pthread_mutex_lock( &TFS_V(cache_lock) );
+    if( dirty ) TFS_V(cache_writebacks)++;
+    if( victim != 0 ) TFS_V(cache_frame_of)[victim] = 0;
+    TFS_V(cache_block)[f] = 0;
+    TFS_V(cache_frame_of)[b] = 0;
+    TFS_V(cache_busy)[f] = 0;
+    pthread_cond_broadcast( &TFS_V(cache_done) );
+    return( NULL );
+  }
+
+  pthread_mutex_lock( &TFS_V(cache_lock) );
+  if( dirty ) TFS_V(cache_writebacks)++;
+  if( victim != 0 ) TFS_V(cache_frame_of)[victim] = 0;
+  TFS_V(cache_referenced)[f] = 1;
+  TFS_V(cache_busy)[f] = 0;
+  pthread_cond_broadcast( &TFS_V(cache_done) );
+
+  return( frame );
+}
+
+
+/* tfs_cache_transfer()
+ *
+ * moves a span of bytes between a buffer and data blocks through the
+ *   block cache, one block at a time; the span may run on into the
+ *   blocks that follow in storage, as for tfs_block_read_span() and
+ *   tfs_block_write_span(), and written blocks are marked dirty
+ *
+ * cache_lock is taken once per block and only covers finding the
+ *   frame and copying the bytes, so transfers to other blocks go on
+ *   while one waits for the device
+ *
+ * preconditions:
+ *   (1) (unchecked) there is a block cache
+ *   (2) (unchecked) the span is within the volume, past the FAT
+ *
+ * postconditions:
+ *   (1) the bytes have been transferred, or as many blocks of them as
+ *         the image could be read and written for
+ *
+ * input parameters are a block number, a byte index within the
+ *   block, a byte pointer, a byte count, and TRUE to write into the
+ *   blocks or FALSE to read from them
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int tfs_cache_transfer( unsigned int b, unsigned int index,
+                                 char *buf, unsigned int count,
+                                 unsigned int write ){
+  unsigned int n;
+  char *frame;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_33: cache_transfer() called with %d, %d, %p,"
+      " %d, and %d\n", b, index, buf, count, write );
+  }
+
+  while( count > 0 ){
+    n = BLOCK_SIZE - index;
+    if( n > count ) n = count;
+    pthread_mutex_lock( &TFS_V(cache_lock) );
+    frame = tfs_cache_block( b, write && ( n == BLOCK_SIZE ) );
+    if( frame == NULL ){
+      pthread_mutex_unlock( &TFS_V(cache_lock) );
+      return( FALSE );
+    }
+    if( write ){
+      memcpy( frame + index, buf, n );
+      tfs_mark_dirty( b, 1 );
+    }else{
+      memcpy( buf, frame + index, n );
+    }
+    pthread_mutex_unlock( &TFS_V(cache_lock) );
+    buf += n;
+    count -= n;
+    index = 0;
+    b++;
+  }
+
+  return( TRUE );
+}
+
+
+/* tfs_cache_flush()
+ *
+ * writes every dirty cached block back to the image, leaving it in
+ *   the cache
+ *
+ * as in tfs_cache_block(), each frame is marked busy and cache_lock
+ *   is dropped while it is written, so that the block is neither
+ *   changed nor replaced under the write; dirty bits of blocks that
+ *   are not cached (the directory and FAT, which tfs_sync() writes
+ *   with the mapping) are just cleared
+ *
+ * preconditions:
+ *   (1) (unchecked) there is a block cache
+ *
+ * postconditions:
+ *   (1) no cached block is dirty, except those that could not be
+ *         written
+ *
+ * no parameters
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int tfs_cache_flush(){
+  unsigned long long w, pending, bit;
+  unsigned int b, f, written, ok = TRUE;
+  char *frame;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_34: cache_flush() called\n" );
+  }
+
+  pthread_mutex_lock( &TFS_V(cache_lock) );
+  for( w = 0; w < BITMAP_WORDS; w++ ){
+
+    /* the blocks dirty now; blocks dirtied meanwhile wait for the
+     *   next flush
+     */
+    pending = __atomic_load_n( &TFS_V(dirty_block_bitmap)[w],
+                               __ATOMIC_ACQUIRE );
+    while( pending != 0 ){
+      b = w*64 + __builtin_ctzll( pending );
+      bit = 1ULL << ( b % 64 );
+      if( TFS_V(cache_frame_of)[b] == 0 ){
+        __atomic_fetch_and( &TFS_V(dirty_block_bitmap)[w], ~bit,
+                            __ATOMIC_RELAXED );
+        pending &= ~bit;
+        continue;
+      }
+      f = TFS_V(cache_frame_of)[b] - 1;
+      if( TFS_V(cache_busy)[f] ){
+        /* being replaced or written already, look again after */
+        pthread_cond_wait( &TFS_V(cache_done), &TFS_V(cache_lock) );
+        continue;
+      }
+      pending &= ~bit;
+      if( !( __atomic_fetch_and( &TFS_V(dirty_block_bitmap)[w], ~bit,
+                                 __ATOMIC_ACQ_REL ) & bit ) ){
+        continue;
+      }
+
+      TFS_V(cache_busy)[f] = 1;
+      frame = TFS_V(cache_data) +
+              ( (unsigned long long) f << BLOCK_SIZE_AS_POWER_OF_2 );
+      pthread_mutex_unlock( &TFS_V(cache_lock) );
+      written = pwrite( TFS_V(volume_fd), frame, BLOCK_SIZE,
+                        (off_t) b << BLOCK_SIZE_AS_POWER_OF_2 ) ==
+                (ssize_t) BLOCK_SIZE;
+      pthread_mutex_lock( &TFS_V(cache_lock) );
+      if( written ){
+        TFS_V(cache_writebacks)++;
+      }else{
+        __atomic_fetch_or( &TFS_V(dirty_block_bitmap)[w], bit,
+                           __ATOMIC_RELAXED );
+        ok = FALSE;
+      }
+      TFS_V(cache_busy)[f] = 0;
+      pthread_cond_broadcast( &TFS_V(cache_done) );
+    }
+  }
+  pthread_mutex_unlock( &TFS_V(cache_lock) );
+
+  if( !ok && ERROR_LOGGING ){
+    fprintf( stderr, "err_h_34: unable to write back dirty blocks\n" );
+  }
+  return( ok );
+}
+
+
+/* tfs_build_cache()
+ *
+ * sets up an empty block cache of cache_capacity frames (at most one
+ *   per data block) for the mounted image described by geometry
+ *
+ * preconditions:
+ *   (1) (unchecked) cache_capacity is not 0, and there is no cache
+ *
+ * no parameters
+ *
+ * no return value
+ */
+
+void tfs_build_cache(){
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_35: build_cache() called\n" );
+  }
+
+  TFS_V(cache_frames) = TFS_V(cache_capacity);
+  if( TFS_V(cache_frames) > N_BLOCKS - FIRST_VALID_BLOCK ){
+    TFS_V(cache_frames) = N_BLOCKS - FIRST_VALID_BLOCK;
+  }
+  TFS_V(cache_data) = malloc( (unsigned long long) TFS_V(cache_frames) <<
+                              BLOCK_SIZE_AS_POWER_OF_2 );
+  TFS_V(cache_block) = calloc( TFS_V(cache_frames), sizeof( unsigned int ) );
+  TFS_V(cache_referenced) = calloc( TFS_V(cache_frames),
+                                   sizeof( unsigned char ) );
+  TFS_V(cache_busy) = calloc( TFS_V(cache_frames), sizeof( unsigned char ) );
+  TFS_V(cache_frame_of) = calloc( N_BLOCKS, sizeof( unsigned int ) );
+  assert( TFS_V(cache_data) && TFS_V(cache_block) &&
+          TFS_V(cache_referenced) && TFS_V(cache_busy) &&
+          TFS_V(cache_frame_of) );
+  TFS_V(cache_hand) = 0;
+  TFS_V(cache_hits) = 0;
+  TFS_V(cache_misses) = 0;
+  TFS_V(cache_writebacks) = 0;
+  pthread_mutex_init( &TFS_V(cache_lock), NULL );
+  pthread_cond_init( &TFS_V(cache_done), NULL );
+}
+
+
+/* tfs_release_cache()
+ *
+ * writes back the dirty blocks of the block cache, if there is one,
+ *   as the system would for a mapped image, and frees the cache
+ *
+ * no parameters
+ *
+ * no return value
+ */
+
+void tfs_release_cache(){
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_36: release_cache() called\n" );
+  }
+
+  if( TFS_V(cache_data) == NULL ) return;
+
+  tfs_cache_flush();
+  pthread_cond_destroy( &TFS_V(cache_done) );
+  pthread_mutex_destroy( &TFS_V(cache_lock) );
+  free( TFS_V(cache_data) );
+  free( TFS_V(cache_block) );
+  free( TFS_V(cache_referenced) );
+  free( TFS_V(cache_busy) );
+  free( TFS_V(cache_frame_of) );
+  TFS_V(cache_data) = NULL;
+  TFS_V(cache_block) = NULL;
+  TFS_V(cache_referenced) = NULL;
+  TFS_V(cache_busy) = NULL;
+  TFS_V(cache_frame_of) = NULL;
+}
+
+
+/* tfs_set_geometry()
+ *
+ * checks a requested geometry and fills in a geometry record,
+ *   including the derived directory and FAT layout; the current
+ *   volume is not changed
+ *
+ * the directory starts at block 0 and the FAT starts at the first
+ *   block boundary past the directory; file data blocks start at
+ *   the first block boundary past the FAT
+ *
+ * preconditions:
+ *   (1) the block size is a power of two between MIN_BLOCK_SIZE
+ *         and MAX_BLOCK_SIZE
+ *   (2) there are at least 2 and at most MAX_N_DIRECTORY_ENTRIES
+ *         directory entries
+ *   (3) the directory and FAT leave at least one data block
+ *
+ * input parameters are the geometry record to fill in, the number
+ *   of blocks, the block size in bytes, and the number of directory
+ *   entries
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int tfs_set_geometry( struct tfs_geometry *g,
+                               unsigned int n_blocks,
+                               unsigned int block_size,
+                               unsigned int n_directory_entries ){
+  unsigned long long directory_blocks, fat_blocks;
+  unsigned int shift, bits;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_13: set_geometry() called with: %u, %u, and %u\n",
+      n_blocks, block_size, n_directory_entries );
+  }
+
+  /* precondition checks */
+  if( ( block_size < MIN_BLOCK_SIZE ) || ( block_size > MAX_BLOCK_SIZE ) ||
+      ( ( block_size & ( block_size - 1 ) ) != 0 ) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_h_13.1: invalid block size: %u\n", block_size );
+    }
+    return( FALSE );
+  }
+  if( ( n_directory_entries < 2 ) ||
+      ( n_directory_entries > MAX_N_DIRECTORY_ENTRIES ) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_h_13.2: invalid directory size: %u\n",
+        n_directory_entries );
+    }
+    return( FALSE );
+  }
+  for( shift = 0; ( 1U << shift ) < block_size; shift++ );
+  directory_blocks = ( (unsigned long long) n_directory_entries *
+                       sizeof( struct directory_entry ) + block_size - 1 )
+                     >> shift;
+  fat_blocks = ( (unsigned long long) n_blocks * sizeof( unsigned int ) +
+                 block_size - 1 ) >> shift;
+  if( directory_blocks + fat_blocks >= n_blocks ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_h_13.3: no room for data blocks: %u\n",
+        n_blocks );
+    }
+    return( FALSE );
+  }
+
+  for( bits = 1; ( 1U << bits ) < 2 * n_directory_entries; bits++ );
+
+  g->magic = TFS_MAGIC;
+  g->n_blocks = n_blocks;
+  g->block_size = block_size;
+  g->n_directory_entries = n_directory_entries;
+  g->fat_block = directory_blocks;
+  g->first_valid_block = directory_blocks + fat_blocks;
+  g->block_shift = shift;
+  g->name_hash_bits = bits;
+
+  return( TRUE );
+}
+
+
+/* tfs_build_tables()
+ *
+ * points the directory and FAT into storage and rebuilds the
+ *   in-memory tables (free block bitmap and count, dirty block
+ *   bitmap, name index, and reverse links) from the directory and
+ *   FAT contents; the last block of each file is also recomputed
+ *   from its chain, and the open file table starts out with every
+ *   file closed
+ *
+ * the directory lock, the block map lock, and one file lock per
+ *   directory entry are also set up here; the directory lock is
+ *   recursive, so that public functions may call one another
+ *
+ * preconditions:
+ *   (1) (unchecked) geometry describes the volume in storage
+ *
+ * no parameters
+ *
+ * no return value
+ */
+
+void tfs_build_tables(){
+  pthread_mutexattr_t attributes;
+  unsigned long long b;
+  unsigned int fd;
+  void *p;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_14: build_tables() called\n" );
+  }
+
+  TFS_V(directory) = (struct directory_entry *) TFS_V(storage);
+  TFS_V(file_allocation_table) = (unsigned int *) BLOCK( FAT_BLOCK );
+
+  TFS_V(free_block_bitmap) = calloc( BITMAP_WORDS,
+                                    sizeof( unsigned long long ) );
+  TFS_V(dirty_block_bitmap) = calloc( BITMAP_WORDS,
+                                     sizeof( unsigned long long ) );
+  TFS_V(name_hash_head) = calloc( NAME_HASH_SIZE, sizeof( unsigned int ) );
+  TFS_V(name_hash_next) = calloc( N_DIRECTORY_ENTRIES, sizeof( unsigned int ) );
+  TFS_V(block_maps) = calloc( N_DIRECTORY_ENTRIES, sizeof( struct block_map ) );
+  TFS_V(block_prev) = calloc( N_BLOCKS, sizeof( unsigned int ) );
+  TFS_V(block_owner) = calloc( N_BLOCKS, sizeof( unsigned int ) );
+  TFS_V(swap_buffer) = malloc( 2 * BLOCK_SIZE );
+  TFS_V(open_file_slots) = N_DIRECTORY_ENTRIES;
+  TFS_V(open_file_chunks)[0] = calloc( TFS_V(open_file_slots),
+                                      sizeof( struct open_file ) );
+  TFS_V(file_opens) = calloc( N_DIRECTORY_ENTRIES,
+                              sizeof( struct file_opens ) );
+  p = NULL;
+  if( posix_memalign( &p, sizeof( struct file_lock ),
+                      N_DIRECTORY_ENTRIES * sizeof( struct file_lock ) ) ){
+    p = NULL;
+  }
+  TFS_V(file_locks) = p;
+  assert( TFS_V(free_block_bitmap) && TFS_V(dirty_block_bitmap) &&
+          TFS_V(name_hash_head) && TFS_V(name_hash_next) &&
+          TFS_V(block_maps) && TFS_V(block_prev) && TFS_V(block_owner) &&
+          TFS_V(swap_buffer) && TFS_V(open_file_chunks)[0] &&
+          TFS_V(file_opens) && TFS_V(file_locks) );
+  TFS_V(defrag_fd) = 0;
+
+  pthread_mutexattr_init( &attributes );
+  pthread_mutexattr_settype( &attributes, PTHREAD_MUTEX_RECURSIVE );
+  pthread_mutex_init( &TFS_V(directory_lock), &attributes );
+  pthread_mutexattr_destroy( &attributes );
+  pthread_mutex_init( &TFS_V(block_map_lock), NULL );
+  for( fd = 0; fd < N_DIRECTORY_ENTRIES; fd++ ){
+    pthread_rwlock_init( &TFS_V(file_locks)[fd].rwlock, NULL );
+  }
+
+  TFS_V(free_block_count) = 0;
+  TFS_V(free_block_hint) = 0;
+  for( b = FIRST_VALID_BLOCK; b < N_BLOCKS; b++ ){
+    if( TFS_V(file_allocation_table)[b] == FREE ){
+      TFS_V(free_block_bitmap)[b/64] |= 1ULL << ( b % 64 );
+      TFS_V(free_block_count)++;
+    }
+  }
+
+  for( fd = FIRST_VALID_FD; fd < N_DIRECTORY_ENTRIES; fd++ ){
+    if( TFS_V(directory)[fd].status != UNUSED ){
+      tfs_name_index_insert( fd );
+
+      /* recompute the tail pointer rather than trust the image,
+       *   and record the reverse links along the way
+       */
+      TFS_V(directory)[fd].last_block = FREE;
+      for( b = TFS_V(directory)[fd].first_block;
+           ( b != FREE ) && ( b != LAST_BLOCK );
+           b = TFS_V(file_allocation_table)[b] ){
+        TFS_V(block_prev)[b] = TFS_V(directory)[fd].last_block;
+        TFS_V(block_owner)[b] = fd;
+        TFS_V(directory)[fd].last_block = b;
+      }
+    }
+  }
+}
+
+
+/* tfs_release_volume()
+ *
+ * releases the storage of the current volume (unmapping and
+ *   closing a mounted image without syncing it, or freeing an
+ *   in-memory volume) along with the in-memory tables and any
+ *   block maps; the dirty blocks of a block cache are written
+ *   back, as the system does for the pages of a mapping
+ *
+ * no parameters
+ *
+ * no return value
+ */
+
+void tfs_release_volume(){
+  unsigned int fd, k;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_h_15: release_volume() called\n" );
+  }
+
+  if( TFS_V(volume_mounted) ){
+    munmap( TFS_V(storage), MAPPED_SIZE );
+    tfs_release_cache();
+    close( TFS_V(volume_fd) );
+    TFS_V(volume_mounted) = FALSE;
+  }else{
+    free( TFS_V(storage) );
+  }
+  for( fd = 0; TFS_V(block_maps) && ( fd < N_DIRECTORY_ENTRIES ); fd++ ){
+    free( TFS_V(block_maps)[fd].blocks );
+  }
+  free( TFS_V(block_maps) );
+  free( TFS_V(block_prev) );
+  free( TFS_V(block_owner) );
+  free( TFS_V(swap_buffer) );
+  for( k = 0; k < OPEN_FILE_CHUNKS; k++ ){
+    free( TFS_V(open_file_chunks)[k] );
+    TFS_V(open_file_chunks)[k] = NULL;
+  }
+  free( TFS_V(file_opens) );
+  if( TFS_V(file_locks) ){
+    for( fd = 0; fd < N_DIRECTORY_ENTRIES; fd++ ){
+      pthread_rwlock_destroy( &TFS_V(file_locks)[fd].rwlock );
+    }
+    pthread_mutex_destroy( &TFS_V(directory_lock) );
+    pthread_mutex_destroy( &TFS_V(block_map_lock) );
+    free( TFS_V(file_locks) );
+  }
+  free( TFS_V(free_block_bitmap) );
+  free( TFS_V(dirty_block_bitmap) );
+  free( TFS_V(name_hash_head) );
+  free( TFS_V(name_hash_next) );
+
+  TFS_V(storage) = NULL;
+  TFS_V(directory) = NULL;
+  TFS_V(file_allocation_table) = NULL;
+  TFS_V(block_maps) = NULL;
+  TFS_V(block_prev) = NULL;
+  TFS_V(block_owner) = NULL;
+  TFS_V(swap_buffer) = NULL;
+  TFS_V(open_file_slots) = 0;
+  TFS_V(file_locks) = NULL;
+  TFS_V(file_opens) = NULL;
+  TFS_V(free_block_bitmap) = NULL;
+  TFS_V(dirty_block_bitmap) = NULL;
+  TFS_V(name_hash_head) = NULL;
+  TFS_V(name_hash_next) = NULL;
+  TFS_V(free_block_count) = 0;
 }
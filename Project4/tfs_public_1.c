@@ -2,7 +2,7 @@
 
 /* implementation of public functions - instructor supplied
  *
- * nine public functions in this source file
+ * nineteen public functions in this source file
  * - call log message prefix is log_p_i for i-th function
  * - error log message prefix is err_p_i for i-th function
  *     or err_h_i.j for j-th error case within i-th function
@@ -21,11 +21,136 @@
 #define ERROR_LOGGING 0
 
 
+/* the default volume, and the current volume of each thread */
+
+struct tfs_volume tfs_default_volume;
+__thread struct tfs_volume *tfs_volume = &tfs_default_volume;
+
+
+/* tfs_new_volume()
+ *
+ * allocates a new volume, with no storage until it is formatted or
+ *   mounted; the volume is used by selecting it with
+ *   tfs_select_volume() and then calling tfs_init(), tfs_format(),
+ *   or tfs_mount() as for the default volume
+ *
+ * postconditions:
+ *   (1) the new volume is not the current volume of any thread
+ *
+ * no parameters
+ *
+ * return value is the new volume when successful or NULL when
+ *   failure
+ */
+
+struct tfs_volume *tfs_new_volume(){
+  struct tfs_volume *v;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_p_15: new_volume() called\n" );
+  }
+
+  v = calloc( 1, sizeof( struct tfs_volume ) );
+  if( v == NULL ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_p_15: no memory for a volume\n" );
+    }
+    return( NULL );
+  }
+
+  return( v );
+}
+
+
+/* tfs_select_volume()
+ *
+ * makes a volume the current volume of the calling thread, so that
+ *   the calls this thread makes from now on operate on it; other
+ *   threads are not affected
+ *
+ * several threads may select the same volume and work on it at once
+ *   under the locking rules above, while threads working on different
+ *   volumes share nothing
+ *
+ * preconditions:
+ *   (1) (unchecked) the volume came from tfs_new_volume() and has not
+ *         been freed, or is NULL
+ *
+ * postconditions:
+ *   (1) the volume is the current volume of the calling thread, or
+ *         the default volume is when the volume is NULL
+ *
+ * input parameter is a volume, or NULL for the default volume
+ *
+ * return value is the volume that was current before the call
+ */
+
+struct tfs_volume *tfs_select_volume( struct tfs_volume *v ){
+  struct tfs_volume *previous;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_p_16: select_volume() called with: %p\n",
+      (void *) v );
+  }
+
+  previous = tfs_volume;
+  tfs_volume = ( v == NULL ) ? &tfs_default_volume : v;
+
+  return( previous );
+}
+
+
+/* tfs_free_volume()
+ *
+ * releases a volume made by tfs_new_volume(): a mounted image is
+ *   synced and unmounted, and an in-memory volume is discarded; if
+ *   the volume is current in the calling thread, the default volume
+ *   becomes current
+ *
+ * preconditions:
+ *   (1) the volume is not NULL and is not the default volume
+ *   (2) (unchecked) no other thread has the volume selected
+ *
+ * postconditions:
+ *   (1) the storage, tables, and locks of the volume are released,
+ *         and the volume itself is freed
+ *
+ * input parameter is a volume
+ *
+ * no return value
+ */
+
+void tfs_free_volume( struct tfs_volume *v ){
+  struct tfs_volume *previous;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_p_17: free_volume() called with: %p\n",
+      (void *) v );
+  }
+
+  /* precondition check */
+  if( ( v == NULL ) || ( v == &tfs_default_volume ) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_p_17: not a volume from new_volume()\n" );
+    }
+    return;
+  }
+
+  previous = tfs_select_volume( v );
+  if( TFS_V(volume_mounted) ){
+    tfs_sync();
+  }
+  tfs_release_volume();
+  tfs_select_volume( ( previous == v ) ? NULL : previous );
+  free( v );
+}
+
+
 
 /* tfs_init()
  *
- * initializes the directory as empty and the file allocation table
- *   to have all blocks free
+ * formats the default volume: an empty directory and a file
+ *   allocation table with all blocks free
  *
  * no parameters
  *
@@ -33,19 +158,588 @@
  */
 
 void tfs_init(){
-  unsigned int i;
 
   if( CALL_LOGGING ){
     fprintf( stderr, "log_p_1: init() called\n" );
   }
 
-  directory = (struct directory_entry *) storage;
-  blocks = (struct storage_block *) storage;
-  file_allocation_table = (unsigned char *) storage + 2*BLOCK_SIZE;
+  tfs_format( DEFAULT_N_BLOCKS, DEFAULT_BLOCK_SIZE,
+              DEFAULT_N_DIRECTORY_ENTRIES );
+}
+
+
+/* tfs_format()
+ *
+ * allocates zeroed storage for a volume of the given geometry,
+ *   derives the directory and FAT locations, writes the superblock,
+ *   and initializes the free block bitmap and name index; any
+ *   previous volume is discarded (a mounted image is synced and
+ *   unmapped first, and the image file is left as it was)
+ *
+ * the directory starts at block 0 and the FAT starts at the first
+ *   block boundary past the directory; file data blocks start at
+ *   the first block boundary past the FAT
+ *
+ * preconditions:
+ *   (1) the block size is a power of two between MIN_BLOCK_SIZE
+ *         and MAX_BLOCK_SIZE
+ *   (2) there are at least 2 and at most MAX_N_DIRECTORY_ENTRIES
+ *         directory entries
+ *   (3) the directory and FAT leave at least one data block
+ *
+ * postconditions:
+ *   (1) the directory is empty and all data blocks are free
+ *   (2) the sizes and limits in tfs.h describe the new volume
+ *
+ * input parameters are the number of blocks, the block size in
+ *   bytes, and the number of directory entries
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int tfs_format( unsigned int n_blocks,
+                         unsigned int block_size,
+                         unsigned int n_directory_entries ){
+  struct tfs_geometry g;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_p_10: format() called with: %u, %u, and %u\n",
+      n_blocks, block_size, n_directory_entries );
+  }
+
+  /* precondition checks */
+  if( !tfs_set_geometry( &g, n_blocks, block_size, n_directory_entries ) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_p_10: invalid geometry\n" );
+    }
+    return( FALSE );
+  }
+
+  /* a mounted image is synced before it is let go */
+  if( TFS_V(volume_mounted) ){
+    tfs_sync();
+  }
+  tfs_release_volume();
+
+  TFS_V(geometry) = g;
+
+  /* calloc() hands back zeroed pages, which is an empty volume */
+  TFS_V(storage) = calloc( STORAGE_SIZE, 1 );
+  assert( TFS_V(storage) );
+  memcpy( TFS_V(storage), &TFS_V(geometry), sizeof( TFS_V(geometry) ) );
+
+  tfs_build_tables();
+
+  return( TRUE );
+}
+
+
+/* tfs_mount()
+ *
+ * maps a volume image file and makes it the storage for the file
+ *   system, so files persist across runs; only the superblock is
+ *   read up front, and the rest of the image is paged in on use
+ *
+ * if the file is empty or does not exist, it is created with the
+ *   geometry of the current volume and the current volume (its
+ *   directory, FAT, and data blocks in use) is written into it;
+ *   this is how an image is first made:
+ *
+ *     tfs_format( ... );  tfs_mount( "volume.img" );
+ *
+ * the image does not record which files were open, so every file
+ *   starts out closed
+ *
+ * when a block cache capacity has been set with tfs_set_cache(), only
+ *   the directory and FAT are mapped, and data blocks are read and
+ *   written through a block cache of that many frames
+ *
+ * preconditions:
+ *   (1) the file can be opened for reading and writing
+ *   (2) a non-empty file starts with a valid superblock and is
+ *         large enough for the geometry it records
+ *   (3) for an empty file, a volume has been formatted or mounted
+ *
+ * postconditions:
+ *   (1) the previous volume is released (and synced if it was a
+ *         mounted image)
+ *   (2) the mapped image is the storage, and the sizes and limits
+ *         in tfs.h describe it
+ *
+ * input parameter is the path of the volume image file
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int tfs_mount( char *path ){
+  struct tfs_geometry g, check;
+  struct stat st;
+  unsigned long long size, map_size, b;
+  unsigned int new_image, ok;
+  int image_fd;
+  char *image, *buffer;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_p_11: mount() called with: %s\n", path );
+  }
+
+  /* precondition checks */
+  if( ( image_fd = open( path, O_RDWR | O_CREAT, 0644 ) ) < 0 ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_p_11.1: unable to open image: %s\n", path );
+    }
+    return( FALSE );
+  }
+  if( fstat( image_fd, &st ) != 0 ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_p_11.2: unable to stat image: %s\n", path );
+    }
+    close( image_fd );
+    return( FALSE );
+  }
+
+  new_image = ( st.st_size == 0 );
+  if( new_image ){
+    if( TFS_V(storage) == NULL ){
+      if( ERROR_LOGGING ){
+        fprintf( stderr, "err_p_11.3: no volume to write to new image\n" );
+      }
+      close( image_fd );
+      return( FALSE );
+    }
+    g = TFS_V(geometry);
+    size = STORAGE_SIZE;
+    if( ftruncate( image_fd, size ) != 0 ){
+      if( ERROR_LOGGING ){
+        fprintf( stderr, "err_p_11.4: unable to size image: %s\n", path );
+      }
+      close( image_fd );
+      return( FALSE );
+    }
+  }else{
+    if( ( pread( image_fd, &g, sizeof( g ), 0 ) != sizeof( g ) ) ||
+        ( g.magic != TFS_MAGIC ) ||
+        !tfs_set_geometry( &check, g.n_blocks, g.block_size,
+                           g.n_directory_entries ) ||
+        ( check.fat_block != g.fat_block ) ||
+        ( check.first_valid_block != g.first_valid_block ) ){
+      if( ERROR_LOGGING ){
+        fprintf( stderr, "err_p_11.5: not a volume image: %s\n", path );
+      }
+      close( image_fd );
+      return( FALSE );
+    }
+    g = check;
+    size = (unsigned long long) g.n_blocks << g.block_shift;
+    if( (unsigned long long) st.st_size < size ){
+      if( ERROR_LOGGING ){
+        fprintf( stderr, "err_p_11.6: image is truncated: %s\n", path );
+      }
+      close( image_fd );
+      return( FALSE );
+    }
+  }
+
+  /* with a block cache, only the directory and FAT are mapped */
+  map_size = ( TFS_V(cache_capacity) != 0 ) ?
+             (unsigned long long) g.first_valid_block << g.block_shift :
+             size;
+  image = mmap( NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                image_fd, 0 );
+  if( image == MAP_FAILED ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_p_11.7: unable to map image: %s\n", path );
+    }
+    close( image_fd );
+    return( FALSE );
+  }
+
+  /* a new image gets the directory, FAT, and blocks in use, which are
+   *   read through the helpers since the current volume may have a
+   *   block cache of its own
+   */
+  if( new_image ){
+    memcpy( image, TFS_V(storage), (unsigned long long) FIRST_VALID_BLOCK <<
+                                   BLOCK_SIZE_AS_POWER_OF_2 );
+    buffer = malloc( BLOCK_SIZE );
+    assert( buffer );
+    ok = TRUE;
+    for( b = FIRST_VALID_BLOCK; ok && ( b < N_BLOCKS ); b++ ){
+      if( TFS_V(file_allocation_table)[b] == FREE ) continue;
+      if( map_size == size ){
+        tfs_block_read( b, image + ( b << BLOCK_SIZE_AS_POWER_OF_2 ) );
+      }else{
+        tfs_block_read( b, buffer );
+        ok = ( pwrite( image_fd, buffer, BLOCK_SIZE,
+                       (off_t) b << BLOCK_SIZE_AS_POWER_OF_2 ) ==
+               (ssize_t) BLOCK_SIZE );
+      }
+    }
+    free( buffer );
+    if( !ok ){
+      if( ERROR_LOGGING ){
+        fprintf( stderr, "err_p_11.8: unable to write image: %s\n", path );
+      }
+      munmap( image, map_size );
+      close( image_fd );
+      return( FALSE );
+    }
+  }
+
+  if( TFS_V(volume_mounted) ){
+    tfs_sync();
+  }
+  tfs_release_volume();
+
+  TFS_V(geometry) = g;
+  TFS_V(storage) = image;
+  TFS_V(volume_mounted) = TRUE;
+  TFS_V(volume_fd) = image_fd;
+
+  tfs_build_tables();
+  if( map_size != size ){
+    tfs_build_cache();
+  }
+
+  /* data blocks copied into a mapped new image are still to be synced;
+   *   with a block cache they were written already
+   */
+  for( b = FIRST_VALID_BLOCK;
+       new_image && !TFS_V(cache_data) && ( b < N_BLOCKS ); b++ ){
+    if( TFS_V(file_allocation_table)[b] != FREE ){
+      tfs_mark_dirty( b, 1 );
+    }
+  }
+
+  return( TRUE );
+}
+
+
+/* tfs_sync()
+ *
+ * writes a mounted volume image back to its file: the directory
+ *   and FAT blocks always, and data blocks only if they have been
+ *   written since the last sync; neighboring dirty blocks are
+ *   merged into one page-aligned range per msync() call
+ *
+ * with a block cache, the dirty cached blocks are written back to
+ *   the image instead, and the file is then flushed to disk
+ *
+ * preconditions:
+ *   (1) a volume image is mounted
+ *
+ * postconditions:
+ *   (1) the directory, FAT, and dirty blocks are on disk
+ *   (2) no blocks are marked dirty
+ *
+ * no parameters
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int tfs_sync(){
+  unsigned long long page, w, bits, b, start, end, run_start, run_end;
+  unsigned int ok = TRUE;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_p_12: sync() called\n" );
+  }
+
+  /* precondition check */
+  if( !TFS_V(volume_mounted) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_p_12.1: no volume image mounted\n" );
+    }
+    return( FALSE );
+  }
+
+  if( TFS_V(cache_data) != NULL ){
+    ok = tfs_cache_flush();
+    if( msync( TFS_V(storage), MAPPED_SIZE, MS_SYNC ) ||
+        fdatasync( TFS_V(volume_fd) ) ){
+      ok = FALSE;
+    }
+    if( !ok && ERROR_LOGGING ){
+      fprintf( stderr, "err_p_12.3: write-back failed\n" );
+    }
+    return( ok );
+  }
+
+  page = sysconf( _SC_PAGESIZE );
+
+  /* the first run is the directory and FAT */
+  run_start = 0;
+  run_end = ( ( (unsigned long long) FIRST_VALID_BLOCK <<
+                BLOCK_SIZE_AS_POWER_OF_2 ) + page - 1 ) & ~( page - 1 );
+
+  for( w = 0; w < BITMAP_WORDS; w++ ){
+    bits = __atomic_exchange_n( &TFS_V(dirty_block_bitmap)[w], 0,
+                                __ATOMIC_ACQ_REL );
+    while( bits != 0 ){
+      b = w*64 + __builtin_ctzll( bits );
+      bits &= bits - 1;
+      start = ( b << BLOCK_SIZE_AS_POWER_OF_2 ) & ~( page - 1 );
+      end = ( ( ( b + 1 ) << BLOCK_SIZE_AS_POWER_OF_2 ) + page - 1 ) &
+            ~( page - 1 );
+      if( start <= run_end ){
+        if( end > run_end ) run_end = end;
+      }else{
+        if( msync( TFS_V(storage) + run_start, run_end - run_start, MS_SYNC ) ){
+          ok = FALSE;
+        }
+        run_start = start;
+        run_end = end;
+      }
+    }
+  }
+  if( msync( TFS_V(storage) + run_start, run_end - run_start, MS_SYNC ) ){
+    ok = FALSE;
+  }
+
+  if( !ok && ERROR_LOGGING ){
+    fprintf( stderr, "err_p_12.2: msync failed\n" );
+  }
+  return( ok );
+}
+
+
+/* tfs_unmount()
+ *
+ * syncs a mounted volume image and releases its mapping; a volume
+ *   must be formatted or mounted again before further use
+ *
+ * preconditions:
+ *   (1) a volume image is mounted
+ *
+ * postconditions:
+ *   (1) the image file holds the final state of the volume
+ *   (2) there is no current volume
+ *
+ * no parameters
+ *
+ * return value is TRUE when successful or FALSE when failure
+ *   (the mapping is released even if the sync failed)
+ */
+
+unsigned int tfs_unmount(){
+  unsigned int ok;
 
-  for( i = 0; i < STORAGE_SIZE; i++ ){
-    storage[i] = 0;
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_p_13: unmount() called\n" );
   }
+
+  /* precondition check */
+  if( !TFS_V(volume_mounted) ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_p_13: no volume image mounted\n" );
+    }
+    return( FALSE );
+  }
+
+  ok = tfs_sync();
+  tfs_release_volume();
+
+  return( ok );
+}
+
+
+/* tfs_defrag()
+ *
+ * does a bounded amount of defragmenting and returns, so it can be
+ *   called between requests; repeated calls pack the files, in file
+ *   descriptor order, into contiguous ascending runs of blocks from
+ *   FIRST_VALID_BLOCK up, leaving the free blocks at the end
+ *
+ * each step puts the next block of the file being packed at the
+ *   next packed position, swapping it with whatever block is there
+ *   using tfs_exchange_blocks(), which also fixes the first, current,
+ *   and last blocks of the files involved, so open files keep
+ *   reading and writing at the same byte offsets
+ *
+ * files may be written, created, and deleted between calls; when
+ *   blocks have been freed since the last call, the pass is started
+ *   again from the first file (blocks already in place cost a step
+ *   each but are not moved)
+ *
+ * the directory lock is held for the whole call, and each step
+ *   holds the file locks of the file being packed and of the owner
+ *   of the target block exclusively; a free target is claimed before
+ *   it is moved into, and a target that is being allocated by another
+ *   thread at that moment is simply tried again on the next step;
+ *   the two file locks may be taken in either order, which is safe
+ *   only because every holder of more than one file lock also holds
+ *   the directory lock
+ *
+ * preconditions:
+ *   (1) the budget is non-zero
+ *
+ * postconditions:
+ *   (1) at most budget blocks have been examined, and each of them
+ *         moved at most once
+ *   (2) every file reads the same bytes as before
+ *
+ * input parameter is the budget, the number of blocks to examine
+ *   in this call
+ *
+ * return value is TRUE when a complete pass over the files found
+ *   nothing to move (the volume is packed), or FALSE when there is
+ *   more work to do or the budget is zero
+ */
+
+unsigned int tfs_defrag( unsigned int budget ){
+  unsigned int fd, target, b, owner, done;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_p_14: defrag() called with: %d\n", budget );
+  }
+
+  /* precondition check */
+  if( budget == 0 ){
+    if( ERROR_LOGGING ){
+      fprintf( stderr, "err_p_14: zero budget\n" );
+    }
+    return( FALSE );
+  }
+
+  pthread_mutex_lock( &TFS_V(directory_lock) );
+
+  /* start a new pass; blocks freed since the last call may have
+   *   opened holes below the packed prefix that later files can
+   *   grow into, so a freed block restarts the pass from the top
+   */
+  if( ( TFS_V(defrag_fd) == 0 ) ||
+      ( TFS_V(defrag_generation) !=
+        __atomic_load_n( &TFS_V(fat_generation), __ATOMIC_RELAXED ) ) ){
+    TFS_V(defrag_fd) = FIRST_VALID_FD;
+    TFS_V(defrag_file_start) = FIRST_VALID_BLOCK;
+    TFS_V(defrag_index) = 0;
+    TFS_V(defrag_moved) = 0;
+    TFS_V(defrag_generation) = __atomic_load_n( &TFS_V(fat_generation),
+                                                __ATOMIC_RELAXED );
+  }
+  while( budget > 0 ){
+    fd = TFS_V(defrag_fd);
+    if( fd >= N_DIRECTORY_ENTRIES ){
+      done = ( TFS_V(defrag_moved) == 0 );
+      TFS_V(defrag_fd) = 0;
+      pthread_mutex_unlock( &TFS_V(directory_lock) );
+      return( done );
+    }
+    budget--;
+
+    /* unused entries cannot change while the directory lock is held */
+    if( TFS_V(directory)[fd].status == UNUSED ){
+      TFS_V(defrag_fd)++;
+      continue;
+    }
+    pthread_rwlock_wrlock( &TFS_V(file_locks)[fd].rwlock );
+
+    /* next block of the file: its first block, or the one after the
+     *   last block put in place
+     */
+    target = TFS_V(defrag_file_start) + TFS_V(defrag_index);
+    if( TFS_V(defrag_index) == 0 ){
+      b = TFS_V(directory)[fd].first_block;
+    }else{
+      b = TFS_V(file_allocation_table)[target - 1];
+    }
+
+    if( ( b == FREE ) || ( b == LAST_BLOCK ) ){
+      /* end of this file; the next one is packed right after it */
+      TFS_V(defrag_fd)++;
+      TFS_V(defrag_file_start) = target;
+      TFS_V(defrag_index) = 0;
+    }else if( b == target ){
+      TFS_V(defrag_index)++;
+    }else if( tfs_claim_run( target, 1 ) ){
+      /* the target was free, and is now held for the move */
+      tfs_exchange_blocks( b, target );
+      TFS_V(defrag_moved)++;
+      TFS_V(defrag_index)++;
+    }else{
+      /* the target is in use; lock its owner unless it is this file,
+       *   and check the owner again now that it cannot change
+       */
+      owner = __atomic_load_n( &TFS_V(block_owner)[target], __ATOMIC_RELAXED );
+      if( ( owner != 0 ) && ( owner != fd ) ){
+        pthread_rwlock_wrlock( &TFS_V(file_locks)[owner].rwlock );
+        if( __atomic_load_n( &TFS_V(block_owner)[target], __ATOMIC_RELAXED ) ==
+            owner ){
+          tfs_exchange_blocks( b, target );
+          TFS_V(defrag_moved)++;
+          TFS_V(defrag_index)++;
+        }
+        pthread_rwlock_unlock( &TFS_V(file_locks)[owner].rwlock );
+      }else if( owner == fd ){
+        tfs_exchange_blocks( b, target );
+        TFS_V(defrag_moved)++;
+        TFS_V(defrag_index)++;
+      }
+    }
+    pthread_rwlock_unlock( &TFS_V(file_locks)[fd].rwlock );
+  }
+
+  pthread_mutex_unlock( &TFS_V(directory_lock) );
+  return( FALSE );
+}
+
+
+/* tfs_set_cache()
+ *
+ * sets the number of block cache frames used for volume images
+ *   mounted on the current volume from now on; 0 means no cache, with
+ *   the whole image mapped and cached by the system
+ *
+ * postconditions:
+ *   (1) the next tfs_mount() uses the new capacity; an image that is
+ *         mounted now keeps its cache as it is
+ *
+ * input parameter is the capacity, in blocks
+ *
+ * return value is the previous capacity
+ */
+
+unsigned int tfs_set_cache( unsigned int capacity ){
+  unsigned int previous;
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_p_18: set_cache() called with: %d\n", capacity );
+  }
+
+  previous = TFS_V(cache_capacity);
+  TFS_V(cache_capacity) = capacity;
+
+  return( previous );
+}
+
+
+/* tfs_list_cache()
+ *
+ * list the size and the counters of the block cache of the mounted
+ *   image
+ *
+ * no parameters
+ *
+ * no return value
+ */
+
+void tfs_list_cache(){
+
+  if( CALL_LOGGING ){
+    fprintf( stderr, "log_p_19: list_cache() called\n" );
+  }
+
+  printf( "-- block cache --\n" );
+  if( TFS_V(cache_data) == NULL ){
+    printf( "  no block cache in use\n" );
+  }else{
+    pthread_mutex_lock( &TFS_V(cache_lock) );
+    printf( "  %u frames of %u bytes\n", TFS_V(cache_frames), BLOCK_SIZE );
+    printf( "  %llu hits, %llu misses, %llu write-backs\n",
+      TFS_V(cache_hits), TFS_V(cache_misses), TFS_V(cache_writebacks) );
+    pthread_mutex_unlock( &TFS_V(cache_lock) );
+  }
+  printf( "-- end --\n" );
 }
 
 
@@ -69,9 +763,9 @@ void tfs_list_blocks(){
   printf( "-- file alllocation table listing of used blocks --\n" );
 
   for( b = FIRST_VALID_BLOCK; b < N_BLOCKS; b++ ){
-    if( file_allocation_table[b] != FREE ){
-      printf( "  block %3d is used and points to %3d\n",
-        b, file_allocation_table[b] );
+    if( TFS_V(file_allocation_table)[b] != FREE ){
+      printf( "  block %3u is used and points to %3u\n",
+        b, TFS_V(file_allocation_table)[b] );
     }
   }
   printf( "-- end --\n" );
@@ -82,6 +776,10 @@ void tfs_list_blocks(){
  *
  * list all directory entries
  *
+ * the directory lock is held throughout, and each file is listed
+ *   under its file lock, so that it is not seen halfway through a
+ *   write
+ *
  * no parameters
  *
  * no return value
@@ -89,57 +787,63 @@ void tfs_list_blocks(){
 
 void tfs_list_directory(){
   unsigned int fd, more_to_print, fd2;
-  unsigned char b;
+  unsigned int b;
 
   if( CALL_LOGGING ){
     fprintf( stderr, "log_p_3: list_directory() called\n" );
   }
 
+  pthread_mutex_lock( &TFS_V(directory_lock) );
   printf( "-- directory listing --\n" );
 
   for( fd = FIRST_VALID_FD; fd < N_DIRECTORY_ENTRIES; fd++ ){
     printf( "  fd = %2d: ", fd );
-    if( directory[fd].status == UNUSED ){
+    if( TFS_V(directory)[fd].status == UNUSED ){
       more_to_print = 0;
       for( fd2 = fd; fd2 < N_DIRECTORY_ENTRIES; fd2++ ){
-        if( directory[fd2].status != UNUSED ) more_to_print = 1;
+        if( TFS_V(directory)[fd2].status != UNUSED ) more_to_print = 1;
       }
       if( more_to_print || ( fd == LAST_VALID_FD ) ){
         printf( "unused\n" );
       }else{
         printf( "this entry and the following entries are unused\n" );
         printf( "-- end --\n" );
+        pthread_mutex_unlock( &TFS_V(directory_lock) );
         return;
       }
-    }else if( directory[fd].status == CLOSED ){
-      printf( "%s, currently closed, %d bytes in size\n",
-        directory[fd].name, directory[fd].size );
-    }else if( directory[fd].status == OPEN ){
-      printf( "%s, currently open, %d bytes in size\n",
-        directory[fd].name, directory[fd].size );
+      continue;
+    }
+
+    pthread_rwlock_rdlock( &TFS_V(file_locks)[fd].rwlock );
+    if( TFS_V(directory)[fd].status == IN_USE ){
+      printf( "%s, currently %s, %llu bytes in size\n",
+        TFS_V(directory)[fd].name,
+        ( TFS_V(file_opens)[fd].count > 0 ) ? "open" : "closed",
+        TFS_V(directory)[fd].size );
     }else{
       if( ERROR_LOGGING ){
         fprintf( stderr, "err_p_3: invalid file status for fd %d: %d\n",
-          fd, directory[fd].status );
+          fd, TFS_V(directory)[fd].status );
       }
     }
 
-    if( ( directory[fd].status == CLOSED ) ||
-        ( directory[fd].status == OPEN ) ){
+    if( TFS_V(directory)[fd].status == IN_USE ){
       printf( "           FAT:" );
-      if( directory[fd].first_block == 0 ){
+      if( TFS_V(directory)[fd].first_block == 0 ){
         printf( " no blocks in use\n" );
       }else{
-        b = directory[fd].first_block;
+        b = TFS_V(directory)[fd].first_block;
         while( b != LAST_BLOCK ){
-          printf( " %d", b );
-          b = file_allocation_table[b];
+          printf( " %u", b );
+          b = TFS_V(file_allocation_table)[b];
         }
         printf( "\n" );
       }
     }
+    pthread_rwlock_unlock( &TFS_V(file_locks)[fd].rwlock );
   }
   printf( "-- end --\n" );
+  pthread_mutex_unlock( &TFS_V(directory_lock) );
 }
 
 
@@ -173,12 +877,15 @@ unsigned int tfs_exists( char *name ){
     }
     return( FALSE );
   }
+  pthread_mutex_lock( &TFS_V(directory_lock) );
   if( tfs_map_name_to_fd( name ) == 0 ){
     if( ERROR_LOGGING ){
       fprintf( stderr, "err_p_4.2: unable to map file name: %s\n", name );
     }
+    pthread_mutex_unlock( &TFS_V(directory_lock) );
     return( FALSE );
   }
+  pthread_mutex_unlock( &TFS_V(directory_lock) );
 
   return( TRUE );
 }
@@ -187,9 +894,9 @@ unsigned int tfs_exists( char *name ){
 /* tfs_create()
  *
  * create a new directory entry with the given file name and
- *   set the status to open, the first block to invalid, the
- *   size to 0, the byte offset to 0, and the current block
- *   to invalid
+ *   set the status to in use, the first block to invalid, and
+ *   the size to 0, then open it with the byte offset at 0 and
+ *   the current block invalid
  *
  * preconditions:
  *   (1) the name is valid
@@ -200,11 +907,13 @@ unsigned int tfs_exists( char *name ){
  * postconditions:
  *   (1) a new directory entry overwrites an unused entry
  *   (2) the new entry is appropriately initialized
+ *   (3) the file is open, with the open file table slot paired
+ *         with the new entry
  *
  * input parameter is file name
  *
- * return value is the file descriptor of a directory entry
- *   when successful or 0 when failure
+ * return value is the file descriptor, which is the directory
+ *   index of the new file, when successful or 0 when failure
  */
 
 unsigned int tfs_create( char *name ){
@@ -221,26 +930,41 @@ unsigned int tfs_create( char *name ){
     }
     return( 0 );
   }
+  pthread_mutex_lock( &TFS_V(directory_lock) );
   if( tfs_map_name_to_fd( name ) != 0 ){
     if( ERROR_LOGGING ){
       fprintf( stderr, "err_p_5.2: attempt to create existing file: %s\n",
         name );
     }
+    pthread_mutex_unlock( &TFS_V(directory_lock) );
     return( 0 );
   }
   if( ( file_descriptor = tfs_new_directory_entry() ) == 0 ){
     if( ERROR_LOGGING ){
       fprintf( stderr, "err_p_5.3: directory entry not available\n" );
     }
+    pthread_mutex_unlock( &TFS_V(directory_lock) );
     return( 0 );
   }
 
-  directory[file_descriptor].status = OPEN;
-  directory[file_descriptor].first_block = 0;
-  directory[file_descriptor].size = 0;
-  directory[file_descriptor].byte_offset = 0;
-  directory[file_descriptor].current_block = 0;
-  strcpy( directory[file_descriptor].name, name );
+  /* the entry is filled in under its file lock, since tfs_size()
+   *   may look at it by directory index without the directory lock
+   */
+  pthread_rwlock_wrlock( &TFS_V(file_locks)[file_descriptor].rwlock );
+  TFS_V(directory)[file_descriptor].status = IN_USE;
+  TFS_V(directory)[file_descriptor].first_block = 0;
+  TFS_V(directory)[file_descriptor].size = 0;
+  TFS_V(directory)[file_descriptor].last_block = 0;
+  /* zero-padded past the end of the name, as tfs_name_key() packs it */
+  memset( TFS_V(directory)[file_descriptor].name, 0, FILENAME_LENGTH + 1 );
+  memcpy( TFS_V(directory)[file_descriptor].name, name,
+          strnlen( name, FILENAME_LENGTH ) );
+  pthread_rwlock_unlock( &TFS_V(file_locks)[file_descriptor].rwlock );
+  tfs_name_index_insert( file_descriptor );
+
+  /* a new file has no opens, so this is the paired slot */
+  file_descriptor = tfs_new_open_file( file_descriptor );
+  pthread_mutex_unlock( &TFS_V(directory_lock) );
 
   return( file_descriptor );
 }
@@ -248,28 +972,31 @@ unsigned int tfs_create( char *name ){
 
 /* tfs_open()
  *
- * opens the directory entry having the given file name and
- *   sets the status to open, the byte offset to 0, and the
- *   current block to the first block
+ * opens the directory entry having the given file name, with
+ *   a new entry in the open file table whose byte offset is 0
+ *   and whose current block is the first block; a file may be
+ *   opened again while it is open, and each open has its own
+ *   byte offset
  *
  * preconditions:
  *   (1) the name is valid
  *   (2) the name is associated with an active directory entry
- *   (3) the directory entry is not already open
+ *   (3) an open file table slot can be found or added
  *
  * postconditions:
- *   (1) the status of the directory entry is set to open
- *   (2) the byte offset of the directory entry is set to 0
- *   (3) the current block is set to the first block
+ *   (1) the open count of the file is incremented
+ *   (2) the byte offset of the new open is set to 0
+ *   (3) the current block of the new open is set to the first block
  *
  * input parameter is file name
  *
- * return value is the file descriptor of a directory entry
- *   when successful or 0 when failure
+ * return value is the file descriptor, which is the directory
+ *   index of the file unless the file was already open, when
+ *   successful or 0 when failure
  */
 
 unsigned int tfs_open( char *name ){
-  unsigned int file_descriptor;
+  unsigned int file_descriptor, fd;
 
   if( CALL_LOGGING ){
     fprintf( stderr, "log_p_6: open() called with: %s\n", name );
@@ -282,24 +1009,23 @@ unsigned int tfs_open( char *name ){
     }
     return( 0 );
   }
-  if( ( file_descriptor = tfs_map_name_to_fd( name ) ) == 0 ){
+  pthread_mutex_lock( &TFS_V(directory_lock) );
+  if( ( fd = tfs_map_name_to_fd( name ) ) == 0 ){
     if( ERROR_LOGGING ){
       fprintf( stderr, "err_p_6.2: unable to map file name: %s\n", name );
     }
+    pthread_mutex_unlock( &TFS_V(directory_lock) );
     return( 0 );
   }
-  if( tfs_is_fd_open( file_descriptor ) ){
+  if( ( file_descriptor = tfs_new_open_file( fd ) ) == 0 ){
     if( ERROR_LOGGING ){
-      fprintf( stderr, "err_p_6.3: attempt to open an open file: %d\n",
-        file_descriptor );
+      fprintf( stderr, "err_p_6.3: no open file table slot for: %d\n",
+        fd );
     }
+    pthread_mutex_unlock( &TFS_V(directory_lock) );
     return( 0 );
   }
-
-  directory[file_descriptor].status = OPEN;
-  directory[file_descriptor].byte_offset = 0;
-  directory[file_descriptor].current_block =
-    directory[file_descriptor].first_block;
+  pthread_mutex_unlock( &TFS_V(directory_lock) );
 
   return( file_descriptor );
 }
@@ -307,21 +1033,22 @@ unsigned int tfs_open( char *name ){
 
 /* tfs_close()
  *
- * closes the directory entry having the given file descriptor
- *   (sets the status to closed, the byte offset to 0, and the
- *   current block to the first block); the function fails if
+ * closes the open having the given file descriptor (frees its
+ *   open file table slot); the function fails if
  *   (1) the file descriptor is out of range,
- *   (2) the file descriptor is within range but the directory
- *         entry is not open
+ *   (2) the file descriptor is within range but is not open
  *
  * preconditions:
  *   (1) the file descriptor is in range
- *   (2) the directory entry is open
+ *   (2) the file descriptor is open
  *
  * postconditions:
- *   (1) the status of the directory entry is set to closed
- *   (2) the byte offset of the directory entry is set to 0
- *   (3) the current block is set to the first block
+ *   (1) the open file table slot is free
+ *   (2) the open count of the file is decremented, and the
+ *         file may be written through another open if this
+ *         one was its writer
+ *   (3) the block map of the file, if built, is discarded when
+ *         this was the last open of the file
  *
  * input parameter is a file descriptor
  *
@@ -342,18 +1069,18 @@ unsigned int tfs_close( unsigned int file_descriptor ){
     }
     return( FALSE );
   }
+  pthread_mutex_lock( &TFS_V(directory_lock) );
   if( !tfs_is_fd_open( file_descriptor ) ){
     if( ERROR_LOGGING ){
       fprintf( stderr, "err_p_7.2: attempt to close a closed file: %d\n",
         file_descriptor );
     }
+    pthread_mutex_unlock( &TFS_V(directory_lock) );
     return( FALSE );
   }
 
-  directory[file_descriptor].status = CLOSED;
-  directory[file_descriptor].byte_offset = 0;
-  directory[file_descriptor].current_block =
-    directory[file_descriptor].first_block;
+  tfs_release_open_file( file_descriptor );
+  pthread_mutex_unlock( &TFS_V(directory_lock) );
 
   return( TRUE );
 }
@@ -361,7 +1088,8 @@ unsigned int tfs_close( unsigned int file_descriptor ){
 
 /* tfs_size()
  *
- * returns the file size for an active directory entry
+ * returns the file size for an active directory entry, named by
+ *   an open file descriptor or by its directory index
  *
  * preconditions:
  *   (1) the file descriptor is in range
@@ -376,48 +1104,55 @@ unsigned int tfs_close( unsigned int file_descriptor ){
  *   when failure
  */
 
-unsigned int tfs_size( unsigned int file_descriptor ){
+unsigned long long tfs_size( unsigned int file_descriptor ){
+  unsigned long long size;
+  unsigned int fd;
 
   if( CALL_LOGGING ){
     fprintf( stderr, "log_p_8: size() called with: %d\n", file_descriptor );
   }
 
   /* precondition checks */
-  if( !tfs_is_fd_in_range( file_descriptor ) ){
+  if( ( fd = tfs_fd_to_entry( file_descriptor ) ) == 0 ){
     if( ERROR_LOGGING ){
       fprintf( stderr, "err_p_8.1: file descriptor out of range: %d\n",
         file_descriptor );
     }
     return( MAX_FILE_SIZE + 1 );
   }
-  if( directory[file_descriptor].status == UNUSED ){
+  pthread_rwlock_rdlock( &TFS_V(file_locks)[fd].rwlock );
+  if( TFS_V(directory)[fd].status == UNUSED ){
     if( ERROR_LOGGING ){
       fprintf( stderr, "err_p_8.2: file status is unused: %d\n",
         file_descriptor );
     }
+    pthread_rwlock_unlock( &TFS_V(file_locks)[fd].rwlock );
     return( MAX_FILE_SIZE + 1 );
   }
+  size = TFS_V(directory)[fd].size;
+  pthread_rwlock_unlock( &TFS_V(file_locks)[fd].rwlock );
 
-  return( directory[file_descriptor].size );
+  return( size );
 }
 
 
 /* tfs_read()
  *
  * reads a specified number of bytes from a file starting
- *   at the byte offset in the directory into the specified
- *   buffer; the byte offset in the directory entry is
- *   incremented by the number of bytes transferred
+ *   at the byte offset of the open into the specified
+ *   buffer; the byte offset of the open is incremented by
+ *   the number of bytes transferred
  *
  * depending on the starting byte offset and the specified
  *   number of bytes to transfer, the transfer may cross two
  *   or more storage blocks
  *
  * this function does not directly access bytes in storage;
- *   instead, each block is first read into an internal
- *   buffer using the helper function tfs_read_block();
- *   this function then moves bytes from the internal buffer
- *   to the user buffer
+ *   instead, the helper function tfs_read_at() copies the part
+ *   of each block that is needed straight into the user buffer,
+ *   one wide copy per block (or per extent of contiguous blocks)
+ *   and with no intermediate buffer; the byte offset and current
+ *   block of the open are updated once, at the end
  *
  * the function will read fewer bytes than specified if the
  *   end of the file is encountered before the specified number
@@ -425,7 +1160,7 @@ unsigned int tfs_size( unsigned int file_descriptor ){
  *
  * preconditions:
  *   (1) the file descriptor is in range
- *   (2) the directory entry is open
+ *   (2) the file descriptor is open
  *   (3) the requested byte count is non-zero
  *   (4) the file has allocated storage blocks and is
  *         non-empty
@@ -462,11 +1197,10 @@ unsigned int tfs_read( unsigned int file_descriptor,
                        char *user_buffer,
                        unsigned int byte_count ){
 
-  unsigned int actual_count,   /* index into user buffer     */
-               internal_index, /* index into internal buffer */
-               current_block;
-
-  char internal_buffer[BLOCK_SIZE];
+  unsigned int actual_count,   /* bytes transferred */
+               current_block,
+               fd;            /* directory index of the file */
+  struct open_file *open_file;   /* the open being read through */
 
   if( CALL_LOGGING ){
     fprintf( stderr, "log_p_9: read() called with: %d, %p, and %d\n",
@@ -494,94 +1228,56 @@ unsigned int tfs_read( unsigned int file_descriptor,
     }
     return( 0 );
   }
-  if( directory[file_descriptor].first_block == 0 ){
+  open_file = tfs_open_file( file_descriptor );
+  fd = open_file->fd;
+
+  /* other opens of the file may read at the same time, but not write */
+  pthread_rwlock_rdlock( &TFS_V(file_locks)[fd].rwlock );
+  if( TFS_V(directory)[fd].first_block == 0 ){
     if( ERROR_LOGGING ){
       fprintf( stderr, "err_p_9.4: attempt to read empty file: %d\n",
         file_descriptor );
     }
+    pthread_rwlock_unlock( &TFS_V(file_locks)[fd].rwlock );
     return( 0 );
   }
-  if( directory[file_descriptor].size == 0 ){
+  if( TFS_V(directory)[fd].size == 0 ){
     if( ERROR_LOGGING ){
       fprintf( stderr, "err_p_9.5: attempt to read empty file: %d\n",
         file_descriptor );
     }
+    pthread_rwlock_unlock( &TFS_V(file_locks)[fd].rwlock );
     return( 0 );
   }
-  if( directory[file_descriptor].byte_offset >=
-        directory[file_descriptor].size         ){
+  if( open_file->byte_offset >= TFS_V(directory)[fd].size ){
     if( ERROR_LOGGING ){
       fprintf( stderr, "err_p_9.6: attempt to read past end of file: %d\n",
         file_descriptor );
     }
+    pthread_rwlock_unlock( &TFS_V(file_locks)[fd].rwlock );
     return( 0 );
   }
 
-  /* obtain the initial storage block from which to read */
-  current_block = directory[file_descriptor].current_block;
-  if( !tfs_block_read( current_block, internal_buffer ) ){
+  /* check the initial storage block from which to read (looked up
+   *   again if another open has written past a cursor that had none)
+   */
+  current_block = tfs_cursor_block( file_descriptor );
+  if( !tfs_is_block_in_range( current_block ) ){
     if( ERROR_LOGGING ){
       fprintf( stderr, "err_p_9.7: fail to read block: %d\n",
         current_block );
     }
+    pthread_rwlock_unlock( &TFS_V(file_locks)[fd].rwlock );
     return( 0 );
   }
 
-  /* initialize each buffer index value
-   * - note that the internal buffer index starts
-   *     where the most recent open, read, write,
-   *     or seek for this file set the byte offset;
-   *     this may be in the middle of a storage block
-   */
-  actual_count = 0;
-  internal_index = directory[file_descriptor].byte_offset % BLOCK_SIZE;
-
-  /* loop to transfer bytes from internal buffer to user buffer
-   *
-   * updates on each iteration:
-   *   (1) read new block if needed
-   *   (2) transfer a byte
-   *   (3) increment actual count
-   *   (4) increment internal index
-   *   (5) increment file byte offset
-   *
-   * stopping conditions:
-   *   (1) actual count == byte count
-   *   (2) byte_offset  == file size
-   *
-   * ending edge case:
-   *   internal index off edge of internal block
-   */
+  /* transfer from the byte offset of the open */
+  actual_count = tfs_read_at( fd, open_file->byte_offset, current_block,
+                              user_buffer, byte_count, &current_block );
 
-  while( ( actual_count < byte_count )                &&
-         ( directory[file_descriptor].byte_offset <
-           directory[file_descriptor].size          )    ){
-
-    /* span blocks - need the next storage block from which to read */
-    if( internal_index >= BLOCK_SIZE ){
-      /* set next block as new current block and read it*/
-      current_block = file_allocation_table[current_block];
-      directory[file_descriptor].current_block = current_block;
-      if( !tfs_block_read( current_block, internal_buffer ) ){
-        if( ERROR_LOGGING ){
-          fprintf( stderr, "err_p_9.8: fail to read block: %d\n",
-            current_block );
-        }
-        return( actual_count );
-      }
-      internal_index = 0;
-    }
-
-    user_buffer[actual_count++] = internal_buffer[internal_index++];
-    directory[file_descriptor].byte_offset++;
-  }
-
-  if( internal_index >= BLOCK_SIZE ){
-    /* set next block as new current block to prepare    */
-    /*   for next read or write with no intervening seek */
-    current_block = file_allocation_table[current_block];
-    directory[file_descriptor].current_block = current_block;
-  }
+  open_file->byte_offset += actual_count;
+  open_file->current_block = current_block;
+  pthread_rwlock_unlock( &TFS_V(file_locks)[fd].rwlock );
 
   return( actual_count );
 }
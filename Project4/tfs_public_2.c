@@ -13,22 +13,27 @@
 
 /* implementation of assigned functions - skeleton for students */
 
+// Write helpers, they live down with tfs_write() but tfs_pwrite() needs them too
+unsigned int claim_the_writer(unsigned int fd, unsigned int file_descriptor);
+unsigned int write_at_offset(unsigned int fd, unsigned long long offset, unsigned int current_block,
+                             char *buffer, unsigned int byte_count, unsigned int *end_block);
+
 
 /* tfs_seek()
  *
- * sets the byte offset in a directory entry
+ * sets the byte offset of an open of a file
  *
  * preconditions:
  *   (1) the file descriptor is in range
- *   (2) the directory entry is open
+ *   (2) the file descriptor is open
  *   (3) the specified offset is less than or equal to the
  *         file size (equal would occur in the case of
  *         writing a new record at the end of a file)
  *
  * postconditions:
- *   (1) the byte offset of the directory entry is set to the
+ *   (1) the byte offset of the open is set to the
  *         specified offset
- *   (2) the current block of the directory entry is set to the
+ *   (2) the current block of the open is set to the
  *         corresponding block (in the case of the offset being
  *         equal to the file size and just beyond the end of
  *         the last block of the file, the current block will
@@ -38,31 +43,115 @@
  *
  */
 
-unsigned int tfs_seek(unsigned int file_descriptor, unsigned int offset) {
-    unsigned int seek_block;
+unsigned int tfs_seek(unsigned int file_descriptor, unsigned long long offset) {
+    unsigned int seek_block, fd;
     // Checks for range validity, particularly for offset, cannot be greater than the file size
     if (!tfs_is_fd_in_range(file_descriptor)) { return FALSE; }
     if (!tfs_is_fd_open(file_descriptor)) { return FALSE; }
-    if (offset > directory[file_descriptor].size) { return FALSE; }
-
-    // Find the block that the offset is in
-    directory[file_descriptor].byte_offset = offset;
-    for (seek_block = directory[file_descriptor].first_block; offset >= BLOCK_SIZE && seek_block != LAST_BLOCK; offset -= BLOCK_SIZE, seek_block = file_allocation_table[seek_block]) {}
-    directory[file_descriptor].current_block = (seek_block == LAST_BLOCK && offset != 0) ? LAST_BLOCK : seek_block;
+    struct open_file *open_file = tfs_open_file(file_descriptor);
+    fd = open_file->fd;
+    // Shared lock, the size and the block map can't change under a seek
+    pthread_rwlock_rdlock(&TFS_V(file_locks)[fd].rwlock);
+    if (offset > TFS_V(directory)[fd].size) { pthread_rwlock_unlock(&TFS_V(file_locks)[fd].rwlock); return FALSE; }
+
+    // Find the block that the offset is in, O(1) through the file's block map
+    open_file->byte_offset = offset;
+    seek_block = tfs_offset_to_block(fd, offset);
+    open_file->current_block = seek_block;
+    pthread_rwlock_unlock(&TFS_V(file_locks)[fd].rwlock);
 
     return TRUE; 
 }
 
 
+/* tfs_pread()
+ *
+ * reads like tfs_read() but starting at the given byte offset
+ *   instead of the byte offset of the open, which is left
+ *   unchanged; the block holding the offset is found in O(1)
+ *   through the block map of the file
+ *
+ * preconditions:
+ *   (1) the file descriptor is in range
+ *   (2) the file descriptor is open
+ *   (3) the offset is less than the file size
+ *
+ * postconditions:
+ *   (1) as for tfs_read(), except that the byte offset and the
+ *         current block of the open are unchanged
+ *
+ * input parameters are a file descriptor, the address of a
+ *   buffer, the count of bytes to transfer, and a byte offset
+ *
+ * return value is the number of bytes transferred
+ */
+
+unsigned int tfs_pread(unsigned int file_descriptor, char *user_buffer, unsigned int byte_count, unsigned long long offset) {
+    if (!tfs_is_fd_in_range(file_descriptor)) { return 0; }
+    if (!tfs_is_fd_open(file_descriptor)) { return 0; }
+    if (byte_count == 0) { return 0; }
+    unsigned int fd = tfs_open_file(file_descriptor)->fd, end_block;
+
+    // Shared lock like tfs_read(), but the open itself is never looked at or moved
+    pthread_rwlock_rdlock(&TFS_V(file_locks)[fd].rwlock);
+    if (offset >= TFS_V(directory)[fd].size) { pthread_rwlock_unlock(&TFS_V(file_locks)[fd].rwlock); return 0; }
+    unsigned int count = tfs_read_at(fd, offset, tfs_offset_to_block(fd, offset), user_buffer, byte_count, &end_block);
+    pthread_rwlock_unlock(&TFS_V(file_locks)[fd].rwlock);
+
+    return count;
+}
+
+
+/* tfs_pwrite()
+ *
+ * writes like tfs_write() but starting at the given byte offset
+ *   instead of the byte offset of the open, which is left
+ *   unchanged; the block holding the offset is found in O(1)
+ *   through the block map of the file
+ *
+ * preconditions:
+ *   (1) the file descriptor is in range
+ *   (2) the file descriptor is open
+ *   (3) the offset is less than or equal to the file size
+ *   (4) no other open of the file is its writer
+ *
+ * postconditions:
+ *   (1) as for tfs_write(), except that the byte offset and the
+ *         current block of the open are unchanged
+ *
+ * input parameters are a file descriptor, the address of a
+ *   buffer, the count of bytes to transfer, and a byte offset
+ *
+ * return value is the number of bytes transferred
+ */
+
+unsigned int tfs_pwrite(unsigned int file_descriptor, char *user_buffer, unsigned int byte_count, unsigned long long offset) {
+    if (!tfs_is_fd_in_range(file_descriptor)) { return 0; }
+    if (!tfs_is_fd_open(file_descriptor)) { return 0; }
+    unsigned int fd = tfs_open_file(file_descriptor)->fd, end_block;
+    if (!claim_the_writer(fd, file_descriptor)) { return 0; }
+
+    // Same transfer as tfs_write(), from the given offset, and the open stays put; a
+    // cursor that sat past the old end gets its block from tfs_cursor_block() later
+    pthread_rwlock_wrlock(&TFS_V(file_locks)[fd].rwlock);
+    if (offset > TFS_V(directory)[fd].size) { pthread_rwlock_unlock(&TFS_V(file_locks)[fd].rwlock); return 0; }
+    unsigned int count = write_at_offset(fd, offset, tfs_offset_to_block(fd, offset), user_buffer, byte_count, &end_block);
+    pthread_rwlock_unlock(&TFS_V(file_locks)[fd].rwlock);
+
+    return count;
+}
+
+
 /* tfs_delete()
  *
  * deletes a closed directory entry having the given file descriptor
  *   (changes the status of the entry to unused) and releases all
- *   allocated storage blocks
+ *   allocated storage blocks; the descriptor may be the directory
+ *   index of the file or its only open, which is closed first
  *
  * preconditions:
  *   (1) the file descriptor is in range
- *   (2) the directory entry is closed
+ *   (2) the file has no opens other than the given descriptor
  *
  * postconditions:
  *   (1) the status of the directory entry is set to unused
@@ -73,31 +162,45 @@ unsigned int tfs_seek(unsigned int file_descriptor, unsigned int offset) {
  *
  */
 void nice_little_file_reset(unsigned int fd) {
-    directory[fd].status = UNUSED;
-    directory[fd].first_block = FREE;
-    directory[fd].size = 0;
-    directory[fd].byte_offset = 0;
-    directory[fd].current_block = FREE;
-    directory[fd].name[0] = '\0';
+    // Drop the name from the index while the name is still there
+    tfs_name_index_remove(fd);
+    tfs_block_map_drop(fd);
+    TFS_V(directory)[fd].status = UNUSED;
+    TFS_V(directory)[fd].first_block = FREE;
+    TFS_V(directory)[fd].size = 0;
+    TFS_V(directory)[fd].last_block = FREE;
+    // Clear the whole name so later fixed-width compares see zeros
+    memset(TFS_V(directory)[fd].name, 0, sizeof(TFS_V(directory)[fd].name));
 }
 
 unsigned int tfs_delete(unsigned int file_descriptor) {
     // Check for range validity AND return if encountering an unused file descriptor
-    if (!tfs_is_fd_in_range(file_descriptor)) { return FALSE; }
-    if (directory[file_descriptor].status == UNUSED) { return FALSE; }
+    unsigned int fd = tfs_fd_to_entry(file_descriptor);
+    if (fd == 0) { return FALSE; }
+    // Directory lock so nobody opens the file while it goes away
+    pthread_mutex_lock(&TFS_V(directory_lock));
+    if (TFS_V(directory)[fd].status == UNUSED) { pthread_mutex_unlock(&TFS_V(directory_lock)); return FALSE; }
+    // Never pull the blocks out from under another open of the file
+    unsigned int own = tfs_is_fd_open(file_descriptor) ? 1 : 0;
+    if (TFS_V(file_opens)[fd].count > own) { pthread_mutex_unlock(&TFS_V(directory_lock)); return FALSE; }
     // Close the file before deleting it
-    if (directory[file_descriptor].status == OPEN) { tfs_close(file_descriptor); }
+    if (own) { tfs_close(file_descriptor); }
+
+    // No opens are left, but tfs_size() by directory index can still look in
+    pthread_rwlock_wrlock(&TFS_V(file_locks)[fd].rwlock);
 
-    unsigned int delete_block = directory[file_descriptor].first_block;
+    unsigned int delete_block = TFS_V(directory)[fd].first_block;
     while (delete_block != LAST_BLOCK && delete_block != FREE) {
-      unsigned int next_block = file_allocation_table[delete_block ];
-      // free up the block
-      file_allocation_table[delete_block] = FREE;  
+      unsigned int next_block = TFS_V(file_allocation_table)[delete_block ];
+      // free up the block (FAT entry and free bitmap)
+      tfs_free_block(delete_block);
       delete_block  = next_block;
     }
 
     // Cute little encapsulating function, having fun with it
-    nice_little_file_reset(file_descriptor);
+    nice_little_file_reset(fd);
+    pthread_rwlock_unlock(&TFS_V(file_locks)[fd].rwlock);
+    pthread_mutex_unlock(&TFS_V(directory_lock));
 
     return TRUE; 
 }
@@ -111,29 +214,35 @@ unsigned int tfs_delete(unsigned int file_descriptor) {
  *     ---- to access the blocks in the storage[] array    ----
  *
  * writes a specified number of bytes from a specified buffer
- *   into a file starting at the byte offset in the directory;
- *   the byte offset in the directory entry is incremented by
- *   the number of bytes transferred
+ *   into a file starting at the byte offset of the open; the
+ *   byte offset of the open is incremented by the number of
+ *   bytes transferred
+ *
+ * only one open of a file may write: the first open to write
+ *   becomes the writer of the file until it is closed, and
+ *   writes through any other open fail until then
+ *
+ * the write holds the file lock exclusively, so reads of the same
+ *   file wait for it, while writes to other files go ahead in
+ *   parallel (blocks come from the lock-free allocator)
  *
  * depending on the starting byte offset and the specified
  *   number of bytes to transfer, the transfer may cross two
  *   or more storage blocks
  *
  * this function does not directly access bytes in storage;
- *   instead, each block is first read into an internal
- *   buffer using the helper function tfs_read_block();
- *   this function then moves bytes from the user buffer
- *   to the internal buffer and then writes each updated
- *   block using the helper function tfs_write_block()
- *
- * the read-modify-write approach is used since a write
- *   may only change part of the content of a block and
- *   the bytes at the unaffected start and or end of a
- *   block must be preserved (a possible optimization is
- *   to omit a read when all bytes of a block will be
- *   overwritten; however, that optimization is not
- *   required, and students should aim for correctness
- *   over eliminating block reads)
+ *   instead, bytes are moved from the user buffer into each
+ *   block using the helper functions tfs_block_write() and
+ *   tfs_block_write_span()
+ *
+ * a write may only change part of the content of a block,
+ *   and the bytes at the unaffected start and or end of a
+ *   block must be preserved; rather than read-modify-write,
+ *   a partial block (including a freshly allocated one) is
+ *   updated with tfs_block_write_span(), which touches only
+ *   the bytes being written, and a fully overwritten block
+ *   is written straight from the user buffer; no block is
+ *   ever read by this function
  *
  * note that this function can extend the file size by
  *   writing bytes beyond the current end of the file;
@@ -160,8 +269,9 @@ unsigned int tfs_delete(unsigned int file_descriptor) {
  *
  * preconditions:
  *   (1) the file descriptor is in range
- *   (2) the directory entry is open
- *   (3) the requested block count is non-zero
+ *   (2) the file descriptor is open
+ *   (3) no other open of the file is its writer
+ *   (4) the requested block count is non-zero
  *
  * postconditions:
  *   (1) the file contains bytes transferred from the user
@@ -186,90 +296,116 @@ unsigned int tfs_delete(unsigned int file_descriptor) {
  */
 
 
-// Helper function to write to the block buffer
+// Helper function to become the writer of a file: one writer per file, the first open
+// to write keeps the job until it closes; claimed with a compare and swap since two
+// opens may race for it
 
-void update_the_offset(unsigned int file_descriptor, unsigned int written, unsigned char current_block) {
-    unsigned int new_offset = directory[file_descriptor].byte_offset + written;
-    if (new_offset > directory[file_descriptor].size) {
-        directory[file_descriptor].size = new_offset;
-    }
-    directory[file_descriptor].byte_offset = new_offset;
-    directory[file_descriptor].current_block = current_block;
+unsigned int claim_the_writer(unsigned int fd, unsigned int file_descriptor) {
+    unsigned int writer = 0;
+    return __atomic_compare_exchange_n(&TFS_V(file_opens)[fd].writer, &writer, file_descriptor, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || writer == file_descriptor;
 }
 
-unsigned int tfs_write(unsigned int file_descriptor, char *buffer, unsigned int byte_count) {
-    // File descriptor validity check
-    if (tfs_is_fd_in_range(file_descriptor) ==  FALSE || tfs_is_fd_open(file_descriptor) == FALSE) {
-        return FALSE;
-    }
-
-    // initiallizing with the first block and inital offset
-    unsigned char block = directory[file_descriptor].first_block,
-                  current_block;
-    unsigned int written = 0,
-                 offset1 = directory[file_descriptor].byte_offset;
-
-    // New block driver
-    if (block == FREE) {
-        current_block = tfs_new_block();
-        if (current_block == LAST_BLOCK) { return -1; }
-        else{
-          // Update to newly allocated block
-          file_allocation_table[current_block] = LAST_BLOCK;
-          directory[file_descriptor].first_block = current_block;
-        }
-    } 
-    // Existing block driver
-    else {
-        // If the block isn't free then find the current block
-        current_block = block;
-        while (offset1 >= BLOCK_SIZE) {
-            offset1 -= BLOCK_SIZE;
-            // Allocate a new block only in the end of the FAT chain is reached
-            if (file_allocation_table[current_block] == LAST_BLOCK) {
-                unsigned char new_block = tfs_new_block();
-                if (new_block == LAST_BLOCK) { return -1; }
-                file_allocation_table[current_block] = new_block;
-                file_allocation_table[new_block] = LAST_BLOCK;
-            }
-            current_block = file_allocation_table[current_block];
+// Helper function to grow a file at its tail by count blocks, O(1) per extent thanks
+// to last_block; takes what it can get when the volume is nearly full
+
+unsigned int append_new_blocks(unsigned int fd, unsigned int count) {
+    unsigned int appended = 0, run, b;
+    while (appended < count) {
+        unsigned int first = tfs_new_extent(count - appended, &run);
+        if (first == 0) { break; }
+        if (TFS_V(directory)[fd].first_block == FREE) { TFS_V(directory)[fd].first_block = first; }
+        else { TFS_V(file_allocation_table)[TFS_V(directory)[fd].last_block] = first; }
+        // Reverse links for the defragmenter, the extent already linked its own blocks
+        TFS_V(block_prev)[first] = TFS_V(directory)[fd].last_block;
+        // Owners are stored atomically since the defragmenter peeks at them unlocked
+        for (b = first; b < first + run; b++) {
+            __atomic_store_n(&TFS_V(block_owner)[b], fd, __ATOMIC_RELAXED);
+            tfs_block_map_append(fd, b);
         }
+        TFS_V(directory)[fd].last_block = first + run - 1;
+        appended += run;
     }
+    return appended;
+}
+
+// The write loop for tfs_write() and tfs_pwrite(), from any offset up to the file size;
+// the caller is the writer and holds the file lock exclusively. Grows the file as needed
+// and hands back the block of the next byte, the opens are the caller's business
+
+unsigned int write_at_offset(unsigned int fd, unsigned long long offset, unsigned int current_block,
+                             char *buffer, unsigned int byte_count, unsigned int *end_block) {
+    // initiallizing with the offset inside the block
+    unsigned int old_last_block = TFS_V(directory)[fd].last_block;
+    unsigned int written = 0;
+    unsigned long long offset1 = offset % BLOCK_SIZE;
+    *end_block = current_block;
+
+    // Every block the write needs past the end of the file is allocated up front,
+    // as few extents as the free space allows
+    unsigned long long have = (TFS_V(directory)[fd].size + BLOCK_SIZE - 1) >> BLOCK_SIZE_AS_POWER_OF_2,
+                       need = (offset + byte_count + BLOCK_SIZE - 1) >> BLOCK_SIZE_AS_POWER_OF_2;
+    if (need > have) { append_new_blocks(fd, need - have); }
+
+    // Empty file (block 0) or offset just past a full last block (LAST_BLOCK):
+    // the write starts in the first block that was just appended, no chain walk needed
+    if (current_block == FREE) { current_block = TFS_V(directory)[fd].first_block; }
+    else if (current_block == LAST_BLOCK) { current_block = TFS_V(file_allocation_table)[old_last_block]; }
+    // Nothing could be appended, volume is full
+    if (current_block == FREE || current_block == LAST_BLOCK) { return 0; }
 
     // Relaying data to the blocks
     while (written < byte_count) {
-        unsigned char FAT_offset = offset1 % BLOCK_SIZE;
-        unsigned int space_in_block = BLOCK_SIZE - FAT_offset,
-                     to_write = (byte_count - written) < space_in_block ? (byte_count - written) : space_in_block;
-        char character_buff[BLOCK_SIZE];
-        tfs_block_read(current_block, character_buff);
-
-        // Memory copy
-        for (int i = 0; i < to_write; i++) { character_buff[FAT_offset + i] = buffer[written + i]; }
-        tfs_block_write(current_block, character_buff);
+        unsigned int FAT_offset = offset1, start_block = current_block;
+        unsigned long long to_write = (byte_count - written) < BLOCK_SIZE - FAT_offset ? (byte_count - written) : BLOCK_SIZE - FAT_offset;
+        // Ride the extent: keep going while the next block of the file is the next block in storage
+        while (to_write < byte_count - written && TFS_V(file_allocation_table)[current_block] == current_block + 1) {
+            current_block++;
+            to_write = (byte_count - written) < to_write + BLOCK_SIZE ? (byte_count - written) : to_write + BLOCK_SIZE;
+        }
+        // One copy for the whole span, straight from the user buffer; the rest of a
+        // partial block is left alone so there is never a read before the write
+        tfs_block_write_span(start_block, FAT_offset, buffer + written, to_write);
 
         // Update the written and offset counts
         written += to_write;
-        offset1 += to_write;
+        offset1 = FAT_offset + to_write - (unsigned long long)(current_block - start_block) * BLOCK_SIZE;
 
         // Logic for reading mid write, transition to next block iff need be
         if (offset1 >= BLOCK_SIZE) {
           offset1 -= BLOCK_SIZE;
-          // Ensure that there is a next block
-          if (written < byte_count) {
-              if (file_allocation_table[current_block] == LAST_BLOCK) {
-                  unsigned char new_block = tfs_new_block();
-                  if (new_block == LAST_BLOCK) { break; }
-                  file_allocation_table[current_block] = new_block;
-                  file_allocation_table[new_block] = LAST_BLOCK;
-              }
-          }
-          current_block = file_allocation_table[current_block];
+          // Ran out of blocks, volume full, the file now ends exactly at this block
+          if (written < byte_count && TFS_V(file_allocation_table)[current_block] == LAST_BLOCK) { current_block = LAST_BLOCK; break; }
+          current_block = TFS_V(file_allocation_table)[current_block];
         }        
     }
 
-    // Metadata update
-    update_the_offset(file_descriptor, written, current_block);
+    // Metadata update, the file only ever grows here
+    if (offset + written > TFS_V(directory)[fd].size) { TFS_V(directory)[fd].size = offset + written; }
+    *end_block = current_block;
+
+    return written;
+}
+
+unsigned int tfs_write(unsigned int file_descriptor, char *buffer, unsigned int byte_count) {
+    // File descriptor validity check
+    if (tfs_is_fd_in_range(file_descriptor) ==  FALSE || tfs_is_fd_open(file_descriptor) == FALSE) {
+        return FALSE;
+    }
+
+    struct open_file *open_file = tfs_open_file(file_descriptor);
+    unsigned int fd = open_file->fd, current_block;
+    if (!claim_the_writer(fd, file_descriptor)) { return 0; }
+
+    // Exclusive from here on, readers of this file wait but other files don't
+    pthread_rwlock_wrlock(&TFS_V(file_locks)[fd].rwlock);
+
+    // Write at the cursor, then move the cursor past what went in
+    unsigned int written = write_at_offset(fd, open_file->byte_offset, tfs_cursor_block(file_descriptor),
+                                           buffer, byte_count, &current_block);
+    open_file->byte_offset += written;
+    open_file->current_block = current_block;
+    pthread_rwlock_unlock(&TFS_V(file_locks)[fd].rwlock);
 
     return written;
 }
@@ -322,40 +458,57 @@ unsigned int tfs_write(unsigned int file_descriptor, char *buffer, unsigned int
  * return value is the number of bytes copied (0 in error cases)
  */
 
-unsigned int tfs_copy(char *from_name, char *to_name) {
+unsigned long long tfs_copy(char *from_name, char *to_name) {
+    // The directory lock covers the checks, the delete, the create and the opens (it's
+    // recursive, so the calls below can take it again); the copy itself runs without
+    // it, the two opens are enough to keep either file from being deleted midway
+    pthread_mutex_lock(&TFS_V(directory_lock));
+
     // Mapping the file names to file descriptors
     unsigned int from_fd = tfs_map_name_to_fd(from_name),
                  to_fd = tfs_map_name_to_fd(to_name);
 
     // Normal function error checking, particularly validating from the source file
-    if (from_fd == 0 || directory[from_fd].size == 0 || directory[from_fd].status != CLOSED) { return FALSE; }
-    if (to_fd != 0 && directory[to_fd].status != CLOSED) { return FALSE; }
+    if (from_fd == 0 || tfs_size(from_fd) == 0 || TFS_V(file_opens)[from_fd].count != 0) { pthread_mutex_unlock(&TFS_V(directory_lock)); return FALSE; }
+    if (to_fd != 0 && TFS_V(file_opens)[to_fd].count != 0) { pthread_mutex_unlock(&TFS_V(directory_lock)); return FALSE; }
     if (to_fd != 0) { tfs_delete(to_fd); }
 
-    // Creating and opening the dest file
+    // Creating and opening the dest file, and becoming its writer before anyone else can
     to_fd = tfs_create(to_name);
-    if (to_fd == 0 || from_fd == 0) { return FALSE; }
+    if (to_fd == 0 || from_fd == 0) { pthread_mutex_unlock(&TFS_V(directory_lock)); return FALSE; }
+    claim_the_writer(to_fd, to_fd);
     from_fd = tfs_open(from_name);
+    pthread_mutex_unlock(&TFS_V(directory_lock));
+
 
+    // One block at a time through the heap, blocks can be 64 KB and this may be a small thread stack
+    char *buffer = malloc(BLOCK_SIZE);
+    unsigned long long copied = 0;
+    unsigned int read, write;
 
-    char buffer[BLOCK_SIZE];
-    unsigned int copied = 0,
-                 read, write;
+    if (buffer == NULL) {
+        if (!tfs_delete(to_fd)) { tfs_close(to_fd); }
+        tfs_close(from_fd);
+        return 0;
+    }
 
     // Read from the source file and write to the destination file
     for (;(read = tfs_read(from_fd, buffer, BLOCK_SIZE)) > 0;) {
       write = tfs_write(to_fd, buffer, read);
       if (write != read) {
-          tfs_delete(to_fd); 
+          // Somebody else may have opened the partial copy by now, then it stays
+          if (!tfs_delete(to_fd)) { tfs_close(to_fd); }
           tfs_close(from_fd);
+          free(buffer);
           return 0;
       }
       copied += write;
     }
 
     // Close both files after done copying
+    free(buffer);
     tfs_close(from_fd);
     tfs_close(to_fd);
 
     return copied;
-}
\ No newline at end of file
+}